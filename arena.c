@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+
+/**
+ * Set up an empty arena; nothing is allocated until it is used
+ */
+void
+arenaInit(struct arena *ar, size_t chunksize)
+{
+	ar->ar_chunks = NULL;
+	ar->ar_chunksize = (chunksize > 0) ? chunksize : ARENA_CHUNKSIZE;
+	ar->ar_held = 0;
+}
+
+/**
+ * Add a chunk with room for at least nbytes in front of the others
+ */
+static struct arenaChunk *
+arenaGrow(struct arena *ar, size_t nbytes)
+{
+	struct arenaChunk *ac;
+	size_t size;
+
+	size = (nbytes > ar->ar_chunksize) ? nbytes : ar->ar_chunksize;
+	if (size > SIZE_MAX - sizeof(struct arenaChunk) - ARENA_MAXALIGN)
+		return NULL;
+	size = (size + ARENA_MAXALIGN - 1) & ~(size_t) (ARENA_MAXALIGN - 1);
+
+	ac = (struct arenaChunk *) aligned_alloc(ARENA_MAXALIGN,
+			sizeof(struct arenaChunk) + size);
+	if (ac == NULL)
+		return NULL;
+	ac->ac_next = ar->ar_chunks;
+	ac->ac_size = size;
+	ac->ac_used = 0;
+	ar->ar_chunks = ac;
+	ar->ar_held += sizeof(struct arenaChunk) + size;
+	return ac;
+}
+
+/**
+ * Make sure the next nbytes (in any alignment) can be handed out
+ * without another malloc, so that the caller's allocations share one
+ * chunk
+ */
+int
+arenaReserve(struct arena *ar, size_t nbytes)
+{
+	struct arenaChunk *ac = ar->ar_chunks;
+
+	if (ac != NULL && ac->ac_size - ac->ac_used >= nbytes)
+		return 0;
+	return (arenaGrow(ar, nbytes) == NULL) ? -1 : 0;
+}
+
+/**
+ * Hand out nbytes aligned to "align", a power of two no larger than
+ * ARENA_MAXALIGN (or 0 for the alignment malloc() would give)
+ */
+void *
+arenaAlloc(struct arena *ar, size_t nbytes, size_t align)
+{
+	struct arenaChunk *ac = ar->ar_chunks;
+	size_t offset;
+
+	if (align == 0)
+		align = sizeof(max_align_t);
+	if (align > ARENA_MAXALIGN || (align & (align - 1)) != 0)
+		return NULL;
+
+	if (ac != NULL) {
+		offset = (ac->ac_used + align - 1) & ~(align - 1);
+		if (offset <= ac->ac_size && nbytes <= ac->ac_size - offset) {
+			ac->ac_used = offset + nbytes;
+			return &ac->ac_data[offset];
+		}
+	}
+
+	/** chunks start on ARENA_MAXALIGN, so a new one needs no padding */
+	ac = arenaGrow(ar, nbytes);
+	if (ac == NULL)
+		return NULL;
+	ac->ac_used = nbytes;
+	return ac->ac_data;
+}
+
+/**
+ * Hand out zeroed room for nmemb items of "size" bytes
+ */
+void *
+arenaCalloc(struct arena *ar, size_t nmemb, size_t size)
+{
+	void *p;
+
+	if (size != 0 && nmemb > SIZE_MAX / size)
+		return NULL;
+	p = arenaAlloc(ar, nmemb * size, 0);
+	if (p != NULL)
+		memset(p, 0, nmemb * size);
+	return p;
+}
+
+/**
+ * Remember how far the arena has got, so that everything allocated
+ * after now can later be released with arenaRelease()
+ */
+void
+arenaGetMark(const struct arena *ar, struct arenaMark *am)
+{
+	am->am_chunk = ar->ar_chunks;
+	am->am_used = (ar->ar_chunks != NULL) ? ar->ar_chunks->ac_used : 0;
+}
+
+/**
+ * Give back everything allocated since the mark was taken, freeing
+ * any chunks made since
+ */
+void
+arenaRelease(struct arena *ar, const struct arenaMark *am)
+{
+	struct arenaChunk *ac;
+
+	while (ar->ar_chunks != NULL && ar->ar_chunks != am->am_chunk) {
+		ac = ar->ar_chunks;
+		ar->ar_chunks = ac->ac_next;
+		ar->ar_held -= sizeof(struct arenaChunk) + ac->ac_size;
+		free(ac);
+	}
+	if (ar->ar_chunks != NULL)
+		ar->ar_chunks->ac_used = am->am_used;
+}
+
+/**
+ * Give back everything, but keep the storage for reuse.  An arena
+ * which had to grow is folded into one chunk as large as all of its
+ * chunks together, so that the same pattern of use next time needs
+ * no malloc at all.
+ */
+void
+arenaReset(struct arena *ar)
+{
+	size_t size;
+
+	if (ar->ar_chunks == NULL)
+		return;
+	if (ar->ar_chunks->ac_next != NULL) {
+		size = ar->ar_held;
+		arenaFree(ar);
+		if (arenaGrow(ar, size) == NULL)
+			return;
+	}
+	ar->ar_chunks->ac_used = 0;
+}
+
+/**
+ * Free every chunk; the arena is left empty, and may be used again
+ */
+void
+arenaFree(struct arena *ar)
+{
+	struct arenaChunk *ac;
+
+	while ((ac = ar->ar_chunks) != NULL) {
+		ar->ar_chunks = ac->ac_next;
+		free(ac);
+	}
+	ar->ar_held = 0;
+}
+
+/**
+ * Return the bytes the arena is holding, used or not
+ */
+size_t
+arenaHeld(const struct arena *ar)
+{
+	return ar->ar_held;
+}
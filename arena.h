@@ -0,0 +1,52 @@
+#ifndef	__ARENA_HEADER__
+#define	__ARENA_HEADER__
+
+#include <stddef.h>
+
+/**
+ * A region allocator: storage is handed out from large chunks by
+ * moving a pointer along, and is only given back all at once (or
+ * back to a mark), so that things which live and die together cost
+ * a handful of mallocs between them rather than one each.
+ *
+ * An arena is not locked; whoever allocates from one must see to it
+ * that no one else is doing so at the same time.
+ */
+typedef struct arenaChunk {
+	struct arenaChunk *ac_next;	/* the chunk made before this one */
+	size_t ac_size;			/* bytes of ac_data */
+	size_t ac_used;			/* of which have been handed out */
+	char ac_data[] __attribute__((aligned(64)));
+} arenaChunk;
+
+typedef struct arena {
+	struct arenaChunk *ar_chunks;	/* newest chunk first */
+	size_t ar_chunksize;		/* least size of a new chunk */
+	size_t ar_held;			/* bytes malloc'ed for all chunks */
+} arena;
+
+/**
+ * A point in an arena's allocations, to be released back to
+ */
+typedef struct arenaMark {
+	struct arenaChunk *am_chunk;
+	size_t am_used;
+} arenaMark;
+
+/** default least size of a chunk */
+#define	ARENA_CHUNKSIZE		(16 * 1024)
+
+/** the most a single allocation may be aligned to */
+#define	ARENA_MAXALIGN		64
+
+void arenaInit(struct arena *ar, size_t chunksize);
+int arenaReserve(struct arena *ar, size_t nbytes);
+void *arenaAlloc(struct arena *ar, size_t nbytes, size_t align);
+void *arenaCalloc(struct arena *ar, size_t nmemb, size_t size);
+void arenaGetMark(const struct arena *ar, struct arenaMark *am);
+void arenaRelease(struct arena *ar, const struct arenaMark *am);
+void arenaReset(struct arena *ar);
+void arenaFree(struct arena *ar);
+size_t arenaHeld(const struct arena *ar);
+
+#endif /* __ARENA_HEADER__ */
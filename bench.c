@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fat12fs.h"
+
+/**
+ * A benchmark driver for the filesystem layer.  For each image named
+ * it times mounts, root directory lookups, sequential and random
+ * fat12fsReadData() calls, fat12fsVerifyEOF() sweeps and FAT dumps,
+ * and prints the throughput and latency percentiles of each.
+ *
+ * Random choices come from a fixed seed, so runs over the same image
+ * do the same work and can be compared against each other.
+ */
+
+#define	SEQ_CHUNK	4096	/* bytes per sequential read call */
+#define	RAND_READLEN	512	/* bytes per random read call */
+
+/**
+ * The latencies of one operation, in nanoseconds
+ */
+typedef struct benchSamples {
+	const char *bs_name;
+	double *bs_ns;
+	int bs_n;
+	int bs_cap;
+	double bs_bytes;	/* data moved, for the throughput figure */
+} benchSamples;
+
+static FILE *devNull;
+static unsigned int randState = 1;
+
+static unsigned int
+nextRandom(void)
+{
+	randState ^= randState << 13;
+	randState ^= randState >> 17;
+	randState ^= randState << 5;
+	return randState;
+}
+
+static double
+nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static void
+samplesInit(struct benchSamples *bs, const char *name)
+{
+	memset(bs, 0, sizeof(*bs));
+	bs->bs_name = name;
+}
+
+static void
+samplesAdd(struct benchSamples *bs, double ns)
+{
+	double *grown;
+
+	if (bs->bs_n == bs->bs_cap) {
+		bs->bs_cap = (bs->bs_cap == 0) ? 1024 : bs->bs_cap * 2;
+		grown = (double *) realloc(bs->bs_ns,
+				bs->bs_cap * sizeof(double));
+		if (grown == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		bs->bs_ns = grown;
+	}
+	bs->bs_ns[bs->bs_n++] = ns;
+}
+
+static int
+compareDouble(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+static double
+percentile(const struct benchSamples *bs, double pct)
+{
+	int i = (int) (pct / 100.0 * (bs->bs_n - 1) + 0.5);
+
+	return bs->bs_ns[i];
+}
+
+/**
+ * Print one line of results, and release the samples
+ */
+static void
+samplesReport(struct benchSamples *bs)
+{
+	double total = 0;
+	int i;
+
+	if (bs->bs_n == 0) {
+		printf("  %-10s %8s\n", bs->bs_name, "(none)");
+		return;
+	}
+
+	for (i = 0; i < bs->bs_n; i++)
+		total += bs->bs_ns[i];
+	qsort(bs->bs_ns, bs->bs_n, sizeof(double), compareDouble);
+
+	printf("  %-10s %8d %12.0f", bs->bs_name, bs->bs_n,
+			bs->bs_n / (total / 1e9));
+	if (bs->bs_bytes > 0)
+		printf(" %9.1f", (bs->bs_bytes / (1024.0 * 1024.0))
+				/ (total / 1e9));
+	else
+		printf(" %9s", "-");
+	printf(" %9.2f %9.2f %9.2f %9.2f\n",
+			percentile(bs, 50) / 1e3, percentile(bs, 90) / 1e3,
+			percentile(bs, 99) / 1e3, bs->bs_ns[bs->bs_n - 1] / 1e3);
+
+	free(bs->bs_ns);
+	bs->bs_ns = NULL;
+}
+
+/**
+ * Build the name fat12fsSearchRootdir() expects from a rootdir entry
+ */
+static void
+entryName(const struct fat12fs_DIRENTRY *de, char *name)
+{
+	int i, n = 0;
+
+	for (i = 0; i < 8 && de->de_name[i] != ' '; i++)
+		name[n++] = de->de_name[i];
+	if (de->de_nameext[0] != ' ') {
+		name[n++] = '.';
+		for (i = 0; i < 3 && de->de_nameext[i] != ' '; i++)
+			name[n++] = de->de_nameext[i];
+	}
+	name[n] = '\0';
+}
+
+/**
+ * Run every benchmark against one image
+ */
+static int
+benchImage(const char *image, const struct fat12fs_options *opts, int reps)
+{
+	struct benchSamples bs;
+	struct fat12fs *fs;
+	char (*names)[13];
+	int *sizes;
+	char *buffer;
+	double t;
+	int nfiles, maxSize;
+	int r, i, f, pos;
+
+	fs = fat12fsMountOpts(image, opts);
+	if (fs == NULL) {
+		fprintf(stderr, "Cannot mount filesystem in '%s'\n", image);
+		return (-1);
+	}
+
+	/** gather up the files to work on */
+	names = malloc(fs->fs_rootdirsize * sizeof(*names));
+	sizes = (int *) malloc(fs->fs_rootdirsize * sizeof(int));
+	if (names == NULL || sizes == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return (-1);
+	}
+	nfiles = 0;
+	maxSize = RAND_READLEN;
+	for (i = 0; i < fs->fs_rootdirsize; i++) {
+		const struct fat12fs_DIRENTRY *de = &fs->fs_rootdirentry[i];
+
+		if (de->de_name[0] == 0x00 || de->de_name[0] == 0xe5
+				|| (de->de_attributes & 0x18))
+			continue;
+		entryName(de, names[nfiles]);
+		sizes[nfiles] = (int) de->de_filelen;
+		if (sizes[nfiles] > maxSize)
+			maxSize = sizes[nfiles];
+		nfiles++;
+	}
+	buffer = (char *) malloc(maxSize);
+	if (buffer == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return (-1);
+	}
+
+	printf("%s: %d files, %d reps\n", image, nfiles, reps);
+	printf("  %-10s %8s %12s %9s %9s %9s %9s %9s\n", "op", "count",
+			"ops/s", "MB/s", "p50 us", "p90 us", "p99 us",
+			"max us");
+
+	samplesInit(&bs, "mount");
+	for (r = 0; r < reps; r++) {
+		struct fat12fs *m;
+
+		t = nowNs();
+		m = fat12fsMountOpts(image, opts);
+		if (m != NULL)
+			fat12fsUmount(m);
+		samplesAdd(&bs, nowNs() - t);
+	}
+	samplesReport(&bs);
+
+	samplesInit(&bs, "lookup");
+	for (r = 0; r < reps; r++) {
+		for (f = 0; f < nfiles; f++) {
+			t = nowNs();
+			(void) fat12fsSearchRootdir(fs, names[f]);
+			samplesAdd(&bs, nowNs() - t);
+		}
+	}
+	samplesReport(&bs);
+
+	/** whole files, front to back, a chunk per call */
+	samplesInit(&bs, "seqread");
+	for (r = 0; r < reps; r++) {
+		for (f = 0; f < nfiles; f++) {
+			for (pos = 0; pos < sizes[f]; pos += SEQ_CHUNK) {
+				t = nowNs();
+				i = fat12fsReadData(fs, buffer, names[f],
+						pos, SEQ_CHUNK);
+				samplesAdd(&bs, nowNs() - t);
+				if (i > 0)
+					bs.bs_bytes += i;
+			}
+		}
+	}
+	samplesReport(&bs);
+
+	/** short reads at random places in random files */
+	samplesInit(&bs, "randread");
+	for (r = 0; r < reps * 64 && nfiles > 0; r++) {
+		f = (int) (nextRandom() % nfiles);
+		pos = (sizes[f] > RAND_READLEN)
+			? (int) (nextRandom() % (sizes[f] - RAND_READLEN)) : 0;
+		t = nowNs();
+		i = fat12fsReadData(fs, buffer, names[f], pos, RAND_READLEN);
+		samplesAdd(&bs, nowNs() - t);
+		if (i > 0)
+			bs.bs_bytes += i;
+	}
+	samplesReport(&bs);
+
+	samplesInit(&bs, "verify");
+	for (r = 0; r < reps; r++) {
+		for (i = 0; i < fs->fs_rootdirsize; i++) {
+			t = nowNs();
+			(void) fat12fsVerifyEOF(fs, i);
+			samplesAdd(&bs, nowNs() - t);
+		}
+	}
+	samplesReport(&bs);
+
+	samplesInit(&bs, "dumpfat");
+	for (r = 0; r < reps; r++) {
+		t = nowNs();
+		(void) fat12fsDumpFat(devNull, fs);
+		samplesAdd(&bs, nowNs() - t);
+	}
+	samplesReport(&bs);
+	printf("\n");
+
+	free(buffer);
+	free(sizes);
+	free(names);
+	fat12fsUmount(fs);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct fat12fs_options opts;
+	int reps = 100;
+	int failed = 0;
+	int i;
+
+	devNull = fopen("/dev/null", "w");
+	if (devNull == NULL) {
+		fprintf(stderr, "Cannot open /dev/null\n");
+		return (-1);
+	}
+
+	fat12fsDefaultOptions(&opts);
+	opts.mo_logfp = devNull;
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] == '-') {
+			if (argv[i][1] == 'm') {
+				opts.mo_flags |= FAT12FS_MOUNT_MAPPED;
+			} else if (argv[i][1] == 'U') {
+				opts.mo_flags |= FAT12FS_MOUNT_URING;
+			} else if (argv[i][1] == 'L') {
+				opts.mo_flags |= FAT12FS_MOUNT_LAZY;
+			} else if (argv[i][1] == 'C' && i + 1 < argc) {
+				opts.mo_cacheblocks = atoi(argv[++i]);
+			} else if (argv[i][1] == 'R' && i + 1 < argc) {
+				opts.mo_readahead = atoi(argv[++i]);
+			} else if (argv[i][1] == 'r' && i + 1 < argc) {
+				reps = atoi(argv[++i]);
+			} else {
+				fprintf(stderr, "Usage:\n");
+				fprintf(stderr, "  %s [-m] [-U] [-L] [-C blocks]"
+					" [-R blocks] [-r reps] image ...\n", argv[0]);
+				return (-1);
+			}
+		} else if (benchImage(argv[i], &opts, reps) < 0) {
+			failed = 1;
+		}
+	}
+
+	return failed;
+}
@@ -0,0 +1,468 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "blockdev.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define	BLOCKDEV_HAVE_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#if FAT12FS_STATS
+#define	BLOCKDEV_COUNT(bd, field, n)	\
+		((void) __atomic_fetch_add(&(bd)->bd_stats.field, (n), \
+			__ATOMIC_RELAXED))
+#else
+#define	BLOCKDEV_COUNT(bd, field, n)	((void) 0)
+#endif
+
+
+/**
+ * pread(2) exactly nbytes at the given offset, retrying on short
+ * reads; running off the end of the device is an error
+ */
+static int
+blockDevicePreadFull(struct blockDevice *bd,
+		char *buffer, size_t nbytes, off_t offset)
+{
+	ssize_t status;
+	size_t done = 0;
+
+	BLOCKDEV_COUNT(bd, bs_reads, 1);
+	while (done < nbytes) {
+		BLOCKDEV_COUNT(bd, bs_syscalls, 1);
+		status = pread(bd->bd_fd, buffer + done, nbytes - done,
+				offset + (off_t) done);
+		if (status < 0 && errno == EINTR)
+			continue;
+		if (status <= 0)
+			return (-1);
+		done += (size_t) status;
+		BLOCKDEV_COUNT(bd, bs_bytes, status);
+	}
+	return 0;
+}
+
+
+/**
+ * The pread backend: serve the batch one request after another
+ */
+static int
+preadReadBatch(struct blockDevice *bd, struct blockRequest *reqs, int nreqs)
+{
+	int i;
+
+	for (i = 0; i < nreqs; i++) {
+		if (blockDevicePreadFull(bd, reqs[i].br_buf,
+				reqs[i].br_len, reqs[i].br_offset) < 0)
+			return (-1);
+	}
+	return 0;
+}
+
+static void
+preadClose(struct blockDevice *bd)
+{
+	(void) bd;
+}
+
+static const struct blockDeviceOps preadOps = {
+	"pread",
+	preadReadBatch,
+	preadClose
+};
+
+
+#ifdef BLOCKDEV_HAVE_URING
+
+/**
+ * An io_uring instance, set up with raw system calls so that no
+ * library is needed: the submission queue ring and its SQE array,
+ * and the completion queue ring, all mapped from the kernel.  A ring
+ * has one submitter at a time, so threads sharing the device take
+ * turns with whole batches.
+ */
+typedef struct uringState {
+	pthread_mutex_t ur_lock;
+	int ur_fd;
+	unsigned int ur_entries;
+
+	void *ur_sqring;
+	size_t ur_sqringsize;
+	void *ur_cqring;		/* the same as ur_sqring if shared */
+	size_t ur_cqringsize;
+	struct io_uring_sqe *ur_sqes;
+	size_t ur_sqessize;
+
+	unsigned int *ur_sqtail;
+	unsigned int *ur_sqmask;
+	unsigned int *ur_sqarray;
+	unsigned int *ur_cqhead;
+	unsigned int *ur_cqtail;
+	unsigned int *ur_cqmask;
+	struct io_uring_cqe *ur_cqes;
+} uringState;
+
+
+static void
+uringTeardown(struct uringState *ur)
+{
+	if (ur->ur_sqes != NULL && ur->ur_sqes != MAP_FAILED)
+		munmap(ur->ur_sqes, ur->ur_sqessize);
+	if (ur->ur_cqring != NULL && ur->ur_cqring != MAP_FAILED
+			&& ur->ur_cqring != ur->ur_sqring)
+		munmap(ur->ur_cqring, ur->ur_cqringsize);
+	if (ur->ur_sqring != NULL && ur->ur_sqring != MAP_FAILED)
+		munmap(ur->ur_sqring, ur->ur_sqringsize);
+	if (ur->ur_fd >= 0)
+		close(ur->ur_fd);
+	pthread_mutex_destroy(&ur->ur_lock);
+	free(ur);
+}
+
+
+/**
+ * Create a ring of (at least) the given depth, or return NULL if
+ * this kernel will not give us one we can use
+ */
+static struct uringState *
+uringSetup(unsigned int depth)
+{
+	struct io_uring_params p;
+	struct uringState *ur;
+	char *sq, *cq;
+
+	ur = (struct uringState *) calloc(1, sizeof(struct uringState));
+	if (ur == NULL)
+		return NULL;
+	pthread_mutex_init(&ur->ur_lock, NULL);
+
+	memset(&p, 0, sizeof(p));
+	ur->ur_fd = (int) syscall(__NR_io_uring_setup, depth, &p);
+	if (ur->ur_fd < 0) {
+		pthread_mutex_destroy(&ur->ur_lock);
+		free(ur);
+		return NULL;
+	}
+
+	/** IORING_OP_READ arrived along with this feature */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		uringTeardown(ur);
+		return NULL;
+	}
+
+	ur->ur_entries = p.sq_entries;
+	ur->ur_sqringsize = p.sq_off.array
+			+ p.sq_entries * sizeof(unsigned int);
+	ur->ur_cqringsize = p.cq_off.cqes
+			+ p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->ur_cqringsize > ur->ur_sqringsize)
+			ur->ur_sqringsize = ur->ur_cqringsize;
+		ur->ur_cqringsize = ur->ur_sqringsize;
+	}
+
+	ur->ur_sqring = mmap(NULL, ur->ur_sqringsize,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ur->ur_fd, IORING_OFF_SQ_RING);
+	if (ur->ur_sqring == MAP_FAILED) {
+		uringTeardown(ur);
+		return NULL;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->ur_cqring = ur->ur_sqring;
+	} else {
+		ur->ur_cqring = mmap(NULL, ur->ur_cqringsize,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE,
+				ur->ur_fd, IORING_OFF_CQ_RING);
+		if (ur->ur_cqring == MAP_FAILED) {
+			uringTeardown(ur);
+			return NULL;
+		}
+	}
+
+	ur->ur_sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->ur_sqes = (struct io_uring_sqe *) mmap(NULL, ur->ur_sqessize,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ur->ur_fd, IORING_OFF_SQES);
+	if (ur->ur_sqes == MAP_FAILED) {
+		uringTeardown(ur);
+		return NULL;
+	}
+
+	sq = (char *) ur->ur_sqring;
+	cq = (char *) ur->ur_cqring;
+	ur->ur_sqtail = (unsigned int *) (sq + p.sq_off.tail);
+	ur->ur_sqmask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	ur->ur_sqarray = (unsigned int *) (sq + p.sq_off.array);
+	ur->ur_cqhead = (unsigned int *) (cq + p.cq_off.head);
+	ur->ur_cqtail = (unsigned int *) (cq + p.cq_off.tail);
+	ur->ur_cqmask = (unsigned int *) (cq + p.cq_off.ring_mask);
+	ur->ur_cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	return ur;
+}
+
+
+/**
+ * Put a read for the given request on the submission queue; it is
+ * not seen by the kernel until the next io_uring_enter()
+ */
+static void
+uringQueueRead(struct uringState *ur, int fd,
+		const struct blockRequest *req, int index)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, slot;
+
+	tail = *ur->ur_sqtail;
+	slot = tail & *ur->ur_sqmask;
+	sqe = &ur->ur_sqes[slot];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) req->br_buf;
+	sqe->len = (unsigned int) req->br_len;
+	sqe->off = (unsigned long long) req->br_offset;
+	sqe->user_data = (unsigned long long) index;
+
+	ur->ur_sqarray[slot] = slot;
+	__atomic_store_n(ur->ur_sqtail, tail + 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * The io_uring backend: keep up to the queue depth of the batch in
+ * flight, topping the queue up as completions come back in whatever
+ * order the device finishes them.  Each completion lands directly in
+ * its request's buffer; a short read is requeued for the remainder.
+ *
+ * On an error, nothing more is queued, but whatever is in flight is
+ * still reaped before returning, since the kernel may yet write into
+ * those buffers.
+ */
+static int
+uringReadBatchLocked(struct blockDevice *bd,
+		struct blockRequest *reqs, int nreqs)
+{
+	struct uringState *ur = (struct uringState *) bd->bd_private;
+	struct io_uring_cqe *cqe;
+	struct blockRequest *req;
+	unsigned int head, tail;
+	unsigned int depth;
+	int next = 0, inflight = 0, toSubmit = 0;
+	int failed = 0;
+	int status;
+
+	depth = ur->ur_entries;
+	if (bd->bd_qdepth > 0 && (unsigned int) bd->bd_qdepth < depth)
+		depth = (unsigned int) bd->bd_qdepth;
+
+	while ((!failed && next < nreqs) || inflight > 0) {
+		while (!failed && next < nreqs
+				&& (unsigned int) inflight < depth) {
+			if (reqs[next].br_len > 0) {
+				BLOCKDEV_COUNT(bd, bs_reads, 1);
+				uringQueueRead(ur, bd->bd_fd, &reqs[next], next);
+				inflight++;
+				toSubmit++;
+			}
+			next++;
+		}
+		if (inflight == 0)
+			break;
+
+		BLOCKDEV_COUNT(bd, bs_syscalls, 1);
+		status = (int) syscall(__NR_io_uring_enter, ur->ur_fd,
+				toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (status < 0) {
+			if (errno == EINTR || errno == EAGAIN
+					|| errno == EBUSY)
+				continue;
+			/** the ring is unusable; nothing more will come */
+			return (-1);
+		}
+		toSubmit -= status;
+
+		head = *ur->ur_cqhead;
+		tail = __atomic_load_n(ur->ur_cqtail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &ur->ur_cqes[head & *ur->ur_cqmask];
+			req = &reqs[cqe->user_data];
+			inflight--;
+
+			if (cqe->res <= 0) {
+				failed = 1;
+				continue;
+			}
+			BLOCKDEV_COUNT(bd, bs_bytes, cqe->res);
+			req->br_buf += cqe->res;
+			req->br_offset += cqe->res;
+			req->br_len -= (size_t) cqe->res;
+			if (req->br_len > 0 && !failed) {
+				uringQueueRead(ur, bd->bd_fd, req,
+						(int) cqe->user_data);
+				inflight++;
+				toSubmit++;
+			}
+		}
+		__atomic_store_n(ur->ur_cqhead, head, __ATOMIC_RELEASE);
+	}
+
+	return failed ? -1 : 0;
+}
+
+static int
+uringReadBatch(struct blockDevice *bd, struct blockRequest *reqs, int nreqs)
+{
+	struct uringState *ur = (struct uringState *) bd->bd_private;
+	int status;
+
+	pthread_mutex_lock(&ur->ur_lock);
+	status = uringReadBatchLocked(bd, reqs, nreqs);
+	pthread_mutex_unlock(&ur->ur_lock);
+	return status;
+}
+
+static void
+uringClose(struct blockDevice *bd)
+{
+	uringTeardown((struct uringState *) bd->bd_private);
+}
+
+static const struct blockDeviceOps uringOps = {
+	"io_uring",
+	uringReadBatch,
+	uringClose
+};
+
+#endif /* BLOCKDEV_HAVE_URING */
+
+
+/**
+ * Set up reads of the descriptor through the given backend, keeping
+ * up to qdepth reads in flight (0 for BLOCKDEV_QUEUEDEPTH) where the
+ * backend queues.  A backend which is unavailable here falls back to
+ * plain pread(2).
+ */
+struct blockDevice *
+blockDeviceOpen(int fd, int kind, int qdepth)
+{
+	struct blockDevice *bd;
+
+	bd = (struct blockDevice *) malloc(sizeof(struct blockDevice));
+	if (bd == NULL)
+		return NULL;
+
+	bd->bd_fd = fd;
+	bd->bd_qdepth = (qdepth > 0) ? qdepth : BLOCKDEV_QUEUEDEPTH;
+	bd->bd_ops = &preadOps;
+	bd->bd_private = NULL;
+	blockDeviceResetStats(bd);
+
+#ifdef BLOCKDEV_HAVE_URING
+	if (kind == BLOCKDEV_URING) {
+		bd->bd_private = uringSetup((unsigned int) bd->bd_qdepth);
+		if (bd->bd_private != NULL)
+			bd->bd_ops = &uringOps;
+	}
+#endif
+
+	return bd;
+}
+
+
+/**
+ * Release a block device and its backend state
+ */
+void
+blockDeviceClose(struct blockDevice *bd)
+{
+	if (bd != NULL) {
+		bd->bd_ops->bo_close(bd);
+		free(bd);
+	}
+}
+
+
+/**
+ * Start the device's counters again from zero
+ */
+void
+blockDeviceResetStats(struct blockDevice *bd)
+{
+	memset(&bd->bd_stats, 0, sizeof(bd->bd_stats));
+}
+
+
+/**
+ * Name the backend actually in use
+ */
+const char *
+blockDeviceName(const struct blockDevice *bd)
+{
+	return bd->bd_ops->bo_name;
+}
+
+
+/**
+ * Read exactly nbytes at the given byte offset.  Single reads gain
+ * nothing from a queue, so they always go straight to pread(2).
+ */
+int
+blockDeviceRead(struct blockDevice *bd,
+		char *buffer, size_t nbytes, off_t offset)
+{
+	return blockDevicePreadFull(bd, buffer, nbytes, offset);
+}
+
+
+/**
+ * Deliver every request of the batch in full, in any order, or
+ * return (-1).  The requests are consumed by the read.
+ */
+int
+blockDeviceReadBatch(struct blockDevice *bd,
+		struct blockRequest *reqs, int nreqs)
+{
+	if (nreqs <= 0)
+		return 0;
+	if (nreqs == 1)
+		return blockDevicePreadFull(bd, reqs[0].br_buf,
+				reqs[0].br_len, reqs[0].br_offset);
+	BLOCKDEV_COUNT(bd, bs_batches, 1);
+	return bd->bd_ops->bo_readbatch(bd, reqs, nreqs);
+}
+
+
+/**
+ * Tell the kernel that the given range will be read soon, so it can
+ * start bringing it into the page cache while the caller gets on
+ * with something else.  This never blocks on the data itself.
+ */
+int
+blockDeviceWillNeed(struct blockDevice *bd, off_t offset, size_t nbytes)
+{
+#ifdef POSIX_FADV_WILLNEED
+	if (posix_fadvise(bd->bd_fd, offset, (off_t) nbytes,
+			POSIX_FADV_WILLNEED) != 0)
+		return (-1);
+	return 0;
+#else
+	(void) bd;
+	(void) offset;
+	(void) nbytes;
+	return 0;
+#endif
+}
@@ -0,0 +1,79 @@
+#ifndef	__BLOCKDEV_HEADER__
+#define	__BLOCKDEV_HEADER__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/** the ways a block device can be driven */
+#define	BLOCKDEV_PREAD		0	/* blocking pread(2), one at a time */
+#define	BLOCKDEV_URING		1	/* io_uring, a whole batch in flight */
+
+/**
+ * Counters are kept unless this is defined to 0, in which case the
+ * counting compiles away to nothing
+ */
+#ifndef	FAT12FS_STATS
+#define	FAT12FS_STATS		1
+#endif
+
+/** default number of reads kept in flight by a queued backend */
+#define	BLOCKDEV_QUEUEDEPTH	32
+
+/**
+ * One read of br_len bytes at byte br_offset of the device.  A batch
+ * read may consume the request as it goes, advancing br_buf and
+ * br_offset past data already delivered.
+ */
+typedef struct blockRequest {
+	char *br_buf;
+	size_t br_len;
+	off_t br_offset;
+} blockRequest;
+
+/**
+ * Work done by a block device since it was opened
+ */
+typedef struct blockDeviceStats {
+	unsigned long bs_reads;		/* reads asked of the device */
+	unsigned long bs_syscalls;	/* system calls they took */
+	unsigned long bs_bytes;		/* bytes delivered */
+	unsigned long bs_batches;	/* batches handed to the backend */
+} blockDeviceStats;
+
+struct blockDevice;
+
+/**
+ * What a backend provides: a batch read, which must deliver every
+ * request in full or fail, and a close for its private state
+ */
+typedef struct blockDeviceOps {
+	const char *bo_name;
+	int (*bo_readbatch)(struct blockDevice *bd,
+			struct blockRequest *reqs, int nreqs);
+	void (*bo_close)(struct blockDevice *bd);
+} blockDeviceOps;
+
+/**
+ * A device (in practice, an image file) read through some backend.
+ * The descriptor belongs to the caller, and is not closed here.
+ */
+typedef struct blockDevice {
+	int bd_fd;
+	int bd_qdepth;		/* reads a queued backend keeps in flight */
+	const struct blockDeviceOps *bd_ops;
+	void *bd_private;	/* backend state */
+	struct blockDeviceStats bd_stats;
+} blockDevice;
+
+struct blockDevice *blockDeviceOpen(int fd, int kind, int qdepth);
+void blockDeviceClose(struct blockDevice *bd);
+const char *blockDeviceName(const struct blockDevice *bd);
+
+int blockDeviceRead(struct blockDevice *bd,
+		char *buffer, size_t nbytes, off_t offset);
+int blockDeviceReadBatch(struct blockDevice *bd,
+		struct blockRequest *reqs, int nreqs);
+int blockDeviceWillNeed(struct blockDevice *bd, off_t offset, size_t nbytes);
+void blockDeviceResetStats(struct blockDevice *bd);
+
+#endif /* __BLOCKDEV_HEADER__ */
@@ -2,229 +2,990 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdarg.h>
+#include <limits.h>
 
 #include "commands.h"
 #include "fat12fs.h"
+#include "outbuf.h"
+#include "lathist.h"
 
 #define	COMMANDLINE_LEN	80
 #define MAXTOKENS 4
 #define DELIMITERLIST " \t\n"
 
+#define	OUTPUT_BUFSIZE	(64 * 1024)
+
 #define	BASE_16		0
 #define	BASE_10		1
 
+#define	TRACE_LINELEN	1024
+#define	TRACE_NCMDS	128
+
+/**
+ * Timing for a session: a histogram for each command letter, made
+ * the first time the letter is run, and the clock and counters as
+ * they stood when the command in progress began
+ */
+typedef struct commandTrace {
+	struct latHist *ct_hist[TRACE_NCMDS];
+	unsigned long ct_seq;
+	struct timespec ct_start;
+	struct fat12fs_stats ct_stats;
+	int ct_havestats;
+} commandTrace;
+
+/**
+ * Print the filesystem's counters, with the ratio of bytes read
+ * from the device to bytes handed back from files
+ */
+static void
+printStats(FILE *ofp, struct fat12fs *fs)
+{
+	struct fat12fs_stats st;
+
+	if (fat12fsGetStats(fs, &st) < 0) {
+		fprintf(ofp, "Statistics were not compiled in\n");
+		return;
+	}
+
+	fprintf(ofp, "Filesystem statistics:\n");
+	fprintf(ofp, "   device reads: %lu (%lu syscalls, %lu batches)\n",
+		st.st_devreads, st.st_syscalls, st.st_batches);
+	fprintf(ofp, "   device bytes: %lu\n", st.st_devbytes);
+	fprintf(ofp, "     file bytes: %lu\n", st.st_filebytes);
+	if (st.st_filebytes > 0)
+		fprintf(ofp, "  amplification: %.2f\n",
+			(double) st.st_devbytes / (double) st.st_filebytes);
+	fprintf(ofp, "     cache hits: %lu (%lu misses)\n",
+		st.st_cachehits, st.st_cachemisses);
+	fprintf(ofp, "     prefetches: %lu (%lu bytes)\n",
+		st.st_prefetches, st.st_prefetchbytes);
+	fprintf(ofp, "    FAT lookups: %lu\n", st.st_fatlookups);
+	fprintf(ofp, "   dir searches: %lu (%lu probes)\n",
+		st.st_dirsearches, st.st_dirprobes);
+	fprintf(ofp, "    dentry hits: %lu (%lu misses)\n",
+		st.st_dentryhits, st.st_dentrymisses);
+	if (st.st_filewrites > 0 || st.st_metawrites > 0)
+		fprintf(ofp, "    file writes: %lu bytes (%lu data, %lu"
+				" metadata writes)\n",
+			st.st_filewrites, st.st_datawrites, st.st_metawrites);
+}
+
+/**
+ * Print nBytes of a file starting at "start", as printBuffer() always
+ * has, but reading the file through a chunk-sized buffer so that
+ * memory use does not depend on the size of the request.  The
+ * escaped text is gathered in the session's output buffer.
+ *
+ * Only "valid" bytes come from the file; anything asked for beyond
+ * that prints as the zero bytes the old whole-request buffer held.
+ */
 static int
-printBuffer(FILE *ofp, char *filename, int start, int nBytes, char *buffer)
+printFileRange(struct outBuffer *ob, struct fat12fs_file *fh, char *filename,
+		int start, int valid, int nBytes,
+		char *chunk, int chunkSize)
 {
-	int i;
+	static const char zeros[256];
+	int done, n;
 
-	fprintf(ofp, "File '%s' %x bytes beginning at %x\n",
+	outBufferPrintf(ob, "File '%s' %x bytes beginning at %x\n",
 		filename, nBytes, start);
 
-	for (i = 0; i < nBytes; i++) {
-		if (isprint(buffer[i]) || buffer[i] == '\n') {
-			fputc(buffer[i], ofp);
+	for (done = 0; done < valid; done += n) {
+		n = valid - done;
+		if (n > chunkSize)
+			n = chunkSize;
+		if (fat12fsPread(fh, chunk, n, start + done) != n)
+			return (-1);
+		outBufferPutEscaped(ob, chunk, n);
+	}
+
+	for (; done < nBytes; done += n) {
+		n = nBytes - done;
+		if (n > (int) sizeof(zeros))
+			n = (int) sizeof(zeros);
+		outBufferPutEscaped(ob, zeros, n);
+	}
+
+	outBufferPut(ob, "\n", 1);
+	return 0;
+}
+
+static unsigned long long
+timespecNs(const struct timespec *ts)
+{
+	return (unsigned long long) ts->tv_sec * 1000000000ULL
+			+ (unsigned long long) ts->tv_nsec;
+}
+
+/**
+ * Put s into the trace line as a quoted JSON string, escaping what
+ * needs it; returns the new length of the line, which is never
+ * allowed to reach size
+ */
+static int
+traceString(char *line, int len, int size, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
+
+	if (len + 2 >= size)
+		return len;
+	line[len++] = '"';
+	for (; (c = (unsigned char) *s) != '\0'; s++) {
+		if (len + 8 >= size)
+			break;
+		if (c == '"' || c == '\\') {
+			line[len++] = '\\';
+			line[len++] = (char) c;
+		} else if (c < 0x20 || c >= 0x7f) {
+			line[len++] = '\\';
+			line[len++] = 'u';
+			line[len++] = '0';
+			line[len++] = '0';
+			line[len++] = hex[c >> 4];
+			line[len++] = hex[c & 0xf];
 		} else {
-			fprintf(ofp, "\\%03o", (char) buffer[i]);
+			line[len++] = (char) c;
 		}
 	}
+	line[len++] = '"';
+	line[len] = '\0';
+	return len;
+}
 
-	fprintf(ofp, "\n");
-	return 0;
+/**
+ * Add formatted text to the trace line, as much as fits
+ */
+static int
+tracePrintf(char *line, int len, int size, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(line + len, size - len, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return len;
+	return (len + n >= size) ? size - 1 : len + n;
+}
+
+static void
+traceBegin(struct commandTrace *ct, struct fat12fs *fs)
+{
+	ct->ct_havestats = (fat12fsGetStats(fs, &ct->ct_stats) == 0);
+	clock_gettime(CLOCK_MONOTONIC, &ct->ct_start);
+}
+
+/**
+ * Finish timing a command: add it to the histogram for its letter,
+ * and write its trace line, with the work it did taken from the
+ * change in the filesystem's counters.  Each line goes out in a
+ * single write, so sessions sharing a trace stream do not interleave.
+ */
+static void
+traceEnd(struct commandTrace *ct, struct fat12fs *fs,
+		const struct commandConfig *cfg,
+		char **tokenList, int tokenIndex)
+{
+	struct timespec now;
+	struct fat12fs_stats st;
+	struct latHist *lh;
+	char line[TRACE_LINELEN];
+	unsigned long long ns;
+	unsigned long devbytes;
+	int cmd, len, i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = timespecNs(&now) - timespecNs(&ct->ct_start);
+	ct->ct_seq++;
+
+	cmd = (unsigned char) tokenList[0][0] % TRACE_NCMDS;
+	if (cfg->cc_histograms) {
+		lh = ct->ct_hist[cmd];
+		if (lh == NULL) {
+			lh = (struct latHist *) malloc(sizeof(struct latHist));
+			if (lh != NULL)
+				latHistInit(lh);
+			ct->ct_hist[cmd] = lh;
+		}
+		if (lh != NULL)
+			latHistRecord(lh, ns);
+	}
+
+	if (cfg->cc_tracefp == NULL)
+		return;
+
+	len = tracePrintf(line, 0, sizeof(line), "{\"seq\":%lu", ct->ct_seq);
+	if (cfg->cc_traceName != NULL) {
+		len = tracePrintf(line, len, sizeof(line), ",\"image\":");
+		len = traceString(line, len, sizeof(line), cfg->cc_traceName);
+	}
+	len = tracePrintf(line, len, sizeof(line), ",\"cmd\":");
+	len = traceString(line, len, sizeof(line), tokenList[0]);
+	len = tracePrintf(line, len, sizeof(line), ",\"args\":[");
+	for (i = 1; i < tokenIndex; i++) {
+		if (i > 1)
+			len = tracePrintf(line, len, sizeof(line), ",");
+		len = traceString(line, len, sizeof(line), tokenList[i]);
+	}
+	len = tracePrintf(line, len, sizeof(line),
+			"],\"start_ns\":%llu,\"dur_ns\":%llu",
+			timespecNs(&ct->ct_start), ns);
+
+	/** blocks (sectors) touched are those read in, plus those cached */
+	if (ct->ct_havestats && fat12fsGetStats(fs, &st) == 0) {
+		devbytes = st.st_devbytes - ct->ct_stats.st_devbytes;
+		len = tracePrintf(line, len, sizeof(line),
+			",\"file_bytes\":%lu,\"dev_bytes\":%lu"
+			",\"dev_reads\":%lu,\"blocks\":%lu"
+			",\"cache_hits\":%lu,\"cache_misses\":%lu"
+			",\"fat_lookups\":%lu",
+			st.st_filebytes - ct->ct_stats.st_filebytes,
+			devbytes,
+			st.st_devreads - ct->ct_stats.st_devreads,
+			devbytes / FS_BLKSIZE
+				+ (st.st_cachehits - ct->ct_stats.st_cachehits)
+					* fs->fs_clustersectors,
+			st.st_cachehits - ct->ct_stats.st_cachehits,
+			st.st_cachemisses - ct->ct_stats.st_cachemisses,
+			st.st_fatlookups - ct->ct_stats.st_fatlookups);
+	}
+	if (len > (int) sizeof(line) - 3)
+		len = (int) sizeof(line) - 3;
+	line[len++] = '}';
+	line[len++] = '\n';
+	line[len] = '\0';
+	fputs(line, cfg->cc_tracefp);
+}
+
+/**
+ * Print the latency histograms gathered over the session, and free
+ * them
+ */
+static void
+traceReport(FILE *ofp, struct commandTrace *ct)
+{
+	char label[2];
+	int i, header = 0;
+
+	for (i = 0; i < TRACE_NCMDS; i++) {
+		if (ct->ct_hist[i] == NULL)
+			continue;
+		if (!header) {
+			fprintf(ofp, "\nCommand latency:\n");
+			latHistPrintHeader(ofp);
+			header = 1;
+		}
+		label[0] = (char) i;
+		label[1] = '\0';
+		latHistPrint(ofp, label, ct->ct_hist[i]);
+		free(ct->ct_hist[i]);
+		ct->ct_hist[i] = NULL;
+	}
+}
+
+void
+defaultCommandConfig(struct commandConfig *cfg)
+{
+	cfg->cc_displayBase = 16;
+	cfg->cc_chunkSize = COMMAND_CHUNKSIZE;
+	cfg->cc_errfp = NULL;
+	cfg->cc_tracefp = NULL;
+	cfg->cc_traceName = NULL;
+	cfg->cc_histograms = 0;
+	cfg->cc_noHostFiles = 0;
 }
 
 int
 processCommands(FILE *ifp, FILE *ofp, struct fat12fs *fs, int displayBase)
 {
-	char commandbuf[COMMANDLINE_LEN];
+	struct commandConfig cfg;
+
+	defaultCommandConfig(&cfg);
+	cfg.cc_displayBase = displayBase;
+	return processCommandsConfig(ifp, ofp, fs, &cfg);
+}
+
+/**
+ * Start a session of commands against fs, with the settings in cfg.
+ * Lines are then run one at a time with commandSessionLine(), from
+ * wherever they come from, and the session finished with
+ * commandSessionEnd().
+ */
+int
+commandSessionInit(struct commandSession *cs, struct fat12fs *fs,
+		const struct commandConfig *cfg)
+{
+	FILE *efp = (cfg->cc_errfp != NULL) ? cfg->cc_errfp : stderr;
+
+	memset(cs, 0, sizeof(*cs));
+	cs->cs_fs = fs;
+	cs->cs_cfg = *cfg;
+	cs->cs_result = 1;
+	arenaInit(&cs->cs_scratch, 0);
+
+	/** set up the right output number system */
+	if (cfg->cc_displayBase == 16) {
+		cs->cs_curBase = BASE_16;
+	} else if (cfg->cc_displayBase == 10) {
+		cs->cs_curBase = BASE_10;
+	} else {
+		cs->cs_curBase = BASE_16;
+		fprintf(efp, "I cannot handle base '%d'\n",
+				cfg->cc_displayBase);
+	}
+
+	/**
+	 * formatted file data is gathered here before it goes out; where
+	 * it goes is set for each command
+	 */
+	if (outBufferInit(&cs->cs_ob, NULL, OUTPUT_BUFSIZE) < 0) {
+		fprintf(efp, "Cannot allocate output buffer\n");
+		return (-1);
+	}
+	cs->cs_trace = (struct commandTrace *)
+			calloc(1, sizeof(struct commandTrace));
+	if (cs->cs_trace == NULL) {
+		fprintf(efp, "Cannot allocate command trace\n");
+		outBufferFree(&cs->cs_ob);
+		return (-1);
+	}
+	return 0;
+}
+
+/**
+ * Run one line of commands in a session, with its output going to
+ * ofp and its diagnostics to efp.  The line is broken up in place.
+ *
+ * Returns non-zero once the session is over, because of a "q" or
+ * of a failure which ends it
+ */
+int
+commandSessionLine(struct commandSession *cs, char *commandbuf,
+		FILE *ofp, FILE *efp)
+{
 	char *tokenList[MAXTOKENS];
 	char *conv[] = { "%x", "%d" };
 	char *convDesc[] = { "hexadecimal", "decimal" };
-	int curBase = BASE_16;
-	char *filename, *buffer;
-	int start, nBytes;
+	struct fat12fs *fs = cs->cs_fs;
+	const struct commandConfig *cfg = &cs->cs_cfg;
+	struct outBuffer *ob = &cs->cs_ob;
+	char *tokenState;
+	char *filename, *buffer, *hostpath;
+	struct fat12fs_file fh;
+	struct fat12fs_checkreport report;
+	struct fat12fs_exportreport exportReport;
+	struct fat12fs_hashreport hashReport;
+	struct fat12fs_hashentry *he;
+	struct fat12fs_fragreport fragReport;
+	int tracing = (cfg->cc_tracefp != NULL || cfg->cc_histograms);
+	int nThreads;
+	int start, nBytes, valid, chunkSize;
 	int entryIndex;
+	uint32_t crc;
 	int status;
+	int i;
+	int outfd, infd;
 	int tokenIndex;
-	int done = 0;
 
-	/** set up the right output number system */
-	if (displayBase == 16) {
-		curBase = BASE_16;
-	} else if (displayBase == 10) {
-		curBase = BASE_10;
-	} else {
-		fprintf(stderr, "I cannot handle base '%d'\n", displayBase);
+	ob->ob_fp = ofp;
+
+	/** whatever the last line took from the scratch arena is free again */
+	arenaReset(&cs->cs_scratch);
+
+	/**
+	 * convert first token
+	 */
+	tokenIndex = 0;
+	tokenList[tokenIndex++] = strtok_r(commandbuf, DELIMITERLIST, &tokenState);
+
+	/** if nothing was typed, there is nothing to do */
+	if (tokenList[0] == NULL)
+		return cs->cs_done;
+
+	/**
+	 * put the rest of the tokens into a list
+	 */
+	while (tokenIndex < MAXTOKENS) {
+		tokenList[tokenIndex] = strtok_r(NULL, DELIMITERLIST, &tokenState);
+		/** break if no more tokens */
+		if (tokenList[tokenIndex++] == NULL) {
+			tokenIndex--;
+			break;
+		}
 	}
 
+	/**
+	 * a session which may not touch the host's files, such as a
+	 * server client's, is refused the commands which name one
+	 */
+	if (cfg->cc_noHostFiles && (tokenList[0][0] == 'x'
+			|| tokenList[0][0] == 'X' || tokenList[0][0] == 'w'
+			|| (tokenList[0][0] == 'F' && tokenIndex >= 2))) {
+		fprintf(efp, "Command '%c' may not name host files here\n",
+			tokenList[0][0]);
+		return cs->cs_done;
+	}
 
+	if (tracing)
+		traceBegin(cs->cs_trace, fs);
 
 	/**
-	 * read commands one line at a time, processing them as we go
+	 * now the tokens are arranged in the token list,
+	 * we can simple "run" the command in the first
+	 * token and get the arguments as required
 	 */
-	while ((!done) && (fgets(commandbuf, COMMANDLINE_LEN, ifp) != NULL)) {
+	switch (tokenList[0][0]) {
+	case 'q':
+		/** we are done, end the session */
+		cs->cs_done = 1;
+		break;
 
-		/**
-		 * convert first token
-		 */
-		tokenIndex = 0;
-		tokenList[tokenIndex++] = strtok(commandbuf, DELIMITERLIST);
+	case 'f':
+		/** dump out the FAT table */
+		if (fat12fsDumpFat(ofp, fs) < 0) {
+			fprintf(efp,
+				"Failed dumping FAT for filesystem\n");
+			cs->cs_result = -1;
+			cs->cs_done = 1;
+			break;
+		}
+		break;
 
-		/** if nothing was typed, just get a new line */
-		if (tokenList[0] == NULL)
-			continue;
+	case 'r':
+		/** dump out the FAT table */
+		if (fat12fsDumpRootdir(ofp, fs) < 0) {
+			fprintf(efp,
+				"Failed dumping filesystem"
+				" root directory\n");
+			cs->cs_result = -1;
+			cs->cs_done = 1;
+			break;
+		}
+		break;
+
+	case 'b':
+		if (tokenIndex < 2) {
+			fprintf(efp, "Need <base>\n");
+			break;
+		}
+		if ((tokenList[1][0] == 'a')
+				|| (tokenList[1][0] == 'A')) {
+			fprintf(ofp, "Arguments in base-10\n");
+			cs->cs_curBase = BASE_10;
+		} else {
+			fprintf(ofp, "Arguments in base-16\n");
+			cs->cs_curBase = BASE_16;
+		}
+		break;
+
+	case 'd':
+		if (tokenIndex < 4) {
+			fprintf(efp, "Need <file> <start> <len>\n");
+			break;
+		}
+		filename = tokenList[1];
+		if (sscanf(tokenList[2], conv[cs->cs_curBase], &start) != 1) {
+			fprintf(efp,
+				"Cannot convert start position"
+					" '%s' to %s\n",
+				tokenList[2],
+				convDesc[cs->cs_curBase]);
+			break;
+		}
+
+		if (sscanf(tokenList[3], conv[cs->cs_curBase], &nBytes) != 1) {
+			fprintf(efp,
+				"Cannot convert nbytes"
+					" '%s' to %s\n",
+				tokenList[3],
+				convDesc[cs->cs_curBase]);
+			break;
+		}
 
 		/**
-		 * put the rest of the tokens into a list
+		 * find out how much of the request the file can
+		 * satisfy before allocating anything, then stream
+		 * it through at most one chunk of memory
 		 */
-		while (tokenIndex < MAXTOKENS) {
-			tokenList[tokenIndex] = strtok(NULL, DELIMITERLIST);
-			/** break if no more tokens */
-			if (tokenList[tokenIndex++] == NULL) {
-				tokenIndex--;
-				break;
-			}
+		if (fat12fsOpenHandle(fs, filename, &fh) < 0) {
+			valid = -1;
+		} else if ((valid = fat12fsFileLength(&fh)) < 0
+				|| start < 0 || nBytes < 0) {
+			fat12fsCloseHandle(&fh);
+			valid = -1;
+		}
+		if (valid < 0) {
+			fprintf(efp,
+				"Failed reading %d bytes from"
+					" file '%s' at 0x%x\n",
+				nBytes, filename, start);
+			cs->cs_result = -1;
+			cs->cs_done = 1;
+			break;
+		}
+		valid = (start >= valid) ? 0 : valid - start;
+		if (valid > nBytes)
+			valid = nBytes;
+
+		chunkSize = cfg->cc_chunkSize;
+		if (chunkSize > valid)
+			chunkSize = valid;
+		if (chunkSize < 1)
+			chunkSize = 1;
+		buffer = (char *) arenaAlloc(&cs->cs_scratch, chunkSize, 0);
+		if (buffer == NULL) {
+			fprintf(efp, "Cannot allocate %d byte buffer\n",
+					chunkSize);
+			fat12fsCloseHandle(&fh);
+			cs->cs_result = -1;
+			cs->cs_done = 1;
+			break;
+		}
+
+		outBufferPuts(ob, "Buffer using return status\n");
+		status = printFileRange(ob, &fh, filename,
+				start, valid, valid, buffer, chunkSize);
+		if (status == 0) {
+			outBufferPuts(ob, "Buffer using request size\n");
+			status = printFileRange(ob, &fh, filename,
+				start, valid, nBytes, buffer, chunkSize);
+		}
+		fat12fsCloseHandle(&fh);
+		outBufferFlush(ob);
+		if (status < 0) {
+			fprintf(efp,
+				"Failed reading %d bytes from"
+					" file '%s' at 0x%x\n",
+				nBytes, filename, start);
+			cs->cs_result = -1;
+			cs->cs_done = 1;
+			break;
+		}
+		break;
+
+	case 'x':
+		if (tokenIndex < 3) {
+			fprintf(efp, "Need <file> <hostpath>\n");
+			break;
+		}
+		filename = tokenList[1];
+		hostpath = tokenList[2];
+
+		outfd = open(hostpath, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (outfd < 0) {
+			fprintf(efp,
+				"Cannot open '%s' for output\n",
+				hostpath);
+			break;
+		}
+
+		/** copy the file out without going through a buffer */
+		status = fat12fsExport(fs, filename, outfd);
+		(void) close(outfd);
+		if (status < 0) {
+			fprintf(efp,
+				"Failed exporting file '%s'"
+					" to '%s'\n",
+				filename, hostpath);
+			break;
+		}
+		fprintf(ofp, "Exported '%s' %x bytes to '%s'\n",
+			filename, status, hostpath);
+		break;
+
+	case 'X':
+		if (tokenIndex < 2) {
+			fprintf(efp, "Need <hostdir> [threads]\n");
+			break;
+		}
+		hostpath = tokenList[1];
+		nThreads = 0;
+		if (tokenIndex >= 3 && sscanf(tokenList[2],
+				conv[cs->cs_curBase], &nThreads) != 1) {
+			fprintf(efp,
+				"Cannot convert thread count"
+					" '%s' to %s\n",
+				tokenList[2],
+				convDesc[cs->cs_curBase]);
+			break;
+		}
+
+		/** every file in the rootdir, in disk order */
+		status = fat12fsExportAll(fs, hostpath, nThreads,
+				&exportReport);
+		if (status < 0) {
+			fprintf(efp,
+				"Cannot export files to '%s'\n",
+				hostpath);
+			break;
 		}
+		if (status > 0)
+			fprintf(efp,
+				"Failed exporting %d files to '%s'\n",
+				status, hostpath);
+		fprintf(ofp, "Exported %d files %lx bytes to '%s'\n",
+			exportReport.xr_nfiles,
+			exportReport.xr_nbytes, hostpath);
+		break;
 
+	case 'h':
+		if (tokenIndex < 2) {
+			fprintf(efp, "Need <file|*> [threads]\n");
+			break;
+		}
+		filename = tokenList[1];
 
 		/**
-		 * now the tokens are arranged in the token list,
-		 * we can simple "run" the command in the first
-		 * token and get the arguments as required
+		 * one line per file, "crc bytes name", so that the
+		 * output can be compared or fed to other tools
 		 */
-		switch (tokenList[0][0]) {
-		case 'q':
-			/** we are done, exit the main loop */
-			done = 1;
-			break;
-
-		case 'f':
-			/** dump out the FAT table */
-			if (fat12fsDumpFat(ofp, fs) < 0) {
-				fprintf(stderr,
-					"Failed dumping FAT for filesystem\n");
-				return (-1);
+		if (strcmp(filename, "*") != 0) {
+			status = fat12fsHashFile(fs, filename, &crc);
+			if (status < 0) {
+				fprintf(efp,
+					"Failed hashing file '%s'\n",
+					filename);
+				break;
 			}
+			fprintf(ofp, "%08x %d %s\n",
+				crc, status, filename);
 			break;
+		}
 
-		case 'r':
-			/** dump out the FAT table */
-			if (fat12fsDumpRootdir(ofp, fs) < 0) {
-				fprintf(stderr,
-					"Failed dumping filesystem"
-					" root directory\n");
-				return (-1);
-			}
+		nThreads = 0;
+		if (tokenIndex >= 3 && sscanf(tokenList[2],
+				conv[cs->cs_curBase], &nThreads) != 1) {
+			fprintf(efp,
+				"Cannot convert thread count"
+					" '%s' to %s\n",
+				tokenList[2],
+				convDesc[cs->cs_curBase]);
 			break;
+		}
 
-		case 'b':
-			if (tokenIndex < 2) {
-				fprintf(stderr, "Need <base>\n");
-				continue;
-			}
-			if ((tokenList[1][0] == 'a')
-					|| (tokenList[1][0] == 'A')) {
-				printf("Arguments in base-10\n");
-				curBase = BASE_10;
-			} else {
-				printf("Arguments in base-16\n");
-				curBase = BASE_16;
-			}
+		/** every file in the rootdir, listed in rootdir order */
+		if (fat12fsHashAll(fs, nThreads, &hashReport) < 0) {
+			fprintf(efp, "Cannot hash files\n");
 			break;
+		}
+		for (i = 0; i < hashReport.hr_nentries; i++) {
+			he = &hashReport.hr_entries[i];
+			if (he->he_nbytes < 0)
+				fprintf(efp,
+					"Failed hashing file '%s'\n",
+					he->he_name);
+			else
+				fprintf(ofp, "%08x %d %s\n",
+					he->he_crc, he->he_nbytes,
+					he->he_name);
+		}
+		fat12fsFreeHashReport(&hashReport);
+		break;
 
-		case 'd':
-			if (tokenIndex < 4) {
-				fprintf(stderr, "Need <file> <start> <len>\n");
-				continue;
-			}
-			filename = tokenList[1];
-			if (sscanf(tokenList[2], conv[curBase], &start) != 1) {
-				fprintf(stderr,
-					"Cannot convert start position"
-						" '%s' to %s\n",
-					tokenList[2],
-					convDesc[curBase]);
-				continue;
-			}
+	case 'v':
+		if (tokenIndex < 2) {
+			fprintf(efp, "Need <direntry index>\n");
+			break;
+		}
+		if (sscanf(tokenList[1],
+				conv[cs->cs_curBase],
+				&entryIndex) != 1) {
+			fprintf(efp,
+				"Cannot convert entry index"
+					" '%s' to %s\n",
+				tokenList[1],
+				convDesc[cs->cs_curBase]);
+			break;
+		}
 
-			if (sscanf(tokenList[3], conv[curBase], &nBytes) != 1) {
-				fprintf(stderr,
-					"Cannot convert nbytes"
-						" '%s' to %s\n",
-					tokenList[3],
-					convDesc[curBase]);
-				continue;
-			}
+		/** verify that entry is valid */
+		status = fat12fsVerifyEOF(fs, entryIndex);
+		if (status < 0) {
+			fprintf(efp, "Entry is not a FILE\n");
+
+		} else if (status == 0) {
+			fprintf(efp, "Entry is NOT VALID\n");
+		} else {
+			fprintf(efp, "Entry is OK\n");
+		}
+		break;
+
+	case 's':
+		/** show (and with "s r", then reset) the counters */
+		printStats(ofp, fs);
+		if (tokenIndex >= 2 && tokenList[1][0] == 'r')
+			fat12fsResetStats(fs);
+		break;
+
+	case 'c':
+		nThreads = 0;
+		if (tokenIndex >= 2 && sscanf(tokenList[1],
+				conv[cs->cs_curBase], &nThreads) != 1) {
+			fprintf(efp,
+				"Cannot convert thread count"
+					" '%s' to %s\n",
+				tokenList[1],
+				convDesc[cs->cs_curBase]);
+			break;
+		}
+
+		/** check every chain in the volume at once */
+		if (fat12fsCheck(fs, nThreads, &report) < 0) {
+			fprintf(efp, "Failed checking filesystem\n");
+			break;
+		}
+		fat12fsDumpCheck(ofp, fs, &report);
+		fat12fsFreeCheckReport(&report);
+		break;
 
-			/** read data from file in root directory */
-			buffer = (char *) malloc(nBytes);
-			memset(buffer, 0, nBytes);
-			status = fat12fsReadData(fs, buffer, filename,
-				start, nBytes);
+	case 'F':
+		/** with a host path, write a defragmented copy there */
+		if (tokenIndex >= 2) {
+			hostpath = tokenList[1];
+			status = fat12fsRepack(fs, hostpath);
 			if (status < 0) {
-				fprintf(stderr,
-					"Failed reading %d bytes from"
-						" file '%s' at 0x%x\n",
-					nBytes, filename, start);
-				return (-1);
+				fprintf(efp,
+					"Failed repacking image to '%s'\n",
+					hostpath);
+				break;
 			}
-			fprintf(ofp, "Buffer using return status\n");
-			printBuffer(ofp, filename, start, status, buffer);
-			fprintf(ofp, "Buffer using request size\n");
-			printBuffer(ofp, filename, start, nBytes, buffer);
-			free(buffer);
+			fprintf(ofp, "Repacked %d files to '%s'\n",
+				status, hostpath);
 			break;
+		}
 
-		case 'v':
-			if (tokenIndex < 2) {
-				fprintf(stderr, "Need <direntry index>\n");
-				continue;
-			}
-			if (sscanf(tokenList[1],
-					conv[curBase],
-					&entryIndex) != 1) {
-				fprintf(stderr,
-					"Cannot convert entry index"
-						" '%s' to %s\n",
-					tokenList[1],
-					convDesc[curBase]);
-				continue;
-			}
+		if (fat12fsFragReport(fs, &fragReport) < 0) {
+			fprintf(efp, "Failed measuring fragmentation\n");
+			break;
+		}
+		fat12fsDumpFrag(ofp, &fragReport);
+		fat12fsFreeFragReport(&fragReport);
+		break;
 
-			/** verify that entry is valid */
-			status = fat12fsVerifyEOF(fs, entryIndex);
-			if (status < 0) {
-				fprintf(stderr, "Entry is not a FILE\n");
+	case 'n':
+		if (tokenIndex < 2) {
+			fprintf(efp, "Need <file>\n");
+			break;
+		}
+		filename = tokenList[1];
+		if (fat12fsCreate(fs, filename) < 0) {
+			fprintf(efp, "Failed creating file '%s'\n", filename);
+			break;
+		}
+		fprintf(ofp, "Created '%s'\n", filename);
+		break;
+
+	case 'w':
+		if (tokenIndex < 4) {
+			fprintf(efp, "Need <file> <start> <hostpath>\n");
+			break;
+		}
+		filename = tokenList[1];
+		hostpath = tokenList[3];
+		if (sscanf(tokenList[2], conv[cs->cs_curBase], &start) != 1) {
+			fprintf(efp,
+				"Cannot convert start position"
+					" '%s' to %s\n",
+				tokenList[2],
+				convDesc[cs->cs_curBase]);
+			break;
+		}
+
+		infd = open(hostpath, O_RDONLY);
+		if (infd < 0) {
+			fprintf(efp, "Cannot open '%s' for input\n", hostpath);
+			break;
+		}
+		chunkSize = cfg->cc_chunkSize;
+		buffer = (char *) arenaAlloc(&cs->cs_scratch, chunkSize, 0);
+		if (buffer == NULL) {
+			fprintf(efp, "Cannot allocate %d byte buffer\n",
+					chunkSize);
+			(void) close(infd);
+			break;
+		}
 
-			} else if (status == 0) {
-				fprintf(stderr, "Entry is NOT VALID\n");
-			} else {
-				fprintf(stderr, "Entry is OK\n");
+		/** a file which is not there yet is created first */
+		if (fat12fsOpenHandle(fs, filename, &fh) < 0
+				&& (fat12fsCreate(fs, filename) < 0
+				|| fat12fsOpenHandle(fs, filename, &fh) < 0)) {
+			fprintf(efp, "Failed creating file '%s'\n", filename);
+			(void) close(infd);
+			break;
+		}
+
+		/** stream the host file in through one chunk of memory */
+		nBytes = 0;
+		status = 0;
+		while ((valid = read(infd, buffer, chunkSize)) > 0) {
+			if (start < 0 || valid > INT_MAX - start - nBytes
+					|| fat12fsPwrite(&fh, buffer, valid,
+						start + nBytes) != valid) {
+				status = -1;
+				break;
 			}
+			nBytes += valid;
+		}
+		fat12fsCloseHandle(&fh);
+		(void) close(infd);
+		if (status < 0 || valid < 0) {
+			fprintf(efp,
+				"Failed writing '%s' to file '%s' at 0x%x\n",
+				hostpath, filename, start + nBytes);
+			break;
+		}
+		fprintf(ofp, "Wrote %d bytes to '%s'\n", nBytes, filename);
+		break;
+
+	case 't':
+		if (tokenIndex < 3) {
+			fprintf(efp, "Need <file> <len>\n");
+			break;
+		}
+		filename = tokenList[1];
+		if (sscanf(tokenList[2], conv[cs->cs_curBase], &nBytes) != 1) {
+			fprintf(efp,
+				"Cannot convert length"
+					" '%s' to %s\n",
+				tokenList[2],
+				convDesc[cs->cs_curBase]);
+			break;
+		}
+		if (fat12fsTruncate(fs, filename, nBytes) < 0) {
+			fprintf(efp, "Failed truncating file '%s'\n",
+					filename);
+			break;
+		}
+		fprintf(ofp, "Truncated '%s' to %d bytes\n", filename, nBytes);
+		break;
+
+	case 'u':
+		if (tokenIndex < 2) {
+			fprintf(efp, "Need <file>\n");
+			break;
+		}
+		filename = tokenList[1];
+		if (fat12fsDelete(fs, filename) < 0) {
+			fprintf(efp, "Failed deleting file '%s'\n", filename);
 			break;
+		}
+		fprintf(ofp, "Deleted '%s'\n", filename);
+		break;
 
-		default:
-			fprintf(stderr, "Unknown command '%s'\n",
-				tokenList[0]);
-			fprintf(stderr, "Commands are:\n");
-			fprintf(stderr, "  %-26s : %s\n",
-				"d <filename> <start> <len>",
-				"dump <filename> from <start> for <len> bytes");
-			fprintf(stderr, "  %-26s : %s\n",
-				"f",
-				"print out FAT table ");
-			fprintf(stderr, "  %-26s : %s\n",
-				"r",
-				"print out root directory");
-			fprintf(stderr, "  %-26s : %s\n",
-				"v <file>",
-				"verify <file> and ensure EOF is correct");
-			fprintf(stderr, "  %-26s : %s\n",
-				"b <base>",
-				"switch base for input numbers to be <base>");
+	case 'S':
+		/** write out the FAT and directory changes held so far */
+		if (fat12fsSync(fs) < 0) {
+			fprintf(efp, "Failed writing changes to the image\n");
+			cs->cs_result = -1;
+			break;
 		}
+		fprintf(ofp, "Synced\n");
+		break;
+
+	default:
+		fprintf(efp, "Unknown command '%s'\n",
+			tokenList[0]);
+		fprintf(efp, "Commands are:\n");
+		fprintf(efp, "  %-26s : %s\n",
+			"d <filename> <start> <len>",
+			"dump <filename> from <start> for <len> bytes");
+		fprintf(efp, "  %-26s : %s\n",
+			"",
+			"(a <filename> may be a path, such as A/B/FILE.TXT)");
+		fprintf(efp, "  %-26s : %s\n",
+			"f",
+			"print out FAT table ");
+		fprintf(efp, "  %-26s : %s\n",
+			"r",
+			"print out root directory");
+		fprintf(efp, "  %-26s : %s\n",
+			"x <filename> <hostpath>",
+			"export <filename> to <hostpath> on the host");
+		fprintf(efp, "  %-26s : %s\n",
+			"X <hostdir> [threads]",
+			"export every file to <hostdir> on the host");
+		fprintf(efp, "  %-26s : %s\n",
+			"h <file|*> [threads]",
+			"print the CRC-32C of <file>, or of every file");
+		fprintf(efp, "  %-26s : %s\n",
+			"v <file>",
+			"verify <file> and ensure EOF is correct");
+		fprintf(efp, "  %-26s : %s\n",
+			"s [r]",
+			"print I/O statistics, and reset them with r");
+		fprintf(efp, "  %-26s : %s\n",
+			"c [threads]",
+			"check all chains for damage and cross links");
+		fprintf(efp, "  %-26s : %s\n",
+			"F [hostpath]",
+			"report fragmentation, or write a repacked copy");
+		fprintf(efp, "  %-26s : %s\n",
+			"n <file>",
+			"create an empty <file> (write mounts)");
+		fprintf(efp, "  %-26s : %s\n",
+			"w <file> <start> <hostpath>",
+			"write <hostpath> into <file> at <start>");
+		fprintf(efp, "  %-26s : %s\n",
+			"t <file> <len>",
+			"truncate or extend <file> to <len> bytes");
+		fprintf(efp, "  %-26s : %s\n",
+			"u <file>",
+			"delete <file>");
+		fprintf(efp, "  %-26s : %s\n",
+			"S",
+			"write out FAT and directory changes");
+		fprintf(efp, "  %-26s : %s\n",
+			"b <base>",
+			"switch base for input numbers to be <base>");
 	}
 
-	return 1;
+	if (tracing)
+		traceEnd(cs->cs_trace, fs, cfg, tokenList, tokenIndex);
+
+	return cs->cs_done;
+}
+
+/**
+ * Finish a session, printing its latency histograms (if it was
+ * keeping them) to ofp, and release what it holds
+ */
+void
+commandSessionEnd(struct commandSession *cs, FILE *ofp)
+{
+	if (cs->cs_cfg.cc_histograms)
+		traceReport(ofp, cs->cs_trace);
+	free(cs->cs_trace);
+	cs->cs_trace = NULL;
+	outBufferFree(&cs->cs_ob);
+	arenaFree(&cs->cs_scratch);
+}
+
+int
+processCommandsConfig(FILE *ifp, FILE *ofp, struct fat12fs *fs,
+		const struct commandConfig *cfg)
+{
+	char commandbuf[COMMANDLINE_LEN];
+	FILE *efp = (cfg->cc_errfp != NULL) ? cfg->cc_errfp : stderr;
+	struct commandSession cs;
+
+	if (commandSessionInit(&cs, fs, cfg) < 0)
+		return (-1);
+
+	/**
+	 * read commands one line at a time, processing them as we go
+	 */
+	while ((!cs.cs_done)
+			&& (fgets(commandbuf, COMMANDLINE_LEN, ifp) != NULL))
+		(void) commandSessionLine(&cs, commandbuf, ofp, efp);
+
+	commandSessionEnd(&cs, ofp);
+	return cs.cs_result;
 }
 
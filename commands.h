@@ -3,7 +3,51 @@
 
 #include <stdio.h>
 #include "fat12fs.h"
+#include "outbuf.h"
 
+/** default size of the buffer used to stream file data out */
+#define	COMMAND_CHUNKSIZE	(64 * 1024)
+
+/**
+ * Settings for a command session; fill in with defaultCommandConfig()
+ */
+typedef struct commandConfig {
+	int cc_displayBase;	/* 16 or 10, for numbers typed in */
+	int cc_chunkSize;	/* most file data held in memory at once */
+	FILE *cc_errfp;		/* diagnostics go here; NULL for stderr */
+	FILE *cc_tracefp;	/* a JSON line per command; NULL for none */
+	const char *cc_traceName; /* names the session in trace lines */
+	int cc_histograms;	/* print latency histograms at the end */
+	int cc_noHostFiles;	/* refuse commands that name host paths */
+} commandConfig;
+
+struct commandTrace;
+
+/**
+ * The state a run of commands carries from one line to the next, so
+ * that lines may be fed in one at a time as they arrive; set up with
+ * commandSessionInit()
+ */
+typedef struct commandSession {
+	struct fat12fs *cs_fs;
+	struct commandConfig cs_cfg;
+	int cs_curBase;		/* base numbers are typed in, as set by "b" */
+	int cs_done;		/* set once the session is over */
+	int cs_result;		/* what processCommandsConfig() would return */
+	struct outBuffer cs_ob;
+	struct commandTrace *cs_trace;
+	struct arena cs_scratch;	/* for one line's buffers, then reset */
+} commandSession;
+
+void defaultCommandConfig(struct commandConfig *cfg);
 int processCommands(FILE *ifp, FILE *ofp, struct fat12fs *fs, int displayBase);
+int processCommandsConfig(FILE *ifp, FILE *ofp, struct fat12fs *fs,
+		const struct commandConfig *cfg);
+
+int commandSessionInit(struct commandSession *cs, struct fat12fs *fs,
+		const struct commandConfig *cfg);
+int commandSessionLine(struct commandSession *cs, char *commandbuf,
+		FILE *ofp, FILE *efp);
+void commandSessionEnd(struct commandSession *cs, FILE *ofp);
 
 #endif /* __COMMANDS_HEADER__ */
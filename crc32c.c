@@ -0,0 +1,101 @@
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32c.h"
+
+/** the reflected Castagnoli polynomial */
+#define	CRC32C_POLY	0x82f63b78
+
+static uint32_t crc32cTable[256];
+static pthread_once_t crc32cTableOnce = PTHREAD_ONCE_INIT;
+
+static void
+crc32cBuildTable(void)
+{
+	uint32_t crc;
+	int i, bit;
+
+	for (i = 0; i < 256; i++) {
+		crc = (uint32_t) i;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+		crc32cTable[i] = crc;
+	}
+}
+
+/**
+ * Plain C version, a byte at a time from a table
+ */
+static uint32_t
+crc32cScalar(uint32_t crc, const unsigned char *p, size_t nbytes)
+{
+	pthread_once(&crc32cTableOnce, crc32cBuildTable);
+	while (nbytes-- > 0)
+		crc = (crc >> 8) ^ crc32cTable[(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+/**
+ * SSE4.2 version: the crc32 instruction takes eight bytes at a time
+ */
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32cSSE42(uint32_t crc, const unsigned char *p, size_t nbytes)
+{
+	uint64_t crc64 = crc;
+	uint64_t word;
+
+	for (; nbytes >= 8; p += 8, nbytes -= 8) {
+		memcpy(&word, p, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = (uint32_t) crc64;
+	for (; nbytes > 0; p++, nbytes--)
+		crc = _mm_crc32_u8(crc, *p);
+	return crc;
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+/**
+ * ARMv8 version, with the CRC32 extension, eight bytes at a time
+ */
+static uint32_t
+crc32cARMv8(uint32_t crc, const unsigned char *p, size_t nbytes)
+{
+	uint64_t word;
+
+	for (; nbytes >= 8; p += 8, nbytes -= 8) {
+		memcpy(&word, p, 8);
+		crc = __crc32cd(crc, word);
+	}
+	for (; nbytes > 0; p++, nbytes--)
+		crc = __crc32cb(crc, *p);
+	return crc;
+}
+#endif
+
+/**
+ * Carry a CRC on over more data, using the CRC instructions of this
+ * machine where it has them
+ */
+uint32_t
+crc32cUpdate(uint32_t crc, const void *data, size_t nbytes)
+{
+	const unsigned char *p = (const unsigned char *) data;
+
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		return ~crc32cSSE42(crc, p, nbytes);
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+	return ~crc32cARMv8(crc, p, nbytes);
+#endif
+	return ~crc32cScalar(crc, p, nbytes);
+}
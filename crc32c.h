@@ -0,0 +1,15 @@
+#ifndef	__CRC32C_HEADER__
+#define	__CRC32C_HEADER__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * CRC-32C (Castagnoli), as used by iSCSI, ext4 and SCTP.  Start from
+ * 0 and feed the data through in as many pieces as is convenient;
+ * the result is the same as for the whole of it at once, so
+ * crc32cUpdate(0, "123456789", 9) is 0xe3069283.
+ */
+uint32_t crc32cUpdate(uint32_t crc, const void *data, size_t nbytes);
+
+#endif /* __CRC32C_HEADER__ */
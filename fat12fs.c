@@ -1,17 +1,33 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <fcntl.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include "fat12fs.h"
+#include "blockdev.h"
+#include "outbuf.h"
+#include "crc32c.h"
 
 
 /*
  * This structure holds the DOS 5 boot block.  This is what you will
  * find in the book block (first block) of any FAT-12 filesystem, such
- * as found on SD cards and other small storage media.
+ * as found on SD cards and other small storage media.  FAT-16 uses
+ * the same layout, and FAT-32 carries on into bb_extra as
+ * fat12fs_BOOTBLOCK32 describes.
  *
  * It is a packed structure defined exactly as is found on the disk,
  * which is why all fields are character.
@@ -34,12 +50,50 @@ typedef struct fat12fs_BOOTBLOCK {
 	unsigned char	bb_extra[476];
 } fat12fs_BOOTBLOCK;
 
+/*
+ * The start of bb_extra on a FAT-32 volume, where bb_sectors_per_fat
+ * and bb_root_dir_entries are both zero
+ */
+typedef struct fat12fs_BOOTBLOCK32 {
+	unsigned char	bb_sectors_per_fat_big[4];
+	unsigned char	bb_ext_flags[2];
+	unsigned char	bb_fs_version[2];
+	unsigned char	bb_root_cluster[4];
+	unsigned char	bb_fsinfo_sector[2];
+	unsigned char	bb_backup_boot_sector[2];
+} fat12fs_BOOTBLOCK32;
+
+
+/**
+ * count something on the filesystem, unless counting is compiled out;
+ * threads sharing a mount count into the same fields, so the adds are
+ * atomic (but unordered, as nothing is synchronized through them)
+ */
+#if FAT12FS_STATS
+#define	FS_COUNT(fs, field, n)	\
+		((void) __atomic_fetch_add(&(fs)->fs_stats.field, (n), \
+			__ATOMIC_RELAXED))
+#else
+#define	FS_COUNT(fs, field, n)	((void) 0)
+#endif
+
+/** read a counter which other threads may be adding to */
+#define	FS_LOADCOUNT(counter)	__atomic_load_n(&(counter), __ATOMIC_RELAXED)
 
-/** define locations and sizes */
+/** most threads any one operation runs at once */
+#define	FS_MAXWORKERS	64
+
+/**
+ * define locations and sizes; the most data clusters of each FAT
+ * width are also what tells them apart
+ */
 #define FAT_BOOTBLOCK	0
-#define FAT12_MAXSIZE	4086
-#define FAT_MAXDIR	(int) ((25 * FS_BLKSIZE) / sizeof (struct fat12fs_DIRENTRY))
+#define FAT12_MAXSIZE	4084
+#define FAT16_MAXSIZE	65524
+#define FAT32_MAXSIZE	0x0ffffff5
+#define FAT_MAXDIR	(int) ((FAT12FS_MAXDIRBLOCKS * FS_BLKSIZE) / sizeof (struct fat12fs_DIRENTRY))
 #define FAT_DIRPERBLK	(int) (FS_BLKSIZE / sizeof (struct fat12fs_DIRENTRY))
+#define FAT_MAXSUBDIR	65536	/* most entries a subdirectory may hold */
 
 
 /*
@@ -47,11 +101,21 @@ typedef struct fat12fs_BOOTBLOCK {
  * FAT12_EOF1	- first value that indicates End of File 
  * FAT12_EOFF	- last End of File value. (why a range and not just one??)
  * FAT12_FREE	- indicates a Free (unallocated) block
+ * FAT12_BAD	- marks a block as bad, never to be allocated
  * FAT16_xxx	- same as above, for FAT16
+ * FAT32_xxx	- and for FAT32, whose top four bits are reserved
+ *
+ * Once mounted, the EOF and mask values of the width in use are kept
+ * in fs_fateof and fs_fatmask, and the bad value is one below EOF.
  */
 #define FAT12_EOF1	0x0ff8  
 #define FAT12_EOFF	0x0fff  
 #define FAT12_FREE	0
+#define FAT12_BAD	0x0ff7
+#define FAT16_EOF1	0xfff8
+#define FAT16_EOFF	0xffff
+#define FAT32_EOF1	0x0ffffff8
+#define FAT32_EOFF	0x0fffffff
 
 
 /*
@@ -75,72 +139,527 @@ typedef struct fat12fs_BOOTBLOCK {
 
 /**
  * Read a physical block of data from the disk into the given buffer.
- * the blknum address is a physical address within the file system
+ * the blknum address is a physical address within the file system.
+ * The descriptor's offset is left alone, so threads may share it.
  */
 int
 fat12fsRawDiskRead(int fd, int blknum, char *buffer)
 {
-	int status;
+	ssize_t status;
 
-	status = lseek(fd, (off_t)(blknum * FS_BLKSIZE), SEEK_SET);
+	status = pread(fd, buffer, FS_BLKSIZE, (off_t) blknum * FS_BLKSIZE);
 	if (status < 0)
 		return (-1);
 
-	status = read(fd, buffer, FS_BLKSIZE);
-	if (status < 0)
+	return 0;
+}
+
+/**
+ * Return a pointer to the given physical block inside the mapping,
+ * or NULL if the filesystem is not mapped or the block count runs
+ * past the end of the image
+ */
+static const char *
+fat12fsMapBlocks(struct fat12fs *fs, int blknum, int nblocks)
+{
+	if (fs->fs_map == NULL || blknum < 0
+			|| (size_t)(blknum + nblocks) * FS_BLKSIZE
+				> fs->fs_mapsize)
+		return NULL;
+
+	return (const char *) &fs->fs_map[blknum * FS_BLKSIZE];
+}
+
+/**
+ * The physical block (sector) at which a data cluster starts,
+ * remembering that the first data cluster is numbered "2"
+ */
+static inline int
+fat12fsClusterBlock(const struct fat12fs *fs, int cluster)
+{
+	return fs->fs_datablock0 + (cluster - 2) * fs->fs_clustersectors;
+}
+
+/**
+ * The byte offset in the image at which a data cluster starts
+ */
+static inline off_t
+fat12fsClusterOffset(const struct fat12fs *fs, int cluster)
+{
+	return (off_t) fs->fs_datablock0 * FS_BLKSIZE
+			+ ((off_t) (cluster - 2) << fs->fs_clustershift);
+}
+
+/**
+ * The first cluster of a directory entry; only FAT-32 has room for
+ * more than 16 bits of it
+ */
+static inline int
+fat12fsFirstCluster(const struct fat12fs *fs, const fat12fs_DIRENTRY *de)
+{
+	if (fs->fs_fatbits != 32)
+		return de->de_fileblock0;
+	return (int) ((de->de_fileblock0
+			| ((unsigned int) de->de_file_block0high[0] << 16)
+			| ((unsigned int) de->de_file_block0high[1] << 24))
+		& FAT32_EOFF);
+}
+
+/**
+ * Whether a chain value names a data block of the volume, rather than
+ * EOF, a bad block mark, a free entry or something out of range
+ */
+static inline int
+fat12fsIsDataBlock(const struct fat12fs *fs, uint32_t cluster)
+{
+	return cluster >= 2 && cluster < (uint32_t) fs->fs_fatsize;
+}
+
+/**
+ * Whether p points into the mount's sidecar index, and so must not
+ * be freed
+ */
+static inline int
+fat12fsInSidecar(const struct fat12fs *fs, const void *p)
+{
+	return fs->fs_sidecar != NULL
+			&& (const unsigned char *) p >= fs->fs_sidecar
+			&& (const unsigned char *) p
+				< fs->fs_sidecar + fs->fs_sidecarsize;
+}
+
+/**
+ * The fixed root directory of FAT-12 and FAT-16 is used in place in
+ * a mapped mount; a FAT-32 one is gathered from its chain, so is
+ * a copy of its own unless it came from a sidecar index
+ */
+static inline int
+fat12fsRootdirMapped(const struct fat12fs *fs)
+{
+	return (fs->fs_map != NULL && fs->fs_rootcluster == 0)
+			|| fat12fsInSidecar(fs, fs->fs_rootdirentry);
+}
+
+/**
+ * The directory entry behind an entry index: below fs_rootdirsize a
+ * rootdir slot, and past it the dentry cache slot holding a file
+ * found in a subdirectory (which its handle keeps pinned)
+ */
+static inline fat12fs_DIRENTRY *
+fat12fsEntry(struct fat12fs *fs, int dirEntryIndex)
+{
+	if (dirEntryIndex < fs->fs_rootdirsize)
+		return &fs->fs_rootdirentry[dirEntryIndex];
+	return &fs->fs_dcache.dc_dentries[dirEntryIndex
+			- fs->fs_rootdirsize].dn_entry;
+}
+
+/**
+ * Where the extent map of an entry index is kept
+ */
+static inline struct fat12fs_extentmap **
+fat12fsExtentSlot(struct fat12fs *fs, int dirEntryIndex)
+{
+	if (dirEntryIndex < fs->fs_rootdirsize)
+		return &fs->fs_extents[dirEntryIndex];
+	return &fs->fs_dcache.dc_dentries[dirEntryIndex
+			- fs->fs_rootdirsize].dn_extents;
+}
+
+/**
+ * Tear down a block cache, including a cache whose set up failed
+ * part way (bc_nshards counts the shards set up); its storage
+ * belongs to the mount's arena, and goes with that
+ */
+static void
+fat12fsCacheFree(struct fat12fs_cache *cache)
+{
+	struct fat12fs_cacheshard *cs;
+	int s;
+
+	for (s = 0; s < cache->bc_nshards; s++) {
+		cs = &cache->bc_shards[s];
+		pthread_mutex_destroy(&cs->cs_lock);
+	}
+	memset(cache, 0, sizeof(struct fat12fs_cache));
+}
+
+/**
+ * Set up a block cache with room for nbufs clusters of bufsize
+ * bytes each.  A cache of zero clusters is legal, and simply sends
+ * every read to the disk.
+ *
+ * The blocks are dealt out over as many shards (up to
+ * FAT12FS_CACHESHARDS) as leave each at least FAT12FS_SHARDMIN, so a
+ * small cache stays a single CLOCK rather than many tiny ones.
+ * Everything is carved from one reservation in the arena.
+ */
+static int
+fat12fsCacheInit(struct fat12fs_cache *cache, struct arena *ar,
+		int nbufs, int bufsize)
+{
+	struct fat12fs_cacheshard *cs;
+	int nshards, shift, nchains;
+	int s, i, b;
+
+	memset(cache, 0, sizeof(struct fat12fs_cache));
+	if (nbufs <= 0)
+		return 0;
+
+	for (nshards = 1, shift = 0; nshards < FAT12FS_CACHESHARDS
+			&& nshards * 2 * FAT12FS_SHARDMIN <= nbufs;
+			nshards <<= 1)
+		shift++;
+
+	/** each shard's hash has fewer than twice its buffers' chains */
+	if (arenaReserve(ar, (size_t) nbufs * bufsize
+			+ nshards * sizeof(struct fat12fs_cacheshard)
+			+ (size_t) nbufs * sizeof(struct fat12fs_cachebuf)
+			+ (2 * (size_t) nbufs + nshards) * sizeof(int)
+			+ (2 * nshards + 2) * ARENA_MAXALIGN) < 0)
+		return (-1);
+	cache->bc_shards = (struct fat12fs_cacheshard *) arenaAlloc(ar,
+			nshards * sizeof(struct fat12fs_cacheshard),
+			ARENA_MAXALIGN);
+	cache->bc_data = (char *) arenaAlloc(ar, (size_t) nbufs * bufsize,
+			ARENA_MAXALIGN);
+	if (cache->bc_shards == NULL || cache->bc_data == NULL) {
+		fat12fsCacheFree(cache);
+		return (-1);
+	}
+	memset(cache->bc_shards, 0,
+			nshards * sizeof(struct fat12fs_cacheshard));
+
+	b = 0;
+	for (s = 0; s < nshards; s++) {
+		cs = &cache->bc_shards[s];
+		cs->cs_nbufs = nbufs / nshards + (s < nbufs % nshards);
+		for (nchains = 1; nchains < cs->cs_nbufs; nchains <<= 1)
+			;
+
+		pthread_mutex_init(&cs->cs_lock, NULL);
+		cache->bc_nshards = s + 1;
+		cs->cs_bufs = (struct fat12fs_cachebuf *)
+				arenaAlloc(ar, cs->cs_nbufs
+					* sizeof(struct fat12fs_cachebuf), 0);
+		cs->cs_hash = (int *) arenaAlloc(ar, nchains * sizeof(int), 0);
+		if (cs->cs_bufs == NULL || cs->cs_hash == NULL) {
+			fat12fsCacheFree(cache);
+			return (-1);
+		}
+
+		for (i = 0; i < cs->cs_nbufs; i++, b++) {
+			cs->cs_bufs[i].cb_blknum = -1;
+			cs->cs_bufs[i].cb_next = -1;
+			cs->cs_bufs[i].cb_ref = 0;
+			cs->cs_bufs[i].cb_data =
+					&cache->bc_data[(size_t) b * bufsize];
+		}
+		for (i = 0; i < nchains; i++)
+			cs->cs_hash[i] = -1;
+		cs->cs_hashmask = nchains - 1;
+	}
+
+	cache->bc_nbufs = nbufs;
+	cache->bc_bufsize = bufsize;
+	cache->bc_shardshift = shift;
+	return 0;
+}
+
+/**
+ * Find the chain head for a block within its shard
+ */
+static int *
+fat12fsCacheChain(const struct fat12fs_cache *cache,
+		struct fat12fs_cacheshard *cs, int blknum)
+{
+	return &cs->cs_hash[(blknum >> cache->bc_shardshift)
+			& cs->cs_hashmask];
+}
+
+/**
+ * Take the given buffer off of its hash chain
+ */
+static void
+fat12fsCacheUnhash(const struct fat12fs_cache *cache,
+		struct fat12fs_cacheshard *cs, int bufIndex)
+{
+	int *link;
+
+	link = fat12fsCacheChain(cache, cs, cs->cs_bufs[bufIndex].cb_blknum);
+	while (*link != bufIndex)
+		link = &cs->cs_bufs[*link].cb_next;
+	*link = cs->cs_bufs[bufIndex].cb_next;
+	cs->cs_bufs[bufIndex].cb_next = -1;
+	cs->cs_bufs[bufIndex].cb_blknum = -1;
+}
+
+/**
+ * Copy n bytes, from "offset" bytes into data cluster blknum, out of
+ * the cache into dest, first loading the cluster from the disk, with
+ * a single read, into a CLOCK-selected victim buffer of its shard if
+ * it is not there.
+ *
+ * Blocks loaded with "keep" clear start without their reference bit,
+ * so one-shot loads (the FAT and rootdir at mount) are the first to
+ * be evicted.  The copy is made with the shard locked, so no other
+ * thread can evict the buffer part way through; a miss holds the
+ * lock for its read, which only readers of the same shard wait on.
+ */
+static int
+fat12fsCacheRead(struct fat12fs *fs, int blknum, char *dest,
+		int offset, int n, int keep)
+{
+	struct fat12fs_cache *cache = &fs->fs_cache;
+	struct fat12fs_cacheshard *cs;
+	struct fat12fs_cachebuf *buf;
+	int *chain;
+	int i;
+
+	cs = &cache->bc_shards[blknum & (cache->bc_nshards - 1)];
+	pthread_mutex_lock(&cs->cs_lock);
+
+	chain = fat12fsCacheChain(cache, cs, blknum);
+	for (i = *chain; i >= 0; i = cs->cs_bufs[i].cb_next) {
+		if (cs->cs_bufs[i].cb_blknum == blknum) {
+			cs->cs_hits++;
+			cs->cs_bufs[i].cb_ref = 1;
+			memcpy(dest, cs->cs_bufs[i].cb_data + offset, n);
+			pthread_mutex_unlock(&cs->cs_lock);
+			return 0;
+		}
+	}
+	cs->cs_misses++;
+
+	/** sweep the hand round until we find an unreferenced buffer */
+	for (;;) {
+		buf = &cs->cs_bufs[cs->cs_hand];
+		if (buf->cb_blknum < 0 || buf->cb_ref == 0)
+			break;
+		buf->cb_ref = 0;
+		cs->cs_hand = (cs->cs_hand + 1) % cs->cs_nbufs;
+	}
+	i = cs->cs_hand;
+	cs->cs_hand = (cs->cs_hand + 1) % cs->cs_nbufs;
+
+	if (buf->cb_blknum >= 0)
+		fat12fsCacheUnhash(cache, cs, i);
+
+	if (blockDeviceRead(fs->fs_bdev, buf->cb_data, cache->bc_bufsize,
+			fat12fsClusterOffset(fs, blknum)) < 0) {
+		pthread_mutex_unlock(&cs->cs_lock);
+		return (-1);
+	}
+
+	buf->cb_blknum = blknum;
+	buf->cb_ref = (keep != 0);
+	buf->cb_next = *chain;
+	*chain = i;
+	memcpy(dest, buf->cb_data + offset, n);
+	pthread_mutex_unlock(&cs->cs_lock);
+	return 0;
+}
+
+
+/**
+ * Bring the cached copy of a data block, if there is one, up to date
+ * with n bytes just written to the image at "offset" into the block
+ * (from src, or zeros if src is NULL)
+ */
+static void
+fat12fsCacheUpdate(struct fat12fs *fs, int blknum, const char *src,
+		int offset, int n)
+{
+	struct fat12fs_cache *cache = &fs->fs_cache;
+	struct fat12fs_cacheshard *cs;
+	int *chain;
+	int i;
+
+	if (cache->bc_nbufs == 0)
+		return;
+
+	cs = &cache->bc_shards[blknum & (cache->bc_nshards - 1)];
+	pthread_mutex_lock(&cs->cs_lock);
+	chain = fat12fsCacheChain(cache, cs, blknum);
+	for (i = *chain; i >= 0; i = cs->cs_bufs[i].cb_next) {
+		if (cs->cs_bufs[i].cb_blknum != blknum)
+			continue;
+		if (src != NULL)
+			memcpy(cs->cs_bufs[i].cb_data + offset, src, n);
+		else
+			memset(cs->cs_bufs[i].cb_data + offset, 0, n);
+		break;
+	}
+	pthread_mutex_unlock(&cs->cs_lock);
+}
+
+
+/**
+ * Set up the dentry cache with room for nentries names, and a buffer
+ * of one cluster to read directories through; all of it belongs to
+ * the mount's arena
+ */
+static int
+fat12fsDcacheInit(struct fat12fs *fs, int nentries)
+{
+	struct fat12fs_dcache *dc = &fs->fs_dcache;
+	int nbuckets;
+	int i;
+
+	if (nentries < FAT12FS_DENTRIESMIN)
+		nentries = FAT12FS_DENTRIESMIN;
+	for (nbuckets = 8; nbuckets < nentries; nbuckets <<= 1)
+		;
+
+	dc->dc_dentries = (struct fat12fs_dentry *) arenaCalloc(
+			&fs->fs_arena, nentries, sizeof(struct fat12fs_dentry));
+	dc->dc_buckets = (int *) arenaAlloc(&fs->fs_arena,
+			nbuckets * sizeof(int), 0);
+	dc->dc_buf = (char *) arenaAlloc(&fs->fs_arena,
+			fs->fs_clustersize, ARENA_MAXALIGN);
+	if (dc->dc_dentries == NULL || dc->dc_buckets == NULL
+			|| dc->dc_buf == NULL)
 		return (-1);
 
+	for (i = 0; i < nbuckets; i++)
+		dc->dc_buckets[i] = -1;
+	for (i = 0; i < nentries; i++)
+		dc->dc_dentries[i].dn_next = -1;
+	dc->dc_nentries = nentries;
+	dc->dc_mask = nbuckets - 1;
+	dc->dc_hand = 0;
 	return 0;
 }
 
+
+/**
+ * Tear down the dentry cache, freeing the extent maps built for its
+ * files; the cache itself goes with the arena
+ */
+static void
+fat12fsDcacheFree(struct fat12fs_dcache *dc)
+{
+	int i;
+
+	for (i = 0; i < dc->dc_nentries; i++)
+		free(dc->dc_dentries[i].dn_extents);
+	dc->dc_nentries = 0;
+	pthread_mutex_destroy(&dc->dc_lock);
+}
+
+/**
+ * Add up the hit and miss counts of all the shards, zeroing them
+ * as we go if asked
+ */
+static void
+fat12fsCacheCounts(struct fat12fs_cache *cache,
+		unsigned long *hits, unsigned long *misses, int reset)
+{
+	struct fat12fs_cacheshard *cs;
+	int s;
+
+	*hits = 0;
+	*misses = 0;
+	for (s = 0; s < cache->bc_nshards; s++) {
+		cs = &cache->bc_shards[s];
+		pthread_mutex_lock(&cs->cs_lock);
+		*hits += cs->cs_hits;
+		*misses += cs->cs_misses;
+		if (reset) {
+			cs->cs_hits = 0;
+			cs->cs_misses = 0;
+		}
+		pthread_mutex_unlock(&cs->cs_lock);
+	}
+}
+
+/**
+ * Get a pointer to the contents of a physical block, from wherever
+ * is cheapest: the mapping if there is one, or else a copy read into
+ * the caller's scratch buffer.  The cache holds whole clusters, so
+ * single blocks (only the boot block now) do not go through it.
+ *
+ * Returns NULL if the block cannot be read.
+ */
+static const char *
+fat12fsGetBlock(struct fat12fs *fs, int blknum, char *scratch)
+{
+	if (fs->fs_map != NULL)
+		return fat12fsMapBlocks(fs, blknum, 1);
+
+	if (blockDeviceRead(fs->fs_bdev, scratch, FS_BLKSIZE,
+			(off_t) blknum * FS_BLKSIZE) < 0)
+		return NULL;
+	return scratch;
+}
+
 /**
  * Load the boot block (block 0), which contains the information
  * which lets us figure everything else out (including whether or
- * not this is even a FAT-12 file system).
+ * not this is even a FAT file system, and of which width).
  */
 int
 fat12fsLoadBootBlock(struct fat12fs *fs)
 {
 	struct fat12fs_BOOTBLOCK bootblock;
+	const struct fat12fs_BOOTBLOCK32 *bb32;
 	unsigned short val;
+	const char *blk;
 
 
 	/** read in the block from the disk */
-	if (fat12fsRawDiskRead(fs->fs_fd,
-			FAT_BOOTBLOCK,
-			(char *)&bootblock) < 0) {
+	blk = fat12fsGetBlock(fs, FAT_BOOTBLOCK, (char *)&bootblock);
+	if (blk == NULL) {
 		fprintf(stderr, "Failed reading boot block\n");
 		return (-1);
 	}
+	memmove(&bootblock, blk, FS_BLKSIZE);
 
 	/**
-	 * make sure the data block size is FS_BLKSIZE, and that
-	 * the filesystem is set up for only 1 sector ber block
-	 *
-	 * if these constraints don't hold, all of our math later
-	 * is much more complicated, and the code here is wrong
+	 * make sure the sector size is FS_BLKSIZE, and that a cluster
+	 * is a power of two sectors, so that positions within files
+	 * can be split into cluster and offset with shifts and masks
 	 */
 	bcopy((char *)&bootblock.bb_bytes_per_sector, (char *)&val, 2);
-	if (val != FS_BLKSIZE || bootblock.bb_sectors_per_block != 1) {
+	if (val != FS_BLKSIZE) {
 		fprintf(stderr,
 			"Expected %d bytes/filesystem block, found %d\n",
-			val * bootblock.bb_sectors_per_block,
-			FS_BLKSIZE);
+			FS_BLKSIZE, val);
+		return (-1);
+	}
+	if (bootblock.bb_sectors_per_block == 0
+			|| bootblock.bb_sectors_per_block > FS_MAXCLUSTERSECTORS
+			|| (bootblock.bb_sectors_per_block
+				& (bootblock.bb_sectors_per_block - 1)) != 0) {
+		fprintf(stderr,
+			"Cannot handle %d sectors per cluster\n",
+			bootblock.bb_sectors_per_block);
 		return (-1);
 	}
+	fs->fs_clustersectors = bootblock.bb_sectors_per_block;
+	fs->fs_clustersize = fs->fs_clustersectors * FS_BLKSIZE;
+	for (fs->fs_clustershift = 0;
+			(1U << fs->fs_clustershift) < fs->fs_clustersize;
+			fs->fs_clustershift++)
+		;
 
 
 	/**
 	 * Load up the "filesystem" structure with the appropriate
 	 * data from the boot block, so that we know how large
-	 * the various parts of the system are, etc.
+	 * the various parts of the system are, etc.  A FAT-32 boot
+	 * block gives the FAT size in its extension instead, and
+	 * has no fixed root directory.
 	 */
+	bb32 = (const struct fat12fs_BOOTBLOCK32 *) bootblock.bb_extra;
 	bcopy((char *)&bootblock.bb_reserved_sectors,
 			(char *)&fs->fs_fatblock, 2);
-	bcopy((char *)&bootblock.bb_sectors_per_fat,
-			(char *)&fs->fs_fatsectors, 2);
+	bcopy((char *)&bootblock.bb_sectors_per_fat, (char *)&val, 2);
+	fs->fs_fatsectors = val;
+	if (fs->fs_fatsectors == 0)
+		bcopy((char *)&bb32->bb_sectors_per_fat_big,
+				(char *)&fs->fs_fatsectors, 4);
 
-	fs->fs_fatsize = (fs->fs_fatsectors * FS_BLKSIZE * 2) / 3;
 	fs->fs_numfats = bootblock.bb_num_fats;
 	fs->fs_rootdirblock = fs->fs_fatblock
 		+ (fs->fs_numfats * fs->fs_fatsectors);
@@ -173,24 +692,57 @@ fat12fsLoadBootBlock(struct fat12fs *fs)
 	/*
 	 * DOS 5 or later uses the long at the end to indicate the size
 	 * of large file systems, so adjust fs_fssize to be the number
-	 * of data blocks by subtracting out fs_datablock0.
+	 * of data clusters by subtracting out fs_datablock0, and
+	 * dividing what is left into clusters.
 	 */
 	if (fs->fs_fssize == 0)
 		bcopy((char *)&bootblock.bb_total_sectors_big,
 				(char *)&fs->fs_fssize, 4);
-	fs->fs_fssize = fs->fs_fssize - fs->fs_datablock0;
+	if (fs->fs_fssize <= fs->fs_datablock0) {
+		fprintf(stderr, "Filesystem has no room for data\n");
+		return (-1);
+	}
+	fs->fs_fssize = (fs->fs_fssize - fs->fs_datablock0)
+			/ fs->fs_clustersectors;
 
 
 	/*
-	 * If there are > FAT12_MAXSIZE data blocks, the file system is
-	 * FAT16 or FAT32.
+	 * The number of data clusters alone says which width of FAT
+	 * this is: up to FAT12_MAXSIZE is FAT-12, up to FAT16_MAXSIZE
+	 * is FAT-16, and anything larger is FAT-32, which must also
+	 * keep its root directory in a chain of clusters.
 	 */
-	if (fs->fs_fssize == 0 || fs->fs_fssize > FAT12_MAXSIZE) {
+	if (fs->fs_fssize == 0 || fs->fs_fssize > FAT32_MAXSIZE) {
 		fprintf(stderr,
-			"Not a FAT-12 filesystem. FAT size is %d\n",
+			"Not a FAT filesystem. FAT size is %u\n",
 				fs->fs_fssize);
 		return (-1);
 	}
+	fs->fs_rootcluster = 0;
+	if (fs->fs_fssize <= FAT12_MAXSIZE) {
+		fs->fs_fatbits = 12;
+		fs->fs_fateof = FAT12_EOF1;
+		fs->fs_fatmask = FAT12_EOFF;
+	} else if (fs->fs_fssize <= FAT16_MAXSIZE) {
+		fs->fs_fatbits = 16;
+		fs->fs_fateof = FAT16_EOF1;
+		fs->fs_fatmask = FAT16_EOFF;
+	} else {
+		fs->fs_fatbits = 32;
+		fs->fs_fateof = FAT32_EOF1;
+		fs->fs_fatmask = FAT32_EOFF;
+		bcopy((char *)&bb32->bb_root_cluster,
+				(char *)&fs->fs_rootcluster, 4);
+		if (fs->fs_rootdirsize != 0 || fs->fs_rootcluster < 2
+				|| fs->fs_rootcluster >= fs->fs_fssize + 2) {
+			fprintf(stderr,
+				"Bad FAT-32 root directory at %u\n",
+					fs->fs_rootcluster);
+			return (-1);
+		}
+		fs->fs_rootdirblock = fat12fsClusterBlock(fs,
+				fs->fs_rootcluster);
+	}
 
 
 	/*
@@ -206,7 +758,9 @@ fat12fsLoadBootBlock(struct fat12fs *fs)
 	 * at the end because the filesystem size may not be an even
 	 * multiple of FAT-block indexable entries
 	 */
-	if (fs->fs_fssize < fs->fs_fatsize)
+	fs->fs_fatsize = (int) (((uint64_t) fs->fs_fatsectors
+				* FS_BLKSIZE * 8) / fs->fs_fatbits);
+	if (fs->fs_fssize < (unsigned int) fs->fs_fatsize)
 		fs->fs_fatsize = fs->fs_fssize;
 
 	return (0);
@@ -219,117 +773,55 @@ fat12fsLoadBootBlock(struct fat12fs *fs)
 void
 fat12fsDeleteFSData(struct fat12fs *fs)
 {
+	struct arena ar;
+
 	if (fs != NULL) {
-		if (fs->fs_fatdata != NULL) {
-			free (fs->fs_fatdata);
+		/**
+		 * the FAT, rootdir and their indexes are in the mapping,
+		 * the sidecar or the arena, and go with those; only the
+		 * extent maps were malloc'ed one by one
+		 */
+		if (fs->fs_map != NULL) {
+			munmap((void *) fs->fs_map, fs->fs_mapsize);
 		}
-		if (fs->fs_rootdirentry != NULL) {
-			free (fs->fs_rootdirentry);
+		if (fs->fs_extents != NULL) {
+			fat12fsInvalidateExtents(fs, -1);
 		}
-		free(fs);
-	}
-}
-
-
-/**
- * "Mount" a file system.  As this code does not do any caching
- * itself, "mount" is quite simple:
- *   - load boot block and ensure the filesystem is actually correct
- *   - load up the FAT information so we can find file blocks
- *   - load up the "root" directory, so we can look up files.
- *
- * If this were going to be an efficient read/write file system,
- * a set of managed buffers for cached data would need to be set
- * up as well
- */
-struct fat12fs *
-fat12fsMount(const char *filename)
-{
-	struct fat12fs *fs;
-	int nDirBlocks;
-	int fd;
-	int i;
-
-
-	/** if we can't open this file, just bail */
-	if ((fd = open(filename, O_RDONLY, 06000)) < 0) {
-		return NULL;
-	}
-
-
-	/**
-	 * if we have opened it, allocate the storage to figure out
-	 * what is inside
-	 */
-	fs = (struct fat12fs *) malloc(sizeof(struct fat12fs));
-	fs->fs_rootdirentry = NULL;
-	fs->fs_fatdata = NULL;
-	fs->fs_fd = fd;
-
-
-	if (fat12fsLoadBootBlock(fs) < 0) {
-		goto FAIL;
-	}
-
-
-	/**
-	 * read FAT into memory
-	 */
-	fs->fs_fatdata = (unsigned char *)
-			malloc(FS_BLKSIZE * fs->fs_fatsectors);
-
-	for (i = 0; i < fs->fs_fatsectors; i++) {
-		if (fat12fsRawDiskRead(fs->fs_fd, fs->fs_fatblock + i,
-				(char *) &fs->fs_fatdata[i * FS_BLKSIZE]) < 0) {
-			goto FAIL;
+		if (fs->fs_sidecar != NULL) {
+			munmap(fs->fs_sidecar, fs->fs_sidecarsize);
 		}
-	}
-
-
-	/**
-	 * read rootdir into memory
-	 */
-	fs->fs_rootdirentry = (struct fat12fs_DIRENTRY *)
-			malloc(fs->fs_rootdirsize
-				* sizeof(struct fat12fs_DIRENTRY));
-
-	nDirBlocks = (fs->fs_rootdirsize / FAT_DIRPERBLK);
-	for (i = 0; i < nDirBlocks; i++) {
-		if (fat12fsRawDiskRead(fs->fs_fd, fs->fs_rootdirblock + i,
-				(char *) &fs->fs_rootdirentry[
-						i * FAT_DIRPERBLK
-					]) < 0) {
-			goto FAIL;
+		fat12fsCacheFree(&fs->fs_cache);
+		fat12fsDcacheFree(&fs->fs_dcache);
+		blockDeviceClose(fs->fs_bdev);
+		pthread_mutex_destroy(&fs->fs_loadlock);
+		if (fs->fs_fd >= 0) {
+			close(fs->fs_fd);
 		}
+		ar = fs->fs_arena;
+		arenaFree(&ar);
 	}
-
-	printf("Mounted :: loaded bootblock, fat and rootdir\n");
-	return fs;
-
-
-FAIL:
-	fat12fsDeleteFSData(fs);
-	return NULL;
 }
 
 
 /**
- * As mentioned in "mount" above, there is no managed cache in this
- * code.  As there is no cache, there is very little to clean up,
- * and nothing to "flush" to the disk.
+ * Fill in the options used by a plain fat12fsMount()
  */
-int
-fat12fsUmount(struct fat12fs *fs)
+void
+fat12fsDefaultOptions(struct fat12fs_options *opts)
 {
-	fat12fsDeleteFSData(fs);
-	printf("Unmounted :: cleaned up\n");
-	return 0;
+	opts->mo_flags = 0;
+	opts->mo_cacheblocks = FAT12FS_CACHEBLOCKS;
+	opts->mo_logfp = NULL;
+	opts->mo_queuedepth = BLOCKDEV_QUEUEDEPTH;
+	opts->mo_readahead = FAT12FS_READAHEAD;
+	opts->mo_sidecar = NULL;
+	opts->mo_dentries = FAT12FS_DENTRIES;
 }
 
 
 /**
- * read the appropriate 12 bits from the packed block of FAT
- * entries and convert it into a 16-bit number.
+ * Unpack the 12-bit FAT entries found in "nbytes" bytes of packed
+ * FAT data into "nentries" 32-bit values, using plain C.
  *
  * The twiddling here is done because in every
  *    24 bits = 3 * 8 bytes, there are
@@ -344,282 +836,5357 @@ fat12fsUmount(struct fat12fs *fs)
  *	00000000 00001111  11111111
  *	|------- ---||---  -------|
  */
-unsigned short
-fat12fsGetFatEntry(struct fat12fs *fs, int index)
+static void
+fat12fsUnpackFatScalar(uint32_t *table, const unsigned char *packed,
+		int first, int nentries)
 {
-	unsigned short val;
+	const unsigned char *p;
 	int i;
 
-	i = (index * 3) / 2;
-	bcopy((char *)&fs->fs_fatdata[i], (char *)&val, 2);
-	if (index & 0x1)
-		val >>= 4;
-	val &= 0xfff;
-	return (val);
+	for (i = first; i < nentries; i++) {
+		p = &packed[(i * 3) / 2];
+		if (i & 0x1)
+			table[i] = (p[0] >> 4) | (p[1] << 4);
+		else
+			table[i] = p[0] | ((p[1] & 0x0f) << 8);
+	}
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
 
 /**
- * Print the FAT table out to the supplied FILE pointer
+ * SSSE3 version of the unpack: each 12 bytes of packed data are
+ * shuffled into eight 16-bit lanes holding the byte pairs (0,1),
+ * (1,2), (3,4), (4,5) ..., then the even lanes are masked down to
+ * 12 bits and the odd lanes shifted right by 4, and the lanes are
+ * widened to 32 bits as they are stored.
  *
- * This should be printed in hexadecimal, with 16 entries
- * per row.
+ * Returns the number of entries converted; the caller finishes off
+ * the tail with the scalar version.
  */
-int
-fat12fsDumpFat(FILE *ofp, struct fat12fs *fs)
+__attribute__((target("ssse3")))
+static int
+fat12fsUnpackFatSSSE3(uint32_t *table, const unsigned char *packed,
+		int nentries, int nbytes)
 {
-	fprintf(ofp, "FAT table dump FORMATTED:\n");
-	int printed = 0;
-	for (int i = 0; i < fs->fs_fatsize; i++) {
-		unsigned short fatEntry = fat12fsGetFatEntry(fs, i);
+	const __m128i shuf = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5,
+			6, 7, 7, 8, 9, 10, 10, 11);
+	const __m128i evenmask = _mm_setr_epi16(0x0fff, 0, 0x0fff, 0,
+			0x0fff, 0, 0x0fff, 0);
+	const __m128i oddmask = _mm_setr_epi16(0, -1, 0, -1, 0, -1, 0, -1);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v;
+	int i, off;
 
-		if (fatEntry != FAT12_FREE) {
-			if (fatEntry == FAT12_EOF1 || fatEntry == FAT12_EOFF) {
-				fprintf(ofp, "|%.4d: EOF|", i);
-			} else {
-				fprintf(ofp, "|%.4d:%.4hu|", i, fatEntry);
-			}
-			printed++;
-		}
-		if (printed % 8 == 0) {
-			fprintf(ofp, "\n");
-		}
+	/** we load 16 bytes to use 12, so stay clear of the end */
+	for (i = 0, off = 0; i + 8 <= nentries && off + 16 <= nbytes;
+			i += 8, off += 12) {
+		v = _mm_loadu_si128((const __m128i *) &packed[off]);
+		v = _mm_shuffle_epi8(v, shuf);
+		v = _mm_or_si128(_mm_and_si128(v, evenmask),
+				_mm_and_si128(_mm_srli_epi16(v, 4), oddmask));
+		_mm_storeu_si128((__m128i *) &table[i],
+				_mm_unpacklo_epi16(v, zero));
+		_mm_storeu_si128((__m128i *) &table[i + 4],
+				_mm_unpackhi_epi16(v, zero));
 	}
+	return i;
+}
+#endif
 
-	fprintf(ofp, "\n\nFAT table dump UNFORMATTED:\n");
-	for (int i = 0; i < fs->fs_fatsize; i++) {
-		if (i % 16 == 0) {
-			fprintf(ofp, "%.4d : ", i);
-		}
-		unsigned short fatEntry = fat12fsGetFatEntry(fs, i);
-		fprintf(ofp, " %.3x", fatEntry);
-		if (i % 16 == 15) {
-			fprintf(ofp, "\n");
-		}
+#if defined(__aarch64__)
+#include <arm_neon.h>
+
+/**
+ * Widen sixteen 16-bit entries, given as the even and the odd ones,
+ * and store them back in order as 32-bit entries
+ */
+static inline void
+fat12fsStoreEntriesNEON(uint32_t *table, uint16x8_t even, uint16x8_t odd)
+{
+	uint16x8x2_t z = vzipq_u16(even, odd);
+
+	vst1q_u32(&table[0], vmovl_u16(vget_low_u16(z.val[0])));
+	vst1q_u32(&table[4], vmovl_u16(vget_high_u16(z.val[0])));
+	vst1q_u32(&table[8], vmovl_u16(vget_low_u16(z.val[1])));
+	vst1q_u32(&table[12], vmovl_u16(vget_high_u16(z.val[1])));
+}
+
+/**
+ * NEON version of the unpack: vld3 de-interleaves 48 packed bytes
+ * into the first, middle and last byte of 16 entry pairs, which are
+ * combined into even and odd entries and stored re-interleaved.
+ */
+static int
+fat12fsUnpackFatNEON(uint32_t *table, const unsigned char *packed,
+		int nentries, int nbytes)
+{
+	uint8x16x3_t b;
+	uint16x8x2_t lo, hi;
+	uint8x16_t mid_lo, mid_hi;
+	int i, off;
+
+	for (i = 0, off = 0; i + 32 <= nentries && off + 48 <= nbytes;
+			i += 32, off += 48) {
+		b = vld3q_u8(&packed[off]);
+		mid_lo = vandq_u8(b.val[1], vdupq_n_u8(0x0f));
+		mid_hi = vshrq_n_u8(b.val[1], 4);
+
+		lo.val[0] = vorrq_u16(vmovl_u8(vget_low_u8(b.val[0])),
+				vshlq_n_u16(vmovl_u8(vget_low_u8(mid_lo)), 8));
+		lo.val[1] = vorrq_u16(vmovl_u8(vget_low_u8(mid_hi)),
+				vshlq_n_u16(vmovl_u8(vget_low_u8(b.val[2])), 4));
+		hi.val[0] = vorrq_u16(vmovl_u8(vget_high_u8(b.val[0])),
+				vshlq_n_u16(vmovl_u8(vget_high_u8(mid_lo)), 8));
+		hi.val[1] = vorrq_u16(vmovl_u8(vget_high_u8(mid_hi)),
+				vshlq_n_u16(vmovl_u8(vget_high_u8(b.val[2])), 4));
+
+		fat12fsStoreEntriesNEON(&table[i], lo.val[0], lo.val[1]);
+		fat12fsStoreEntriesNEON(&table[i + 16], hi.val[0], hi.val[1]);
+	}
+	return i;
+}
+#endif
+
+/**
+ * Unpack as much of a 12-bit FAT as we can with whatever vector unit
+ * this machine has, and the rest with the scalar code
+ */
+static void
+fat12fsUnpackFat12(uint32_t *table, const unsigned char *packed,
+		int nentries, int nbytes)
+{
+	int done = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("ssse3"))
+		done = fat12fsUnpackFatSSSE3(table, packed, nentries, nbytes);
+#elif defined(__aarch64__)
+	done = fat12fsUnpackFatNEON(table, packed, nentries, nbytes);
+#endif
+
+	fat12fsUnpackFatScalar(table, packed, done, nentries);
+}
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define	fat12fsLittleEndian16(w)	__builtin_bswap16(w)
+#define	fat12fsLittleEndian32(w)	__builtin_bswap32(w)
+#else
+#define	fat12fsLittleEndian16(w)	(w)
+#define	fat12fsLittleEndian32(w)	(w)
+#endif
+
+/**
+ * The 16 and 32-bit FATs hold whole little-endian words, so their
+ * unpack is a plain load of each (which compilers vectorize well),
+ * masked down to the bits the width uses
+ */
+#define	FAT12FS_UNPACKWORDS(bits, type, mask)				\
+static void								\
+fat12fsUnpackFat##bits(uint32_t *table, const unsigned char *packed,	\
+		int nentries, int nbytes)				\
+{									\
+	type word;							\
+	int i;								\
+									\
+	if (nentries > nbytes / (int) sizeof(type))			\
+		nentries = nbytes / (int) sizeof(type);			\
+	for (i = 0; i < nentries; i++) {				\
+		memcpy(&word, &packed[i * sizeof(type)], sizeof(type));	\
+		table[i] = fat12fsLittleEndian##bits(word) & (mask);	\
+	}								\
+}
+
+FAT12FS_UNPACKWORDS(16, uint16_t, FAT16_EOFF)
+FAT12FS_UNPACKWORDS(32, uint32_t, FAT32_EOFF)
+
+/**
+ * Unpack a FAT of whichever width the filesystem uses into the flat
+ * table; once unpacked, walking a chain is the same for every width
+ */
+static void
+fat12fsUnpackFat(struct fat12fs *fs, uint32_t *table,
+		const unsigned char *packed, int nbytes)
+{
+	switch (fs->fs_fatbits) {
+	case 12:
+		fat12fsUnpackFat12(table, packed, fs->fs_fatsize, nbytes);
+		break;
+	case 16:
+		fat12fsUnpackFat16(table, packed, fs->fs_fatsize, nbytes);
+		break;
+	default:
+		fat12fsUnpackFat32(table, packed, fs->fs_fatsize, nbytes);
+		break;
+	}
+}
+
+
+/**
+ * Set a bit in the free map for each of the given table entries which
+ * is free, using plain C
+ */
+static void
+fat12fsFreeMaskScalar(uint64_t *map, const uint32_t *table,
+		int first, int nentries)
+{
+	int i;
+
+	for (i = first; i < nentries; i++) {
+		if (table[i] == FAT12_FREE)
+			map[i / 64] |= (uint64_t) 1 << (i % 64);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * SSE2 version of the free mask: compare four entries at a time to
+ * zero, pack four compares down to bytes and take their sign bits, so
+ * each 64-entry word of the map is four movemasks.
+ */
+__attribute__((target("sse2")))
+static int
+fat12fsFreeMaskSSE2(uint64_t *map, const uint32_t *table, int nentries)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a, b, c, d;
+	uint64_t word;
+	int i, j;
+
+	for (i = 0; i + 64 <= nentries; i += 64) {
+		word = 0;
+		for (j = 0; j < 64; j += 16) {
+			a = _mm_cmpeq_epi32(_mm_loadu_si128(
+				(const __m128i *) &table[i + j]), zero);
+			b = _mm_cmpeq_epi32(_mm_loadu_si128(
+				(const __m128i *) &table[i + j + 4]), zero);
+			c = _mm_cmpeq_epi32(_mm_loadu_si128(
+				(const __m128i *) &table[i + j + 8]), zero);
+			d = _mm_cmpeq_epi32(_mm_loadu_si128(
+				(const __m128i *) &table[i + j + 12]), zero);
+			word |= (uint64_t) (unsigned int) _mm_movemask_epi8(
+					_mm_packs_epi16(_mm_packs_epi32(a, b),
+						_mm_packs_epi32(c, d))) << j;
+		}
+		map[i / 64] = word;
+	}
+	return i;
+}
+#endif
+
+#if defined(__aarch64__)
+/**
+ * NEON version of the free mask: compare eight entries to zero,
+ * narrow the result to bytes, and weight and sum them into a byte
+ * of the map.
+ */
+static int
+fat12fsFreeMaskNEON(uint64_t *map, const uint32_t *table, int nentries)
+{
+	static const uint8_t weights[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+	const uint8x8_t w = vld1_u8(weights);
+	uint8x8_t m;
+	uint64_t word;
+	int i, j;
+
+	for (i = 0; i + 64 <= nentries; i += 64) {
+		word = 0;
+		for (j = 0; j < 64; j += 8) {
+			m = vmovn_u16(vcombine_u16(
+				vmovn_u32(vceqzq_u32(vld1q_u32(&table[i + j]))),
+				vmovn_u32(vceqzq_u32(
+					vld1q_u32(&table[i + j + 4])))));
+			word |= (uint64_t) vaddv_u8(vand_u8(m, w)) << j;
+		}
+		map[i / 64] = word;
+	}
+	return i;
+}
+#endif
+
+
+/**
+ * Find the longest run of free blocks in the free map.  Whole words
+ * of free or used blocks are stepped over at once, since most of a
+ * FAT is one or the other.
+ */
+static void
+fat12fsFindFreeRun(struct fat12fs *fs)
+{
+	uint64_t word;
+	int nwords;
+	int run, start;
+	int i, w;
+
+	nwords = (fs->fs_fatsize + 63) / 64;
+	fs->fs_freerun = 0;
+	fs->fs_freerunstart = -1;
+	run = start = 0;
+	for (w = 0; w < nwords; w++) {
+		word = fs->fs_freemap[w];
+		if (word == ~(uint64_t) 0) {
+			if (run == 0)
+				start = w * 64;
+			run += 64;
+			continue;
+		}
+		for (i = 0; i < 64; i++) {
+			if (word == 0 && run == 0)
+				break;
+			if (word & ((uint64_t) 1 << i)) {
+				if (run == 0)
+					start = w * 64 + i;
+				run++;
+				continue;
+			}
+			if (run > fs->fs_freerun) {
+				fs->fs_freerun = run;
+				fs->fs_freerunstart = start;
+			}
+			run = 0;
+		}
+	}
+	if (run > fs->fs_freerun) {
+		fs->fs_freerun = run;
+		fs->fs_freerunstart = start;
+	}
+
+	fs->fs_freestale = 0;
+}
+
+
+/**
+ * Summarize the unpacked FAT as a bitmap with a bit set for every
+ * free data block, and from it the number of free blocks and the
+ * longest run of them, so that questions about space never need to
+ * go back over the table
+ */
+static int
+fat12fsBuildFreeMap(struct fat12fs *fs)
+{
+	int nwords;
+	int done = 0;
+	int w;
+
+	nwords = (fs->fs_fatsize + 63) / 64;
+	fs->fs_freemap = (uint64_t *) arenaCalloc(&fs->fs_arena,
+			nwords, sizeof(uint64_t));
+	if (fs->fs_freemap == NULL)
+		return (-1);
+
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("sse2"))
+		done = fat12fsFreeMaskSSE2(fs->fs_freemap,
+				fs->fs_fattable, fs->fs_fatsize);
+#elif defined(__aarch64__)
+	done = fat12fsFreeMaskNEON(fs->fs_freemap,
+			fs->fs_fattable, fs->fs_fatsize);
+#endif
+	fat12fsFreeMaskScalar(fs->fs_freemap, fs->fs_fattable,
+			done, fs->fs_fatsize);
+
+	/** entries 0 and 1 are reserved, not blocks */
+	fs->fs_freemap[0] &= ~(uint64_t) 0x3;
+
+	fs->fs_nfree = 0;
+	for (w = 0; w < nwords; w++)
+		fs->fs_nfree += __builtin_popcountll(fs->fs_freemap[w]);
+
+	fat12fsFindFreeRun(fs);
+	return 0;
+}
+
+
+/**
+ * Load the packed FAT into memory (or point at it in the mapping)
+ * and unpack it into the flat fs_fattable used for chain walking.
+ *
+ * If "checkCopies" is set, each of the other fs_numfats copies of the
+ * FAT is compared against the first, and the number of entries which
+ * disagree in any copy is left in fs_fatmismatch.
+ *
+ * The packed FAT, the table and the free map are carved from a
+ * single reservation in the mount's arena; the copies compared are
+ * given back to it before returning.
+ */
+static int
+fat12fsLoadFat(struct fat12fs *fs, int checkCopies)
+{
+	struct arenaMark mark;
+	uint32_t *other;
+	unsigned char *copy;
+	const char *blk;
+	int nbytes;
+	int c, i;
+
+	nbytes = FS_BLKSIZE * fs->fs_fatsectors;
+
+	if (arenaReserve(&fs->fs_arena, (size_t) nbytes
+			+ (size_t) fs->fs_fatsize * sizeof(uint32_t)
+			+ ((size_t) fs->fs_fatsize + 63) / 64 * sizeof(uint64_t)
+			+ 3 * ARENA_MAXALIGN) < 0)
+		return (-1);
+
+	if (fs->fs_map != NULL) {
+		fs->fs_fatdata = (unsigned char *) fat12fsMapBlocks(fs,
+				fs->fs_fatblock, fs->fs_fatsectors);
+		if (fs->fs_fatdata == NULL)
+			return (-1);
+	} else {
+		/** the FAT is read once, so it goes around the cache */
+		fs->fs_fatdata = (unsigned char *) arenaAlloc(&fs->fs_arena,
+				nbytes, ARENA_MAXALIGN);
+		if (fs->fs_fatdata == NULL)
+			return (-1);
+		if (blockDeviceRead(fs->fs_bdev, (char *) fs->fs_fatdata,
+				nbytes, (off_t) fs->fs_fatblock * FS_BLKSIZE) < 0)
+			return (-1);
+	}
+
+	fs->fs_fattable = (uint32_t *) arenaAlloc(&fs->fs_arena,
+			fs->fs_fatsize * sizeof(uint32_t), ARENA_MAXALIGN);
+	if (fs->fs_fattable == NULL)
+		return (-1);
+	fat12fsUnpackFat(fs, fs->fs_fattable, fs->fs_fatdata, nbytes);
+	if (fat12fsBuildFreeMap(fs) < 0)
+		return (-1);
+
+	fs->fs_fatmismatch = 0;
+	if (!checkCopies || fs->fs_numfats < 2)
+		return 0;
+
+	/**
+	 * Compare the packed bytes first; only if a copy differs do
+	 * we unpack it to count the entries which disagree
+	 */
+	arenaGetMark(&fs->fs_arena, &mark);
+	copy = (unsigned char *) arenaAlloc(&fs->fs_arena, nbytes, 0);
+	other = (uint32_t *) arenaAlloc(&fs->fs_arena,
+			fs->fs_fatsize * sizeof(uint32_t), 0);
+	if (copy == NULL || other == NULL) {
+		arenaRelease(&fs->fs_arena, &mark);
+		return (-1);
+	}
+
+	for (c = 1; c < fs->fs_numfats; c++) {
+		blk = (const char *) fat12fsMapBlocks(fs,
+				fs->fs_fatblock + (c * fs->fs_fatsectors),
+				fs->fs_fatsectors);
+		if (blk != NULL) {
+			memcpy(copy, blk, nbytes);
+		} else if (blockDeviceRead(fs->fs_bdev, (char *) copy, nbytes,
+				(off_t) (fs->fs_fatblock
+					+ (c * fs->fs_fatsectors))
+					* FS_BLKSIZE) < 0) {
+			fprintf(stderr, "Failed reading FAT copy %d\n", c);
+			fs->fs_fatmismatch = fs->fs_fatsize;
+			break;
+		}
+		if (memcmp(copy, fs->fs_fatdata, nbytes) == 0)
+			continue;
+
+		fat12fsUnpackFat(fs, other, copy, nbytes);
+		for (i = 0; i < fs->fs_fatsize; i++) {
+			if (other[i] != fs->fs_fattable[i])
+				fs->fs_fatmismatch++;
+		}
+	}
+
+	arenaRelease(&fs->fs_arena, &mark);
+	return 0;
+}
+
+
+/**
+ * Gather a FAT-32 root directory from its chain of clusters, which
+ * needs the FAT to have been loaded first.  The chain may hold no
+ * more than FAT_MAXDIR entries, which also bounds the walk of a
+ * chain that loops.
+ */
+static int
+fat12fsLoadRootChain(struct fat12fs *fs)
+{
+	int maxclusters, nclusters;
+	unsigned int cur;
+
+	maxclusters = (FAT_MAXDIR * sizeof(struct fat12fs_DIRENTRY))
+			>> fs->fs_clustershift;
+	if (maxclusters < 1)
+		maxclusters = 1;
+
+	nclusters = 0;
+	for (cur = fs->fs_rootcluster;
+			cur >= 2 && cur < (unsigned int) fs->fs_fatsize;
+			cur = fs->fs_fattable[cur]) {
+		if (nclusters == maxclusters) {
+			fprintf(stderr,
+				"Root directory is over %d entries\n",
+					FAT_MAXDIR);
+			return (-1);
+		}
+		nclusters++;
+	}
+
+	fs->fs_rootdirentry = (struct fat12fs_DIRENTRY *) arenaAlloc(
+			&fs->fs_arena, (size_t) nclusters << fs->fs_clustershift,
+			0);
+	if (fs->fs_rootdirentry == NULL)
+		return (-1);
+	fs->fs_rootdirsize = (nclusters << fs->fs_clustershift)
+			/ sizeof(struct fat12fs_DIRENTRY);
+
+	nclusters = 0;
+	for (cur = fs->fs_rootcluster;
+			cur >= 2 && cur < (unsigned int) fs->fs_fatsize;
+			cur = fs->fs_fattable[cur]) {
+		if (fat12fsLoadDataBlock(fs, (char *) fs->fs_rootdirentry
+				+ ((size_t) nclusters++ << fs->fs_clustershift),
+				cur) < 0)
+			return (-1);
+	}
+	return 0;
+}
+
+
+/**
+ * Load the root directory into memory, or point at it in the mapping
+ */
+static int
+fat12fsLoadRootdir(struct fat12fs *fs)
+{
+	int nDirBlocks;
+
+	if (fs->fs_rootcluster != 0)
+		return fat12fsLoadRootChain(fs);
+
+	nDirBlocks = (fs->fs_rootdirsize / FAT_DIRPERBLK);
+
+	if (fs->fs_map != NULL) {
+		fs->fs_rootdirentry = (struct fat12fs_DIRENTRY *)
+				fat12fsMapBlocks(fs,
+					fs->fs_rootdirblock, nDirBlocks);
+		return (fs->fs_rootdirentry == NULL) ? -1 : 0;
+	}
+
+	fs->fs_rootdirentry = (struct fat12fs_DIRENTRY *) arenaAlloc(
+			&fs->fs_arena, fs->fs_rootdirsize
+				* sizeof(struct fat12fs_DIRENTRY), 0);
+	if (fs->fs_rootdirentry == NULL)
+		return (-1);
+
+	return blockDeviceRead(fs->fs_bdev, (char *) fs->fs_rootdirentry,
+			(size_t) nDirBlocks * FS_BLKSIZE,
+			(off_t) fs->fs_rootdirblock * FS_BLKSIZE);
+}
+
+
+/**
+ * Build the normalized 11 byte "NAME    EXT" key for a file name
+ * as typed by a user, upper-casing it and padding each part with
+ * spaces as DOS stores them.  Returns (-1) if the name cannot be
+ * an 8.3 name.
+ */
+static int
+fat12fsNameKey(const char *filename, unsigned char *key)
+{
+	int i, j;
+
+	memset(key, ' ', FAT12FS_KEYLEN);
+	for (i = 0; filename[i] != '\0' && filename[i] != '.'; i++) {
+		if (i >= 8)
+			return (-1);
+		key[i] = toupper((unsigned char) filename[i]);
+	}
+	if (i == 0)
+		return (-1);
+
+	if (filename[i] == '.') {
+		for (i++, j = 0; filename[i] != '\0'; i++, j++) {
+			if (j >= 3 || filename[i] == '.')
+				return (-1);
+			key[8 + j] = toupper((unsigned char) filename[i]);
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Build the key for a directory entry as it is stored on disk
+ */
+static void
+fat12fsEntryKey(const struct fat12fs_DIRENTRY *de, unsigned char *key)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		key[i] = toupper(de->de_name[i]);
+	for (i = 0; i < 3; i++)
+		key[8 + i] = toupper(de->de_nameext[i]);
+	if (key[0] == NAME0_E5)
+		key[0] = NAME0_DELETED;
+}
+
+
+/**
+ * FNV-1a over the 11 key bytes
+ */
+static unsigned int
+fat12fsKeyHash(const unsigned char *key)
+{
+	unsigned int h = 2166136261u;
+	int i;
+
+	for (i = 0; i < FAT12FS_KEYLEN; i++) {
+		h ^= key[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+/**
+ * Fill in the open-addressed hash index over the root directory,
+ * whose slots have already been allocated.
+ *
+ * Only files and directories are entered -- empty, deleted and volume
+ * (which includes long name pieces) entries are left out, and if a
+ * name appears twice the first slot wins, as it would in a linear
+ * scan.  Directories are there for path lookup to start from; a
+ * search for a file passes over them.
+ */
+static void
+fat12fsFillDirIndex(struct fat12fs *fs)
+{
+	struct fat12fs_dirindex *di = &fs->fs_dirindex;
+	const struct fat12fs_DIRENTRY *de;
+	unsigned char key[FAT12FS_KEYLEN];
+	unsigned int h;
+	int i;
+
+	for (i = 0; i <= di->di_mask; i++)
+		di->di_hash[i].dh_slot = -1;
+
+	for (i = 0; i < fs->fs_rootdirsize; i++) {
+		de = &fs->fs_rootdirentry[i];
+		if (de->de_name[0] == NAME0_EMPTY
+				|| de->de_name[0] == NAME0_DELETED
+				|| (de->de_attributes & ATTR_VOLUME))
+			continue;
+
+		fat12fsEntryKey(de, key);
+		for (h = fat12fsKeyHash(key) & di->di_mask;
+				di->di_hash[h].dh_slot >= 0;
+				h = (h + 1) & di->di_mask) {
+			if (memcmp(di->di_hash[h].dh_key, key,
+					FAT12FS_KEYLEN) == 0)
+				break;
+		}
+		if (di->di_hash[h].dh_slot < 0) {
+			di->di_hash[h].dh_slot = i;
+			memcpy(di->di_hash[h].dh_key, key, FAT12FS_KEYLEN);
+		}
+	}
+}
+
+
+/**
+ * Build the hash index over the root directory, with room for
+ * twice as many names as the rootdir has slots, so that a write
+ * mount can refill it in place as files come and go
+ */
+static int
+fat12fsBuildDirIndex(struct fat12fs *fs)
+{
+	struct fat12fs_dirindex *di = &fs->fs_dirindex;
+	int nslots;
+
+	for (nslots = 8; nslots < 2 * fs->fs_rootdirsize; nslots <<= 1)
+		;
+
+	di->di_hash = (struct fat12fs_dirhash *) arenaAlloc(&fs->fs_arena,
+			nslots * sizeof(struct fat12fs_dirhash), 0);
+	if (di->di_hash == NULL)
+		return (-1);
+	di->di_mask = nslots - 1;
+	fat12fsFillDirIndex(fs);
+	return 0;
+}
+
+
+/**
+ * Check whether a part of the filesystem has been loaded yet.  The
+ * acquire pairs with the release in fat12fsSetLoaded(), so a thread
+ * which sees the bit also sees everything the load wrote.
+ */
+static inline int
+fat12fsIsLoaded(struct fat12fs *fs, int part)
+{
+	return (__atomic_load_n(&fs->fs_loaded, __ATOMIC_ACQUIRE) & part) != 0;
+}
+
+static inline void
+fat12fsSetLoaded(struct fat12fs *fs, int part)
+{
+	(void) __atomic_fetch_or(&fs->fs_loaded, part, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Load the FAT with fs_loadlock held, which also serializes use of
+ * the mount's arena
+ */
+static int
+fat12fsEnsureFatLocked(struct fat12fs *fs)
+{
+	struct arenaMark mark;
+
+	if (fs->fs_loaded & FAT12FS_LOADED_FAT)
+		return 0;
+
+	arenaGetMark(&fs->fs_arena, &mark);
+	if (fat12fsLoadFat(fs, (fs->fs_flags & FAT12FS_MOUNT_CHECKFATS)) < 0) {
+		arenaRelease(&fs->fs_arena, &mark);
+		fs->fs_fatdata = NULL;
+		fs->fs_fattable = NULL;
+		fs->fs_freemap = NULL;
+		return (-1);
+	}
+	if (fs->fs_fatmismatch > 0) {
+		fprintf(stderr,
+			"Warning: %d FAT entries differ between the"
+			" %d copies of the FAT\n",
+				fs->fs_fatmismatch, fs->fs_numfats);
+	}
+
+	fat12fsSetLoaded(fs, FAT12FS_LOADED_FAT);
+	return 0;
+}
+
+
+/**
+ * Make sure the FAT has been loaded, unpacked and summarized,
+ * doing so now if the mount was lazy.  Anything left from a load
+ * which failed part way is released, so that a later call can try
+ * again.  Threads racing to be first are serialized on fs_loadlock,
+ * and once the FAT is in, the check costs a single atomic load.
+ */
+static int
+fat12fsEnsureFat(struct fat12fs *fs)
+{
+	int status;
+
+	if (fat12fsIsLoaded(fs, FAT12FS_LOADED_FAT))
+		return 0;
+
+	pthread_mutex_lock(&fs->fs_loadlock);
+	status = fat12fsEnsureFatLocked(fs);
+	pthread_mutex_unlock(&fs->fs_loadlock);
+	return status;
+}
+
+
+/**
+ * Load and index the root directory with fs_loadlock held.  The
+ * chain of a FAT-32 root directory is found through the FAT, so that
+ * is loaded first.
+ */
+static int
+fat12fsEnsureRootdirLocked(struct fat12fs *fs)
+{
+	struct arenaMark mark;
+
+	if (fs->fs_loaded & FAT12FS_LOADED_ROOTDIR)
+		return 0;
+
+	if (fs->fs_rootcluster != 0 && fat12fsEnsureFatLocked(fs) < 0)
+		return (-1);
+
+	/** extent maps are built on demand, one per rootdir slot */
+	arenaGetMark(&fs->fs_arena, &mark);
+	if (fat12fsLoadRootdir(fs) < 0 || fat12fsBuildDirIndex(fs) < 0
+			|| (fs->fs_extents = (struct fat12fs_extentmap **)
+				arenaCalloc(&fs->fs_arena, fs->fs_rootdirsize,
+				sizeof(struct fat12fs_extentmap *))) == NULL) {
+		arenaRelease(&fs->fs_arena, &mark);
+		fs->fs_rootdirentry = NULL;
+		fs->fs_dirindex.di_hash = NULL;
+		if (fs->fs_rootcluster != 0)
+			fs->fs_rootdirsize = 0;
+		return (-1);
+	}
+
+	fat12fsSetLoaded(fs, FAT12FS_LOADED_ROOTDIR);
+	return 0;
+}
+
+
+/**
+ * Make sure the root directory has been loaded and indexed, doing
+ * so now if the mount was lazy
+ */
+static int
+fat12fsEnsureRootdir(struct fat12fs *fs)
+{
+	int status;
+
+	if (fat12fsIsLoaded(fs, FAT12FS_LOADED_ROOTDIR))
+		return 0;
+
+	pthread_mutex_lock(&fs->fs_loadlock);
+	status = fat12fsEnsureRootdirLocked(fs);
+	pthread_mutex_unlock(&fs->fs_loadlock);
+	return status;
+}
+
+
+/** identifies a sidecar index, and the layout of this version of one */
+#define	SIDECAR_MAGIC		"FAT12IDX"
+#define	SIDECAR_VERSION		2
+
+/** each structure in a sidecar starts on a boundary of this many bytes */
+#define	SIDECAR_ALIGN		64
+
+/** sh_flags bits */
+#define	SIDECAR_FATSCHECKED	0x0001	/* the FAT copies were compared */
+
+/**
+ * The head of a sidecar index: the image it was built from, the
+ * geometry and summaries of the mount, and where each structure it
+ * holds starts, as a byte offset into the file.  The structures are
+ * kept in their in-memory form, so that a mount can use them where
+ * they lie in a mapping of the file.
+ *
+ * The extent index holds an offset for each rootdir slot, of the
+ * slot's extent map, or 0 if it has none.
+ */
+typedef struct fat12fs_sidecarheader {
+	char sh_magic[8];
+	uint32_t sh_version;
+	uint32_t sh_headersize;		/* sizeof this, so layouts never mix */
+	uint64_t sh_filesize;		/* size of the whole sidecar */
+
+	uint64_t sh_imagesize;		/* the image as the index saw it */
+	int64_t sh_imagemtime;
+	int64_t sh_imagemtimens;
+
+	uint32_t sh_fatblock;		/* what the boot block said */
+	uint32_t sh_fatsectors;
+	uint32_t sh_numfats;
+	uint32_t sh_fatbits;
+	uint32_t sh_clustersize;
+	uint32_t sh_fssize;
+	uint32_t sh_rootcluster;
+	uint32_t sh_rootdirsize;	/* as loaded, for a FAT-32 chain */
+	int32_t sh_fatsize;
+
+	uint32_t sh_flags;		/* SIDECAR_xxx bits */
+	int32_t sh_fatmismatch;
+	int32_t sh_nfree;
+	int32_t sh_freerun;
+	int32_t sh_freerunstart;
+	int32_t sh_dirmask;
+
+	uint64_t sh_fattable;		/* sh_fatsize 32-bit entries */
+	uint64_t sh_freemap;		/* a bit for each of them */
+	uint64_t sh_rootdir;		/* sh_rootdirsize directory entries */
+	uint64_t sh_dirhash;		/* sh_dirmask + 1 name hash slots */
+	uint64_t sh_extentindex;	/* sh_rootdirsize map offsets */
+} fat12fs_sidecarheader;
+
+
+static uint64_t
+fat12fsSidecarAlign(uint64_t offset)
+{
+	return (offset + SIDECAR_ALIGN - 1) & ~(uint64_t) (SIDECAR_ALIGN - 1);
+}
+
+/**
+ * Whether nbytes at "offset" lie within the sidecar, after its header
+ */
+static int
+fat12fsSidecarSpan(const struct fat12fs_sidecarheader *sh,
+		uint64_t offset, uint64_t nbytes)
+{
+	return offset >= sizeof(*sh) && (offset % sizeof(uint32_t)) == 0
+			&& offset <= sh->sh_filesize
+			&& nbytes <= sh->sh_filesize - offset;
+}
+
+/**
+ * Check that a sidecar describes this image as it is now, with the
+ * geometry the boot block has just given, and that everything it
+ * points to lies within it.  Its extent maps must all stay within
+ * the FAT and cover exactly the blocks they claim, in order, and its
+ * name hash must only name rootdir slots, so that
+ * a damaged sidecar can send the mount nowhere it could not go by
+ * reading the image itself.
+ */
+static int
+fat12fsSidecarValid(struct fat12fs *fs, const unsigned char *base,
+		size_t size, const struct stat *image)
+{
+	const struct fat12fs_sidecarheader *sh;
+	const struct fat12fs_dirhash *dh;
+	const struct fat12fs_extentmap *em;
+	const uint64_t *index;
+	uint64_t nslots, nblocks;
+	int i, e;
+
+	sh = (const struct fat12fs_sidecarheader *) base;
+	if (size < sizeof(*sh)
+			|| memcmp(sh->sh_magic, SIDECAR_MAGIC, 8) != 0
+			|| sh->sh_version != SIDECAR_VERSION
+			|| sh->sh_headersize != sizeof(*sh)
+			|| sh->sh_filesize != size)
+		return (-1);
+
+	if (sh->sh_imagesize != (uint64_t) image->st_size
+			|| sh->sh_imagemtime != (int64_t) image->st_mtim.tv_sec
+			|| sh->sh_imagemtimens
+				!= (int64_t) image->st_mtim.tv_nsec)
+		return (-1);
+
+	if (sh->sh_fatblock != fs->fs_fatblock
+			|| sh->sh_fatsectors != fs->fs_fatsectors
+			|| sh->sh_numfats != fs->fs_numfats
+			|| sh->sh_fatbits != fs->fs_fatbits
+			|| sh->sh_clustersize != fs->fs_clustersize
+			|| sh->sh_fssize != fs->fs_fssize
+			|| sh->sh_rootcluster != fs->fs_rootcluster
+			|| sh->sh_fatsize != fs->fs_fatsize
+			|| sh->sh_rootdirsize > FAT_MAXDIR
+			|| (fs->fs_rootcluster == 0
+				&& sh->sh_rootdirsize != fs->fs_rootdirsize))
+		return (-1);
+
+	/** an index built without comparing the FATs cannot say if they agree */
+	if ((fs->fs_flags & FAT12FS_MOUNT_CHECKFATS)
+			&& !(sh->sh_flags & SIDECAR_FATSCHECKED))
+		return (-1);
+
+	nslots = (uint64_t) sh->sh_dirmask + 1;
+	if (sh->sh_dirmask < 7 || (nslots & (nslots - 1)) != 0
+			|| nslots < 2 * (uint64_t) sh->sh_rootdirsize
+			|| !fat12fsSidecarSpan(sh, sh->sh_fattable,
+				(uint64_t) sh->sh_fatsize * sizeof(uint32_t))
+			|| (sh->sh_freemap % sizeof(uint64_t)) != 0
+			|| !fat12fsSidecarSpan(sh, sh->sh_freemap,
+				((sh->sh_fatsize + 63) / 64) * sizeof(uint64_t))
+			|| !fat12fsSidecarSpan(sh, sh->sh_rootdir,
+				sh->sh_rootdirsize * sizeof(fat12fs_DIRENTRY))
+			|| !fat12fsSidecarSpan(sh, sh->sh_dirhash,
+				nslots * sizeof(struct fat12fs_dirhash))
+			|| (sh->sh_extentindex % sizeof(uint64_t)) != 0
+			|| !fat12fsSidecarSpan(sh, sh->sh_extentindex,
+				sh->sh_rootdirsize * sizeof(uint64_t)))
+		return (-1);
+
+	dh = (const struct fat12fs_dirhash *) (base + sh->sh_dirhash);
+	for (i = 0; i < (int) nslots; i++) {
+		if (dh[i].dh_slot < -1 || dh[i].dh_slot >= (int) sh->sh_rootdirsize)
+			return (-1);
+	}
+
+	index = (const uint64_t *) (base + sh->sh_extentindex);
+	for (i = 0; i < (int) sh->sh_rootdirsize; i++) {
+		if (index[i] == 0)
+			continue;
+		if (!fat12fsSidecarSpan(sh, index[i], sizeof(*em)))
+			return (-1);
+		em = (const struct fat12fs_extentmap *) (base + index[i]);
+		if (em->em_nextents < 0 || !fat12fsSidecarSpan(sh, index[i],
+				sizeof(*em) + (uint64_t) em->em_nextents
+					* sizeof(struct fat12fs_extent)))
+			return (-1);
+		/** the runs must cover the file in order, and only its blocks */
+		for (e = 0, nblocks = 0; e < em->em_nextents; e++) {
+			if (em->em_extents[e].ex_fileblk != nblocks
+					|| em->em_extents[e].ex_len == 0
+					|| em->em_extents[e].ex_start < 2
+					|| em->em_extents[e].ex_len
+						> (unsigned int) fs->fs_fatsize
+					|| em->em_extents[e].ex_start
+						> (unsigned int) fs->fs_fatsize
+						- em->em_extents[e].ex_len)
+				return (-1);
+			nblocks += em->em_extents[e].ex_len;
+		}
+		if (em->em_nblocks < 0 || nblocks != (uint64_t) em->em_nblocks)
+			return (-1);
+	}
+	return 0;
+}
+
+
+/**
+ * Mount from a sidecar index in place of the FAT and rootdir, if it
+ * is there and still describes the image.  It is mapped privately,
+ * so anything changed through the mount changes only this mount's
+ * copy.  Returns (-1), having changed nothing, if it cannot be used.
+ */
+static int
+fat12fsSidecarLoad(struct fat12fs *fs, const char *path,
+		const struct stat *image)
+{
+	const struct fat12fs_sidecarheader *sh;
+	const uint64_t *index;
+	unsigned char *base;
+	struct stat sb;
+	void *map;
+	int fd;
+	int i;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return (-1);
+	if (fstat(fd, &sb) < 0 || sb.st_size < (off_t) sizeof(*sh)) {
+		close(fd);
+		return (-1);
+	}
+	map = mmap(NULL, (size_t) sb.st_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return (-1);
+
+	base = (unsigned char *) map;
+	if (fat12fsSidecarValid(fs, base, (size_t) sb.st_size, image) < 0) {
+		munmap(map, (size_t) sb.st_size);
+		return (-1);
+	}
+
+	sh = (const struct fat12fs_sidecarheader *) base;
+	fs->fs_extents = (struct fat12fs_extentmap **) arenaCalloc(
+			&fs->fs_arena, sh->sh_rootdirsize,
+			sizeof(struct fat12fs_extentmap *));
+	if (fs->fs_extents == NULL && sh->sh_rootdirsize > 0) {
+		munmap(map, (size_t) sb.st_size);
+		return (-1);
+	}
+
+	fs->fs_sidecar = base;
+	fs->fs_sidecarsize = (size_t) sb.st_size;
+	fs->fs_fattable = (uint32_t *) (base + sh->sh_fattable);
+	fs->fs_freemap = (uint64_t *) (base + sh->sh_freemap);
+	fs->fs_nfree = sh->sh_nfree;
+	fs->fs_freerun = sh->sh_freerun;
+	fs->fs_freerunstart = sh->sh_freerunstart;
+	fs->fs_fatmismatch = sh->sh_fatmismatch;
+	fs->fs_rootdirsize = sh->sh_rootdirsize;
+	fs->fs_rootdirentry = (struct fat12fs_DIRENTRY *)
+			(base + sh->sh_rootdir);
+	fs->fs_dirindex.di_mask = sh->sh_dirmask;
+	fs->fs_dirindex.di_hash = (struct fat12fs_dirhash *)
+			(base + sh->sh_dirhash);
+
+	index = (const uint64_t *) (base + sh->sh_extentindex);
+	for (i = 0; i < fs->fs_rootdirsize; i++) {
+		if (index[i] != 0)
+			fs->fs_extents[i] = (struct fat12fs_extentmap *)
+					(base + index[i]);
+	}
+
+	if (fs->fs_fatmismatch > 0) {
+		fprintf(stderr,
+			"Warning: %d FAT entries differ between the"
+			" %d copies of the FAT\n",
+				fs->fs_fatmismatch, fs->fs_numfats);
+	}
+	fat12fsSetLoaded(fs, FAT12FS_LOADED_FAT | FAT12FS_LOADED_ROOTDIR);
+	return 0;
+}
+
+
+/**
+ * Write all of nbytes at "offset" of fd
+ */
+static int
+fat12fsPwriteFull(int fd, const void *data, size_t nbytes, off_t offset)
+{
+	const char *p = (const char *) data;
+	ssize_t n;
+
+	while (nbytes > 0) {
+		n = pwrite(fd, p, nbytes, offset);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		p += n;
+		offset += n;
+		nbytes -= (size_t) n;
+	}
+	return 0;
+}
+
+
+/**
+ * Write a sidecar index for a fully loaded mount, first building the
+ * extent map of every file so that they are saved too.  It is written
+ * to a new file which is then renamed over the old, so a mount never
+ * sees half of one.
+ */
+static int
+fat12fsSidecarWrite(struct fat12fs *fs, const char *path,
+		const struct stat *image)
+{
+	struct fat12fs_sidecarheader sh;
+	struct fat12fs_extentmap *em;
+	const fat12fs_DIRENTRY *de;
+	uint64_t *index;
+	char tmppath[PATH_MAX];
+	uint64_t offset;
+	size_t maplen;
+	int status = 0;
+	int fd;
+	int i;
+
+	for (i = 0; i < fs->fs_rootdirsize; i++) {
+		de = &fs->fs_rootdirentry[i];
+		if (de->de_name[0] == NAME0_EMPTY
+				|| de->de_name[0] == NAME0_DELETED
+				|| (de->de_attributes & (ATTR_VOLUME | ATTR_DIR)))
+			continue;
+		(void) fat12fsGetExtents(fs, i);
+	}
+
+	index = (uint64_t *) calloc(fs->fs_rootdirsize + 1, sizeof(uint64_t));
+	if (index == NULL)
+		return (-1);
+
+	memset(&sh, 0, sizeof(sh));
+	memcpy(sh.sh_magic, SIDECAR_MAGIC, 8);
+	sh.sh_version = SIDECAR_VERSION;
+	sh.sh_headersize = sizeof(sh);
+	sh.sh_imagesize = (uint64_t) image->st_size;
+	sh.sh_imagemtime = (int64_t) image->st_mtim.tv_sec;
+	sh.sh_imagemtimens = (int64_t) image->st_mtim.tv_nsec;
+	sh.sh_fatblock = fs->fs_fatblock;
+	sh.sh_fatsectors = fs->fs_fatsectors;
+	sh.sh_numfats = fs->fs_numfats;
+	sh.sh_fatbits = fs->fs_fatbits;
+	sh.sh_clustersize = fs->fs_clustersize;
+	sh.sh_fssize = fs->fs_fssize;
+	sh.sh_rootcluster = fs->fs_rootcluster;
+	sh.sh_rootdirsize = fs->fs_rootdirsize;
+	sh.sh_fatsize = fs->fs_fatsize;
+	if ((fs->fs_flags & FAT12FS_MOUNT_CHECKFATS) || fs->fs_numfats < 2)
+		sh.sh_flags |= SIDECAR_FATSCHECKED;
+	sh.sh_fatmismatch = fs->fs_fatmismatch;
+	sh.sh_nfree = fs->fs_nfree;
+	sh.sh_freerun = fs->fs_freerun;
+	sh.sh_freerunstart = fs->fs_freerunstart;
+	sh.sh_dirmask = fs->fs_dirindex.di_mask;
+
+	/** lay the structures out one after another */
+	offset = fat12fsSidecarAlign(sizeof(sh));
+	sh.sh_fattable = offset;
+	offset = fat12fsSidecarAlign(offset
+			+ (uint64_t) fs->fs_fatsize * sizeof(uint32_t));
+	sh.sh_freemap = offset;
+	offset = fat12fsSidecarAlign(offset
+			+ ((fs->fs_fatsize + 63) / 64) * sizeof(uint64_t));
+	sh.sh_rootdir = offset;
+	offset = fat12fsSidecarAlign(offset
+			+ fs->fs_rootdirsize * sizeof(fat12fs_DIRENTRY));
+	sh.sh_dirhash = offset;
+	offset = fat12fsSidecarAlign(offset
+			+ (uint64_t) (fs->fs_dirindex.di_mask + 1)
+				* sizeof(struct fat12fs_dirhash));
+	sh.sh_extentindex = offset;
+	offset = fat12fsSidecarAlign(offset
+			+ fs->fs_rootdirsize * sizeof(uint64_t));
+	for (i = 0; i < fs->fs_rootdirsize; i++) {
+		em = fs->fs_extents[i];
+		if (em == NULL)
+			continue;
+		index[i] = offset;
+		offset += sizeof(*em) + em->em_nextents
+				* sizeof(struct fat12fs_extent);
+		offset = (offset + 7) & ~(uint64_t) 7;
+	}
+	sh.sh_filesize = offset;
+
+	if (snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", path)
+			>= (int) sizeof(tmppath)) {
+		free(index);
+		return (-1);
+	}
+	fd = mkstemp(tmppath);
+	if (fd < 0) {
+		free(index);
+		return (-1);
+	}
+	(void) fchmod(fd, 0644);
+
+	/** the gaps between structures are left as holes, reading as 0 */
+	if (ftruncate(fd, (off_t) sh.sh_filesize) < 0
+			|| fat12fsPwriteFull(fd, &sh, sizeof(sh), 0) < 0
+			|| fat12fsPwriteFull(fd, fs->fs_fattable,
+				fs->fs_fatsize * sizeof(uint32_t),
+				(off_t) sh.sh_fattable) < 0
+			|| fat12fsPwriteFull(fd, fs->fs_freemap,
+				((fs->fs_fatsize + 63) / 64) * sizeof(uint64_t),
+				(off_t) sh.sh_freemap) < 0
+			|| fat12fsPwriteFull(fd, fs->fs_rootdirentry,
+				fs->fs_rootdirsize * sizeof(fat12fs_DIRENTRY),
+				(off_t) sh.sh_rootdir) < 0
+			|| fat12fsPwriteFull(fd, fs->fs_dirindex.di_hash,
+				(fs->fs_dirindex.di_mask + 1)
+					* sizeof(struct fat12fs_dirhash),
+				(off_t) sh.sh_dirhash) < 0
+			|| fat12fsPwriteFull(fd, index,
+				fs->fs_rootdirsize * sizeof(uint64_t),
+				(off_t) sh.sh_extentindex) < 0)
+		status = -1;
+	for (i = 0; status == 0 && i < fs->fs_rootdirsize; i++) {
+		em = fs->fs_extents[i];
+		if (em == NULL)
+			continue;
+		maplen = sizeof(*em)
+				+ em->em_nextents * sizeof(struct fat12fs_extent);
+		if (fat12fsPwriteFull(fd, em, maplen, (off_t) index[i]) < 0)
+			status = -1;
+	}
+	free(index);
+
+	if (close(fd) < 0)
+		status = -1;
+	if (status == 0 && rename(tmppath, path) < 0)
+		status = -1;
+	if (status < 0)
+		(void) unlink(tmppath);
+	return status;
+}
+
+
+/**
+ * "Mount" a file system:
+ *   - load boot block and ensure the filesystem is actually correct
+ *   - set up the managed buffers used to cache clusters
+ *   - load up the FAT information so we can find file blocks,
+ *     and unpack it into a flat table of entries
+ *   - load up the "root" directory, so we can look up files.
+ *
+ * If FAT12FS_MOUNT_MAPPED is given, the whole image is mapped
+ * read-only instead, and the packed FAT and rootdir are simply
+ * pointers into that mapping, as is every later block "read".
+ * The mapping is already backed by the page cache, so no block
+ * cache is used.
+ *
+ * If FAT12FS_MOUNT_CHECKFATS is given, the other copies of the FAT
+ * are compared against the first, and a warning printed if they
+ * do not agree.
+ *
+ * If FAT12FS_MOUNT_LAZY is given, only the boot block is read here.
+ * The FAT and the rootdir are each loaded the first time something
+ * needs them, so a caller which only wants the geometry pays for a
+ * single block read.
+ *
+ * If FAT12FS_MOUNT_SIDECAR is given, the FAT, rootdir, name index,
+ * free map and extent maps are taken from a sidecar index file, if
+ * one was written for the image as it now is (by its size and
+ * modification time), at the cost of one mapping of it after the
+ * boot block is read.  Otherwise everything is loaded as usual, even
+ * for a lazy mount, and a new sidecar written for next time.
+ *
+ * If FAT12FS_MOUNT_WRITE is given, the image is opened read-write so
+ * that files can be created, written, truncated and deleted.  Such a
+ * mount is never mapped and never uses a sidecar index, whatever
+ * else is asked for.
+ */
+struct fat12fs *
+fat12fsMountOpts(const char *filename, const struct fat12fs_options *opts)
+{
+	struct fat12fs *fs;
+	struct arena ar;
+	struct stat sb;
+	char sidecar[PATH_MAX];
+	void *map;
+	int flags;
+	int fd;
+
+	flags = opts->mo_flags;
+
+	/**
+	 * a write mount changes the FAT and rootdir in its own copies
+	 * of them, so takes neither from a mapping or a sidecar index
+	 */
+	if (flags & FAT12FS_MOUNT_WRITE)
+		flags &= ~(FAT12FS_MOUNT_MAPPED | FAT12FS_MOUNT_SIDECAR);
+
+	/** if we can't open this file, just bail */
+	if ((fd = open(filename, (flags & FAT12FS_MOUNT_WRITE)
+				? O_RDWR : O_RDONLY, 06000)) < 0) {
+		return NULL;
+	}
+
+
+	/**
+	 * if we have opened it, allocate the storage to figure out
+	 * what is inside; the structure is the first thing in its own
+	 * arena, which everything loaded for the mount then shares
+	 */
+	arenaInit(&ar, 0);
+	fs = (struct fat12fs *) arenaCalloc(&ar, 1, sizeof(struct fat12fs));
+	if (fs == NULL) {
+		close(fd);
+		return NULL;
+	}
+	fs->fs_arena = ar;
+	fs->fs_rootdirentry = NULL;
+	fs->fs_fatdata = NULL;
+	fs->fs_fattable = NULL;
+	fs->fs_fatmismatch = 0;
+	fs->fs_freemap = NULL;
+	fs->fs_bdev = NULL;
+	fs->fs_flags = flags;
+	fs->fs_loaded = 0;
+	pthread_mutex_init(&fs->fs_loadlock, NULL);
+	fs->fs_readahead = (opts->mo_readahead > 0) ? opts->mo_readahead : 0;
+	memset(&fs->fs_stats, 0, sizeof(fs->fs_stats));
+	fs->fs_extents = NULL;
+	fs->fs_dirindex.di_hash = NULL;
+	fs->fs_map = NULL;
+	fs->fs_mapsize = 0;
+	fs->fs_sidecar = NULL;
+	fs->fs_sidecarsize = 0;
+	fs->fs_fatdirty = NULL;
+	memset(fs->fs_dirdirty, 0, sizeof(fs->fs_dirdirty));
+	fs->fs_freestale = 0;
+	fs->fs_fd = fd;
+	fs->fs_logfp = (opts->mo_logfp != NULL) ? opts->mo_logfp : stdout;
+
+	memset(&fs->fs_cache, 0, sizeof(fs->fs_cache));
+	memset(&fs->fs_dcache, 0, sizeof(fs->fs_dcache));
+	pthread_mutex_init(&fs->fs_dcache.dc_lock, NULL);
+
+	/** all reads of the image go through the block device */
+	fs->fs_bdev = blockDeviceOpen(fd, (flags & FAT12FS_MOUNT_URING)
+				? BLOCKDEV_URING : BLOCKDEV_PREAD,
+			opts->mo_queuedepth);
+	if (fs->fs_bdev == NULL) {
+		goto FAIL;
+	}
+
+
+	/**
+	 * map the whole image if asked; everything after this point
+	 * will find its blocks in the mapping
+	 */
+	if (flags & FAT12FS_MOUNT_MAPPED) {
+		if (fstat(fd, &sb) < 0 || sb.st_size < FS_BLKSIZE) {
+			goto FAIL;
+		}
+		map = mmap(NULL, (size_t) sb.st_size, PROT_READ,
+				MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			goto FAIL;
+		}
+		fs->fs_map = (const unsigned char *) map;
+		fs->fs_mapsize = (size_t) sb.st_size;
+	}
+
+
+	if (fat12fsLoadBootBlock(fs) < 0) {
+		goto FAIL;
+	}
+
+	/** the cache holds whole clusters, so is sized once they are known */
+	if (fat12fsCacheInit(&fs->fs_cache, &fs->fs_arena,
+			(flags & FAT12FS_MOUNT_MAPPED)
+				? 0 : opts->mo_cacheblocks,
+			fs->fs_clustersize) < 0) {
+		goto FAIL;
+	}
+	if (fat12fsDcacheInit(fs, opts->mo_dentries) < 0) {
+		goto FAIL;
+	}
+
+	if ((flags & FAT12FS_MOUNT_WRITE)
+			&& (fs->fs_fatdirty = (uint64_t *) arenaCalloc(
+				&fs->fs_arena, (fs->fs_fatsectors + 63) / 64,
+				sizeof(uint64_t))) == NULL) {
+		goto FAIL;
+	}
+
+	/** an index which cannot be named or the image stat'ed is not used */
+	if (flags & FAT12FS_MOUNT_SIDECAR) {
+		if (opts->mo_sidecar != NULL)
+			snprintf(sidecar, sizeof(sidecar), "%s",
+					opts->mo_sidecar);
+		else
+			snprintf(sidecar, sizeof(sidecar), "%s%s",
+					filename, FAT12FS_SIDECARSUFFIX);
+		if (fstat(fd, &sb) < 0)
+			flags &= ~FAT12FS_MOUNT_SIDECAR;
+	}
+	if ((flags & FAT12FS_MOUNT_SIDECAR)
+			&& fat12fsSidecarLoad(fs, sidecar, &sb) == 0) {
+		fprintf(fs->fs_logfp,
+			"Mounted :: loaded bootblock, fat and rootdir"
+			" from '%s'\n", sidecar);
+		return fs;
+	}
+
+	if ((flags & FAT12FS_MOUNT_LAZY) && !(flags & FAT12FS_MOUNT_SIDECAR)) {
+		fprintf(fs->fs_logfp,
+			"Mounted :: loaded bootblock, fat and rootdir"
+			" deferred\n");
+		return fs;
+	}
+
+	if (fat12fsEnsureFat(fs) < 0 || fat12fsEnsureRootdir(fs) < 0) {
+		goto FAIL;
+	}
+
+	/** failing to save the index only costs the next mount */
+	if ((flags & FAT12FS_MOUNT_SIDECAR)
+			&& fat12fsSidecarWrite(fs, sidecar, &sb) < 0) {
+		fprintf(stderr, "Warning: cannot write index '%s' : %s\n",
+			sidecar, strerror(errno));
+	}
+
+	if (fs->fs_map != NULL)
+		fprintf(fs->fs_logfp,
+			"Mounted :: mapped bootblock, fat and rootdir\n");
+	else
+		fprintf(fs->fs_logfp,
+			"Mounted :: loaded bootblock, fat and rootdir\n");
+	return fs;
+
+
+FAIL:
+	fat12fsDeleteFSData(fs);
+	return NULL;
+}
+
+
+struct fat12fs *
+fat12fsMount(const char *filename)
+{
+	struct fat12fs_options opts;
+
+	fat12fsDefaultOptions(&opts);
+	return fat12fsMountOpts(filename, &opts);
+}
+
+
+/**
+ * Mount with the whole image mapped read-only, so that block
+ * reads become pointer arithmetic into the mapping
+ */
+struct fat12fs *
+fat12fsMountMapped(const char *filename)
+{
+	struct fat12fs_options opts;
+
+	fat12fsDefaultOptions(&opts);
+	opts.mo_flags |= FAT12FS_MOUNT_MAPPED;
+	return fat12fsMountOpts(filename, &opts);
+}
+
+
+/**
+ * As the block cache only ever holds clean copies of blocks, there
+ * is very little to clean up; a write mount flushes the FAT and
+ * directory changes it is holding first.  Returns (-1) if they
+ * could not all be written, though the mount is gone either way.
+ */
+int
+fat12fsUmount(struct fat12fs *fs)
+{
+	FILE *logfp = fs->fs_logfp;
+	int status;
+
+	status = fat12fsSync(fs);
+	if (status < 0)
+		fprintf(stderr, "Failed writing changes to the image\n");
+	fat12fsDeleteFSData(fs);
+	fprintf(logfp, "Unmounted :: cleaned up\n");
+	return status;
+}
+
+
+/**
+ * Return the value of a FAT entry.  The packed entries, of whatever
+ * width, have already been unpacked by fat12fsLoadFat(), so this is
+ * just an index into the flat table.  An index past the table reads
+ * as EOF, as does every entry if the FAT of a lazy mount cannot be
+ * loaded.
+ */
+unsigned int
+fat12fsGetFatEntry(struct fat12fs *fs, int index)
+{
+	FS_COUNT(fs, st_fatlookups, 1);
+	if (index < 0 || index >= fs->fs_fatsize)
+		return fs->fs_fatmask;
+	if (fat12fsEnsureFat(fs) < 0)
+		return fs->fs_fatmask;
+	return (fs->fs_fattable[index]);
+}
+
+
+/**
+ * Gather up the counters of the filesystem, its block device and its
+ * cache.  Returns (-1), with everything but the cache counts zero, if
+ * statistics were compiled out.  While other threads are reading,
+ * the figures are each current, but not a snapshot of one instant.
+ */
+int
+fat12fsGetStats(struct fat12fs *fs, struct fat12fs_stats *st)
+{
+	const struct blockDeviceStats *bs = &fs->fs_bdev->bd_stats;
+
+	st->st_devreads = FS_LOADCOUNT(bs->bs_reads);
+	st->st_syscalls = FS_LOADCOUNT(bs->bs_syscalls);
+	st->st_devbytes = FS_LOADCOUNT(bs->bs_bytes);
+	st->st_batches = FS_LOADCOUNT(bs->bs_batches);
+	st->st_fatlookups = FS_LOADCOUNT(fs->fs_stats.st_fatlookups);
+	st->st_dirsearches = FS_LOADCOUNT(fs->fs_stats.st_dirsearches);
+	st->st_dirprobes = FS_LOADCOUNT(fs->fs_stats.st_dirprobes);
+	st->st_filebytes = FS_LOADCOUNT(fs->fs_stats.st_filebytes);
+	st->st_prefetches = FS_LOADCOUNT(fs->fs_stats.st_prefetches);
+	st->st_prefetchbytes = FS_LOADCOUNT(fs->fs_stats.st_prefetchbytes);
+	st->st_filewrites = FS_LOADCOUNT(fs->fs_stats.st_filewrites);
+	st->st_datawrites = FS_LOADCOUNT(fs->fs_stats.st_datawrites);
+	st->st_metawrites = FS_LOADCOUNT(fs->fs_stats.st_metawrites);
+	pthread_mutex_lock(&fs->fs_dcache.dc_lock);
+	st->st_dentryhits = fs->fs_dcache.dc_hits;
+	st->st_dentrymisses = fs->fs_dcache.dc_misses;
+	pthread_mutex_unlock(&fs->fs_dcache.dc_lock);
+	fat12fsCacheCounts(&fs->fs_cache,
+			&st->st_cachehits, &st->st_cachemisses, 0);
+	return FAT12FS_STATS ? 0 : -1;
+}
+
+
+/**
+ * Start all the counters of the filesystem again from zero
+ */
+void
+fat12fsResetStats(struct fat12fs *fs)
+{
+	unsigned long hits, misses;
+
+	memset(&fs->fs_stats, 0, sizeof(fs->fs_stats));
+	blockDeviceResetStats(fs->fs_bdev);
+	fat12fsCacheCounts(&fs->fs_cache, &hits, &misses, 1);
+	pthread_mutex_lock(&fs->fs_dcache.dc_lock);
+	fs->fs_dcache.dc_hits = 0;
+	fs->fs_dcache.dc_misses = 0;
+	pthread_mutex_unlock(&fs->fs_dcache.dc_lock);
+}
+
+
+/**
+ * Report how much of the volume is in use, from the free map
+ * built at mount (and kept up to date by a write mount)
+ */
+int
+fat12fsGetSpaceInfo(struct fat12fs *fs, struct fat12fs_spaceinfo *si)
+{
+	if (fat12fsEnsureFat(fs) < 0)
+		return (-1);
+	if (fs->fs_freestale)
+		fat12fsFindFreeRun(fs);
+	si->si_nblocks = fs->fs_fatsize - 2;
+	si->si_free = fs->fs_nfree;
+	si->si_used = si->si_nblocks - si->si_free;
+	si->si_largestfree = fs->fs_freerun;
+	si->si_largeststart = fs->fs_freerunstart;
+	return 0;
+}
+
+/**
+ * Return roughly how many bytes of memory the mount is holding: its
+ * arena, which has the block cache, the FAT in its packed and
+ * unpacked forms, the free map, the rootdir and its index and the
+ * dentry cache, and then the extent maps built so far, for files in
+ * the rootdir and in subdirectories.  Nothing mapped from the image
+ * or the sidecar index is counted, and nothing is loaded.
+ */
+size_t
+fat12fsMemoryUsage(struct fat12fs *fs)
+{
+	struct fat12fs_extentmap *em;
+	size_t nbytes;
+	int i;
+
+	nbytes = arenaHeld(&fs->fs_arena);
+	if (fs->fs_loaded & FAT12FS_LOADED_ROOTDIR) {
+		for (i = 0; fs->fs_extents != NULL
+				&& i < fs->fs_rootdirsize; i++) {
+			em = __atomic_load_n(&fs->fs_extents[i],
+					__ATOMIC_ACQUIRE);
+			if (em != NULL && !fat12fsInSidecar(fs, em))
+				nbytes += sizeof(*em) + em->em_nextents
+					* sizeof(struct fat12fs_extent);
+		}
+	}
+
+	pthread_mutex_lock(&fs->fs_dcache.dc_lock);
+	for (i = 0; i < fs->fs_dcache.dc_nentries; i++) {
+		em = __atomic_load_n(&fs->fs_dcache.dc_dentries[i].dn_extents,
+				__ATOMIC_ACQUIRE);
+		if (em != NULL)
+			nbytes += sizeof(*em) + em->em_nextents
+				* sizeof(struct fat12fs_extent);
+	}
+	pthread_mutex_unlock(&fs->fs_dcache.dc_lock);
+
+	return nbytes;
+}
+
+
+
+/**
+ * Return 1 if the given data block is free, 0 if it is in use, or
+ * (-1) if it is not a data block
+ */
+int
+fat12fsBlockIsFree(struct fat12fs *fs, int index)
+{
+	if (index < 2 || index >= fs->fs_fatsize
+			|| fat12fsEnsureFat(fs) < 0)
+		return (-1);
+	return (fs->fs_freemap[index / 64] >> (index % 64)) & 0x1;
+}
+
+
+/**
+ * Print the FAT table out to the supplied FILE pointer
+ *
+ * This should be printed in hexadecimal, with 16 entries
+ * per row.
+ */
+int
+fat12fsDumpFat(FILE *ofp, struct fat12fs *fs)
+{
+	char space[16 * 1024];
+	struct outBuffer ob;
+	unsigned int fatEntry;
+	int printed = 0;
+	int i;
+
+	if (fat12fsEnsureFat(fs) < 0)
+		return (-1);
+
+	/**
+	 * a FAT is thousands of entries, so rows are put together in
+	 * a buffer and given to stdio a buffer-full at a time
+	 */
+	outBufferInitStatic(&ob, ofp, space, sizeof(space));
+
+	outBufferPuts(&ob, "FAT table dump FORMATTED:\n");
+	for (i = 0; i < fs->fs_fatsize; i++) {
+		fatEntry = fat12fsGetFatEntry(fs, i);
+
+		if (fatEntry != FAT12_FREE) {
+			outBufferPut(&ob, "|", 1);
+			outBufferPutDec(&ob, i, 4);
+			if (fatEntry == fs->fs_fateof
+					|| fatEntry == fs->fs_fatmask) {
+				outBufferPut(&ob, ": EOF|", 6);
+			} else {
+				outBufferPut(&ob, ":", 1);
+				outBufferPutDec(&ob, fatEntry, 4);
+				outBufferPut(&ob, "|", 1);
+			}
+			printed++;
+		}
+		if (printed % 8 == 0) {
+			outBufferPut(&ob, "\n", 1);
+		}
+	}
+
+	outBufferPuts(&ob, "\n\nFAT table dump UNFORMATTED:\n");
+	for (i = 0; i < fs->fs_fatsize; i++) {
+		if (i % 16 == 0) {
+			outBufferPutDec(&ob, i, 4);
+			outBufferPut(&ob, " : ", 3);
+		}
+		outBufferPut(&ob, " ", 1);
+		outBufferPutHex(&ob, fat12fsGetFatEntry(fs, i),
+				fs->fs_fatbits / 4);
+		if (i % 16 == 15) {
+			outBufferPut(&ob, "\n", 1);
+		}
+	}
+
+	if (outBufferFlush(&ob) < 0)
+		return (-1);
+	return 1;
+}
+
+/**
+ * Print out the root directory, printing out only entries
+ * which are not empty, and labelling each type of entry:
+ *   VOL(ume)
+ *   DEL(eted)
+ *   FILE
+ */
+int
+fat12fsDumpRootdir(FILE *ofp, struct fat12fs *fs)
+{
+	if (fat12fsEnsureRootdir(fs) < 0)
+		return (-1);
+
+	fprintf(ofp, "Root directory dump:\n");
+	for (int i = 0; i < fs->fs_rootdirsize; i++) {
+		fat12fs_DIRENTRY cur = fs->fs_rootdirentry[i];
+		if (cur.de_name[0] == NAME0_EMPTY) {
+			continue;
+		}
+		if (cur.de_name[0] == NAME0_DELETED) {
+			fprintf(ofp, "%d : DEL  ", i);
+		} else if (cur.de_attributes & ATTR_VOLUME) {
+			fprintf(ofp, "%d : VOL  ", i);
+		} else {
+			fprintf(ofp, "%d : FILE ", i);
+		}
+		fprintf(ofp, "[%.8s.%.3s] (%x bytes, start %d)\n", cur.de_name, cur.de_nameext, cur.de_filelen, fat12fsFirstCluster(fs, &cur));
+	}
+	return 1;
+}
+
+/**
+ * Find the rootdir index the hash index holds for a normalized key
+ */
+static int
+fat12fsLookupKey(struct fat12fs *fs, const unsigned char *key)
+{
+	struct fat12fs_dirindex *di = &fs->fs_dirindex;
+	unsigned int h;
+
+	for (h = fat12fsKeyHash(key) & di->di_mask;
+			di->di_hash[h].dh_slot >= 0;
+			h = (h + 1) & di->di_mask) {
+		FS_COUNT(fs, st_dirprobes, 1);
+		if (memcmp(di->di_hash[h].dh_key, key, FAT12FS_KEYLEN) == 0)
+			return di->di_hash[h].dh_slot;
+	}
+	return -1;
+}
+
+
+/**
+ * Search through the root directory, looking for the given
+ * file name.
+ *
+ * Note that as is typical with DOS, search should be case
+ * insensitive.  Be sure to handle the fact that the "extension"
+ * is stored separately from the "name" portion.
+ *
+ * Only "files" should be found -- Volumes or "deleted" items
+ * should be skipped.  This is done by only ever entering files and
+ * directories into the hash index built at mount, and passing over
+ * a directory if that is what the name finds, so the search itself
+ * is a single probe sequence with no allocation.
+ */
+int
+fat12fsSearchRootdir(
+	struct fat12fs *fs,
+	const char *filename)
+{
+	unsigned char key[FAT12FS_KEYLEN];
+	int dirEntryIndex;
+
+	FS_COUNT(fs, st_dirsearches, 1);
+	if (fat12fsNameKey(filename, key) < 0
+			|| fat12fsEnsureRootdir(fs) < 0)
+		return -1;
+	dirEntryIndex = fat12fsLookupKey(fs, key);
+	if (dirEntryIndex >= 0 && (fs->fs_rootdirentry[dirEntryIndex]
+			.de_attributes & ATTR_DIR))
+		return -1;
+	return dirEntryIndex;
+}
+
+/**
+ * Find a file by name, returning its root directory index or (-1)
+ */
+int
+fat12fsFindFile(struct fat12fs *fs, const char *filename)
+{
+	return fat12fsSearchRootdir(fs, filename);
+}
+
+
+/**
+ * The hash chain of a name within the directory starting at "parent"
+ */
+static inline int *
+fat12fsDentryChain(const struct fat12fs_dcache *dc, uint32_t parent,
+		const unsigned char *key)
+{
+	return &dc->dc_buckets[(fat12fsKeyHash(key) ^ (parent * 0x9e3779b1u))
+			& dc->dc_mask];
+}
+
+
+/**
+ * Find the dentry for a name in a directory, or (-1)
+ */
+static int
+fat12fsDcacheFind(const struct fat12fs_dcache *dc, uint32_t parent,
+		const unsigned char *key)
+{
+	const struct fat12fs_dentry *dn;
+	int i;
+
+	for (i = *fat12fsDentryChain(dc, parent, key); i >= 0;
+			i = dn->dn_next) {
+		dn = &dc->dc_dentries[i];
+		if (dn->dn_parent == parent
+				&& memcmp(dn->dn_key, key, FAT12FS_KEYLEN) == 0)
+			return i;
+	}
+	return (-1);
+}
+
+
+/**
+ * Enter a name of a directory into the cache, with its directory
+ * entry or (if de is NULL) as one the directory does not have.  The
+ * dentry is taken by sweeping the CLOCK hand past those recently
+ * used or pinned by an open file; returns (-1) if all are pinned.
+ */
+static int
+fat12fsDcacheInsert(struct fat12fs_dcache *dc, uint32_t parent,
+		const unsigned char *key, const fat12fs_DIRENTRY *de)
+{
+	struct fat12fs_dentry *dn;
+	int *chain;
+	int i = -1;
+	int n;
+
+	for (n = 0; n < 2 * dc->dc_nentries && i < 0; n++) {
+		dn = &dc->dc_dentries[dc->dc_hand];
+		if (dn->dn_parent == 0
+				|| (dn->dn_pins == 0 && dn->dn_ref == 0))
+			i = dc->dc_hand;
+		else if (dn->dn_pins == 0)
+			dn->dn_ref = 0;
+		dc->dc_hand = (dc->dc_hand + 1) % dc->dc_nentries;
+	}
+	if (i < 0)
+		return (-1);
+	dn = &dc->dc_dentries[i];
+
+	if (dn->dn_parent != 0) {
+		for (chain = fat12fsDentryChain(dc, dn->dn_parent, dn->dn_key);
+				*chain != i;
+				chain = &dc->dc_dentries[*chain].dn_next)
+			;
+		*chain = dn->dn_next;
+		free(dn->dn_extents);
+		dn->dn_extents = NULL;
+	}
+
+	dn->dn_parent = parent;
+	memcpy(dn->dn_key, key, FAT12FS_KEYLEN);
+	dn->dn_ref = 0;
+	dn->dn_pins = 0;
+	if (de != NULL)
+		dn->dn_entry = *de;
+	else
+		memset(&dn->dn_entry, 0, sizeof(dn->dn_entry));
+
+	chain = fat12fsDentryChain(dc, parent, key);
+	dn->dn_next = *chain;
+	*chain = i;
+	return i;
+}
+
+
+/**
+ * Read the subdirectory starting at "parent" through the block cache
+ * and enter every file and directory in it into the dentry cache, so
+ * that later lookups there need neither the FAT nor the disk.  The
+ * name wanted is entered last, so that a directory larger than the
+ * cache cannot push it out again, and as a name the directory does
+ * not have if it is not found.  Returns its dentry, or (-1).
+ */
+static int
+fat12fsDcacheFill(struct fat12fs *fs, uint32_t parent,
+		const unsigned char *want)
+{
+	struct fat12fs_dcache *dc = &fs->fs_dcache;
+	const fat12fs_DIRENTRY *de;
+	fat12fs_DIRENTRY found;
+	unsigned char key[FAT12FS_KEYLEN];
+	int perCluster, maxclusters, nclusters;
+	int haveFound = 0;
+	uint32_t cur;
+	int i;
+
+	perCluster = fs->fs_clustersize / sizeof(fat12fs_DIRENTRY);
+	maxclusters = (FAT_MAXSUBDIR * sizeof(fat12fs_DIRENTRY))
+			>> fs->fs_clustershift;
+	if (maxclusters < 1)
+		maxclusters = 1;
+
+	for (cur = parent, nclusters = 0;
+			cur >= 2 && cur < (uint32_t) fs->fs_fatsize
+				&& nclusters < maxclusters;
+			cur = fat12fsGetFatEntry(fs, cur), nclusters++) {
+		if (fat12fsLoadDataBlock(fs, dc->dc_buf, cur) < 0)
+			return (-1);
+		de = (const fat12fs_DIRENTRY *) dc->dc_buf;
+		for (i = 0; i < perCluster; i++, de++) {
+			/** an unused entry is the end of the directory */
+			if (de->de_name[0] == NAME0_EMPTY)
+				goto DONE;
+			if (de->de_name[0] == NAME0_DELETED
+					|| de->de_name[0] == '.'
+					|| (de->de_attributes & ATTR_VOLUME))
+				continue;
+
+			fat12fsEntryKey(de, key);
+			if (memcmp(key, want, FAT12FS_KEYLEN) == 0) {
+				if (!haveFound)
+					found = *de;
+				haveFound = 1;
+			} else if (fat12fsDcacheFind(dc, parent, key) < 0) {
+				(void) fat12fsDcacheInsert(dc, parent, key, de);
+			}
+		}
+	}
+
+DONE:
+	return fat12fsDcacheInsert(dc, parent, want,
+			haveFound ? &found : NULL);
+}
+
+
+/**
+ * Resolve a path such as "A/B/FILE.TXT" to the entry index of the
+ * file it names.  The parts may be split by '/' or a backslash, and
+ * one at the start means nothing, since every path starts at the root.
+ *
+ * A file in the root is found through the rootdir hash index, as
+ * fat12fsSearchRootdir() finds it, and its index is its rootdir slot.
+ * Below that each part is looked up in the dentry cache, reading the
+ * directory (once) only if the cache has not seen the name, and the
+ * index is past the rootdir, naming the dentry holding the file; the
+ * dentry is pinned until fat12fsReleaseEntry().
+ *
+ * Returns (-1) if a part is not an 8.3 name or is not there, or if a
+ * directory is named where a file is wanted or the other way round.
+ */
+static int
+fat12fsLookupPath(struct fat12fs *fs, const char *path)
+{
+	struct fat12fs_dcache *dc = &fs->fs_dcache;
+	unsigned char key[FAT12FS_KEYLEN];
+	char part[FAT12FS_HOSTNAMELEN];
+	const fat12fs_DIRENTRY *de;
+	uint32_t parent = 0;
+	size_t n;
+	int dirEntryIndex;
+
+	while (*path == '/' || *path == '\\')
+		path++;
+	if (strpbrk(path, "/\\") == NULL)
+		return fat12fsSearchRootdir(fs, path);
+
+	FS_COUNT(fs, st_dirsearches, 1);
+	if (fat12fsEnsureFat(fs) < 0 || fat12fsEnsureRootdir(fs) < 0)
+		return (-1);
+
+	pthread_mutex_lock(&dc->dc_lock);
+	for (;;) {
+		n = strcspn(path, "/\\");
+		if (n >= sizeof(part))
+			goto FAIL;
+		memcpy(part, path, n);
+		part[n] = '\0';
+		if (fat12fsNameKey(part, key) < 0)
+			goto FAIL;
+
+		if (parent == 0) {
+			dirEntryIndex = fat12fsLookupKey(fs, key);
+			if (dirEntryIndex < 0)
+				goto FAIL;
+			de = &fs->fs_rootdirentry[dirEntryIndex];
+		} else {
+			dirEntryIndex = fat12fsDcacheFind(dc, parent, key);
+			if (dirEntryIndex >= 0) {
+				dc->dc_hits++;
+				dc->dc_dentries[dirEntryIndex].dn_ref = 1;
+			} else {
+				dc->dc_misses++;
+				dirEntryIndex = fat12fsDcacheFill(fs, parent, key);
+				if (dirEntryIndex < 0)
+					goto FAIL;
+			}
+			de = &dc->dc_dentries[dirEntryIndex].dn_entry;
+			if (de->de_name[0] == NAME0_EMPTY)
+				goto FAIL;
+		}
+
+		for (path += n; *path == '/' || *path == '\\'; path++)
+			;
+		if (*path == '\0')
+			break;
+		if (!(de->de_attributes & ATTR_DIR))
+			goto FAIL;
+		parent = fat12fsFirstCluster(fs, de);
+		if (parent < 2 || parent >= (uint32_t) fs->fs_fatsize)
+			goto FAIL;
+	}
+	if (de->de_attributes & ATTR_DIR)
+		goto FAIL;
+
+	if (parent != 0) {
+		dc->dc_dentries[dirEntryIndex].dn_pins++;
+		dirEntryIndex += fs->fs_rootdirsize;
+	}
+	pthread_mutex_unlock(&dc->dc_lock);
+	return dirEntryIndex;
+
+FAIL:
+	pthread_mutex_unlock(&dc->dc_lock);
+	return (-1);
+}
+
+
+/**
+ * Give back the pin fat12fsLookupPath() took on a subdirectory file
+ */
+static void
+fat12fsReleaseEntry(struct fat12fs *fs, int dirEntryIndex)
+{
+	struct fat12fs_dcache *dc = &fs->fs_dcache;
+
+	if (dirEntryIndex < fs->fs_rootdirsize)
+		return;
+	pthread_mutex_lock(&dc->dc_lock);
+	dc->dc_dentries[dirEntryIndex - fs->fs_rootdirsize].dn_pins--;
+	pthread_mutex_unlock(&dc->dc_lock);
+}
+
+
+/**
+ * Load a logical data block (a whole cluster, of fs_clustersize
+ * bytes) into the provided buffer through the block cache,
+ * remembering that the first data block is numbered "2"
+ */
+int
+fat12fsLoadDataBlock(
+	struct fat12fs *fs,
+	char *buffer,
+	int index)
+{
+	const char *blk;
+
+	if (index < 2 || index >= fs->fs_fatsize)
+		return (-1);
+
+	if (fs->fs_map != NULL) {
+		blk = fat12fsMapBlocks(fs, fat12fsClusterBlock(fs, index),
+				fs->fs_clustersectors);
+		if (blk == NULL)
+			return (-1);
+		memcpy(buffer, blk, fs->fs_clustersize);
+		return 0;
+	}
+
+	if (fs->fs_cache.bc_nbufs > 0)
+		return fat12fsCacheRead(fs, index, buffer,
+				0, fs->fs_clustersize, 1);
+
+	return blockDeviceRead(fs->fs_bdev, buffer, fs->fs_clustersize,
+			fat12fsClusterOffset(fs, index));
+}
+
+/**
+ * Return a pointer straight into the mapping for the given logical
+ * data block, so that no copy needs to be made.  NULL is returned
+ * if the filesystem was not mounted mapped.
+ */
+const char *
+fat12fsMapDataBlock(
+	struct fat12fs *fs,
+	int index)
+{
+	return fat12fsMapBlocks(fs, fat12fsClusterBlock(fs, index),
+			fs->fs_clustersectors);
+}
+
+/**
+ * If the indicated dirEntry is a FILE, verify its integrity
+ * by processing through the file-block list and ensuring
+ * that the last FAT entry is marked EOF.  Ensure that the
+ * number of bytes reported by the file matches this length
+ * in file blocks.
+ *
+ * If everything is OK, return 1.
+ * If the entry is a FILE, but it does not check out, return 0;
+ * If the entry does not correspond to a FILE, or some other
+ * problem is encountered, return -1
+ */
+int
+fat12fsVerifyEOF(
+	struct fat12fs *fs,
+	int dirEntryIndex)
+{
+	int bytesRemainInFile, bytesThisBlock;
+	unsigned int curblock;
+
+	if (fat12fsEnsureFat(fs) < 0 || fat12fsEnsureRootdir(fs) < 0)
+		return -1;
+	if (dirEntryIndex < 0 || dirEntryIndex >= fs->fs_rootdirsize)
+		return -1;
+
+	fat12fs_DIRENTRY entry = fs->fs_rootdirentry[dirEntryIndex];
+	curblock = fat12fsFirstCluster(fs, &entry);
+	bytesRemainInFile = fs->fs_rootdirentry[dirEntryIndex].de_filelen;
+
+	/** an unused slot or an empty file has no chain to check */
+	if (curblock == 0 && bytesRemainInFile <= 0)
+		return -1;
+
+	while (bytesRemainInFile > 0) {
+
+		if (bytesRemainInFile < (int) fs->fs_clustersize)
+			bytesThisBlock = bytesRemainInFile;
+		else
+			bytesThisBlock = fs->fs_clustersize;
+
+		bytesRemainInFile -= fs->fs_clustersize;
+
+		if (bytesRemainInFile > 0) {
+			if (!fat12fsIsDataBlock(fs, curblock))
+			    return 0;
+			curblock = fat12fsGetFatEntry(fs, curblock);
+		}
+	}
+
+	if (!fat12fsIsDataBlock(fs, curblock))
+		return 0;
+	curblock = fat12fsGetFatEntry(fs, curblock);
+	if ((curblock & fs->fs_fateof) == fs->fs_fateof) {
+		return 1;
+	}
+
+	return -1;
+}
+
+/**
+ * Walk the FAT chain of the given directory entry once, and
+ * summarize it as a list of runs of physically contiguous blocks.
+ *
+ * The walk stops at the first entry which is not a data block (EOF,
+ * free or out of range), or once the chain covers de_filelen bytes,
+ * so a damaged chain simply yields a short map.
+ */
+static struct fat12fs_extentmap *
+fat12fsBuildExtents(struct fat12fs *fs, int dirEntryIndex)
+{
+	struct fat12fs_extentmap *em, *grown;
+	struct fat12fs_extent *ex;
+	unsigned int filelen;
+	int nblocks, maxblocks;
+	int cap;
+	int cur;
+
+	filelen = fat12fsEntry(fs, dirEntryIndex)->de_filelen;
+	maxblocks = (int) ((filelen + fs->fs_clustersize - 1)
+			>> fs->fs_clustershift);
+	if (maxblocks > fs->fs_fatsize)
+		maxblocks = fs->fs_fatsize;
+
+	cap = 4;
+	em = (struct fat12fs_extentmap *) malloc(sizeof(*em)
+			+ cap * sizeof(struct fat12fs_extent));
+	if (em == NULL)
+		return NULL;
+	em->em_nextents = 0;
+
+	cur = fat12fsFirstCluster(fs, fat12fsEntry(fs, dirEntryIndex));
+	nblocks = 0;
+	while (nblocks < maxblocks && cur >= 2 && cur < fs->fs_fatsize) {
+		ex = (em->em_nextents > 0)
+				? &em->em_extents[em->em_nextents - 1] : NULL;
+		if (ex != NULL
+				&& ex->ex_start + ex->ex_len == (unsigned int) cur) {
+			ex->ex_len++;
+		} else {
+			if (em->em_nextents == cap) {
+				cap *= 2;
+				grown = (struct fat12fs_extentmap *) realloc(em,
+					sizeof(*em)
+					+ cap * sizeof(struct fat12fs_extent));
+				if (grown == NULL) {
+					free(em);
+					return NULL;
+				}
+				em = grown;
+			}
+			ex = &em->em_extents[em->em_nextents++];
+			ex->ex_fileblk = nblocks;
+			ex->ex_start = cur;
+			ex->ex_len = 1;
+		}
+		nblocks++;
+		cur = fat12fsGetFatEntry(fs, cur);
+	}
+
+	em->em_nblocks = nblocks;
+	return em;
+}
+
+
+/**
+ * Return the extent map for a directory entry, building and caching
+ * it on the first call.  The entry is a rootdir slot, or a file in a
+ * subdirectory whose dentry an open handle has pinned.
+ *
+ * Threads may race to build the same map; each builds its own, one
+ * is published with a compare-and-swap, and the losers free theirs
+ * and use the winner's.  A published map never changes.
+ */
+struct fat12fs_extentmap *
+fat12fsGetExtents(struct fat12fs *fs, int dirEntryIndex)
+{
+	struct fat12fs_extentmap *em, *expected = NULL;
+	struct fat12fs_extentmap **slot;
+
+	if (fat12fsEnsureFat(fs) < 0 || fat12fsEnsureRootdir(fs) < 0)
+		return NULL;
+	if (dirEntryIndex < 0 || dirEntryIndex >= fs->fs_rootdirsize
+			+ fs->fs_dcache.dc_nentries)
+		return NULL;
+
+	slot = fat12fsExtentSlot(fs, dirEntryIndex);
+	em = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (em != NULL)
+		return em;
+
+	em = fat12fsBuildExtents(fs, dirEntryIndex);
+	if (em == NULL)
+		return NULL;
+	if (!__atomic_compare_exchange_n(slot,
+			&expected, em, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(em);
+		em = expected;
+	}
+	return em;
+}
+
+
+/**
+ * Throw away the cached extent map for a directory entry (or for all
+ * entries if dirEntryIndex is -1), so it will be rebuilt from the FAT
+ * the next time it is needed.  Anything that changes a chain or a
+ * directory entry must call this, and must not do so while other
+ * threads may be reading through the mount.
+ */
+void
+fat12fsInvalidateExtents(struct fat12fs *fs, int dirEntryIndex)
+{
+	int i;
+
+	if (fs->fs_extents == NULL)
+		return;
+	for (i = 0; i < fs->fs_rootdirsize; i++) {
+		if (dirEntryIndex >= 0 && i != dirEntryIndex)
+			continue;
+		if (!fat12fsInSidecar(fs, fs->fs_extents[i]))
+			free(fs->fs_extents[i]);
+		fs->fs_extents[i] = NULL;
+	}
+}
+
+
+/**
+ * Binary search for the extent holding the given block of the file
+ */
+static int
+fat12fsFindExtent(const struct fat12fs_extentmap *em, int fileblk)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = em->em_nextents - 1;
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (em->em_extents[mid].ex_fileblk <= (unsigned int) fileblk)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+
+/**
+ * Clamp a request against the length of the file and of its chain,
+ * returning the number of bytes which can actually be read
+ */
+static int
+fat12fsClampRead(struct fat12fs *fs, int dirEntryIndex,
+		const struct fat12fs_extentmap *em,
+		int startpos, int nBytesToCopy)
+{
+	unsigned int avail;
+
+	avail = fat12fsEntry(fs, dirEntryIndex)->de_filelen;
+	if ((unsigned int) em->em_nblocks << fs->fs_clustershift < avail)
+		avail = (unsigned int) em->em_nblocks << fs->fs_clustershift;
+
+	if ((unsigned int) startpos >= avail || nBytesToCopy <= 0)
+		return 0;
+	if ((unsigned int) nBytesToCopy > avail - startpos)
+		return (int) (avail - startpos);
+	return nBytesToCopy;
+}
+
+
+/**
+ * Reads going straight to the device which fat12fsPread() gathers
+ * up, so that all the runs of a request can be in flight at once
+ */
+#define	FAT12FS_BATCHMAX	64
+
+typedef struct fat12fs_readbatch {
+	int rb_nreqs;
+	struct blockRequest rb_reqs[FAT12FS_BATCHMAX];
+} fat12fs_readbatch;
+
+
+/**
+ * Hand any gathered reads to the device, waiting for all of them
+ */
+static int
+fat12fsFlushBatch(struct fat12fs *fs, struct fat12fs_readbatch *batch)
+{
+	int status;
+
+	status = blockDeviceReadBatch(fs->fs_bdev,
+			batch->rb_reqs, batch->rb_nreqs);
+	batch->rb_nreqs = 0;
+	return status;
+}
+
+
+/**
+ * Copy nbytes starting "offset" bytes into data cluster "cluster",
+ * running on through the following (physically adjacent) clusters,
+ * into the caller's buffer.
+ *
+ * A mapped filesystem just copies out of the mapping.  Otherwise
+ * short runs are served through the block cache a cluster at a time,
+ * so that small hot files stay resident, and anything of
+ * FAT12FS_DIRECTMIN clusters or more is read with one device read
+ * straight into the destination, partial head and tail clusters
+ * included.  If a batch is given, such reads are added to it to be
+ * issued together by the caller.
+ */
+static int
+fat12fsReadRun(struct fat12fs *fs, int cluster, int offset,
+		char *buffer, int nbytes, struct fat12fs_readbatch *batch)
+{
+	struct blockRequest *req;
+	const char *src;
+	int nblocks;
+	int n;
+
+	if (fs->fs_map != NULL) {
+		nblocks = (offset + nbytes + FS_BLKSIZE - 1) / FS_BLKSIZE;
+		src = fat12fsMapBlocks(fs, fat12fsClusterBlock(fs, cluster),
+				nblocks);
+		if (src == NULL)
+			return (-1);
+		memcpy(buffer, src + offset, nbytes);
+		return 0;
+	}
+
+	if (nbytes >= (FAT12FS_DIRECTMIN << fs->fs_clustershift)
+			|| fs->fs_cache.bc_nbufs == 0) {
+		if (batch == NULL)
+			return blockDeviceRead(fs->fs_bdev, buffer, nbytes,
+					fat12fsClusterOffset(fs, cluster)
+						+ offset);
+
+		if (batch->rb_nreqs == FAT12FS_BATCHMAX
+				&& fat12fsFlushBatch(fs, batch) < 0)
+			return (-1);
+		req = &batch->rb_reqs[batch->rb_nreqs++];
+		req->br_buf = buffer;
+		req->br_len = (size_t) nbytes;
+		req->br_offset = fat12fsClusterOffset(fs, cluster) + offset;
+		return 0;
+	}
+
+	while (nbytes > 0) {
+		n = fs->fs_clustersize - offset;
+		if (n > nbytes)
+			n = nbytes;
+		if (fat12fsCacheRead(fs, cluster, buffer, offset, n, 1) < 0)
+			return (-1);
+
+		buffer += n;
+		nbytes -= n;
+		offset = 0;
+		cluster++;
+	}
+	return 0;
+}
+
+
+/**
+ * Find the extent holding the given file block, trying the cursor's
+ * extent and the one after it before falling back to a binary search,
+ * so that sequential reads continue at O(1) cost
+ */
+static int
+fat12fsCursorExtent(const struct fat12fs_extentmap *em,
+		int hint, int fileblk)
+{
+	const struct fat12fs_extent *ex;
+
+	if (hint >= 0 && hint < em->em_nextents) {
+		ex = &em->em_extents[hint];
+		if (ex->ex_fileblk <= (unsigned int) fileblk) {
+			if ((unsigned int) fileblk < ex->ex_fileblk + ex->ex_len)
+				return hint;
+			if (hint + 1 < em->em_nextents && (unsigned int) fileblk
+					< em->em_extents[hint + 1].ex_fileblk
+					+ em->em_extents[hint + 1].ex_len)
+				return hint + 1;
+		}
+	}
+	return fat12fsFindExtent(em, fileblk);
+}
+
+
+/**
+ * Hint that the file blocks from fileblk up to (not including)
+ * endblk will be read soon, one physical run at a time, starting the
+ * extent search at hint.  The kernel fetches them into the page
+ * cache in the background, whether the image is mapped or read, so
+ * the block cache and direct reads then find them in memory.
+ */
+static void
+fat12fsPrefetch(struct fat12fs *fs, const struct fat12fs_extentmap *em,
+		int hint, int fileblk, int endblk)
+{
+	const struct fat12fs_extent *ex;
+	size_t page, start, end;
+	off_t offset;
+	int e, n;
+
+	if (endblk > em->em_nblocks)
+		endblk = em->em_nblocks;
+	if (fileblk >= endblk)
+		return;
+
+	page = (size_t) sysconf(_SC_PAGESIZE);
+	for (e = fat12fsCursorExtent(em, hint, fileblk);
+			fileblk < endblk && e < em->em_nextents; e++) {
+		ex = &em->em_extents[e];
+		n = ex->ex_fileblk + ex->ex_len - fileblk;
+		if (n > endblk - fileblk)
+			n = endblk - fileblk;
+		offset = fat12fsClusterOffset(fs,
+				ex->ex_start + (fileblk - ex->ex_fileblk));
+
+		if (fs->fs_map != NULL) {
+			/** madvise() wants the range on page boundaries */
+			start = (size_t) offset & ~(page - 1);
+			end = (size_t) offset
+					+ ((size_t) n << fs->fs_clustershift);
+			if (end > fs->fs_mapsize)
+				end = fs->fs_mapsize;
+			if (end > start)
+				(void) madvise((void *) &fs->fs_map[start],
+						end - start, MADV_WILLNEED);
+		} else {
+			(void) blockDeviceWillNeed(fs->fs_bdev, offset,
+					(size_t) n << fs->fs_clustershift);
+		}
+		FS_COUNT(fs, st_prefetches, 1);
+		FS_COUNT(fs, st_prefetchbytes,
+				(unsigned long) n << fs->fs_clustershift);
+		fileblk += n;
+	}
+}
+
+
+/**
+ * Keep a handle's readahead going after a read of nbytes at startpos
+ *
+ * A read starting where the last one finished is sequential, and
+ * opens the window (doubling it each time, up to fs_readahead
+ * blocks); any other read closes it.  Like the kernel's own
+ * readahead, more is only asked for once the reader has used up
+ * half of what is already on the way, so steady small reads cost a
+ * hint every half window rather than one per call.
+ */
+static void
+fat12fsReadAhead(struct fat12fs_file *fh, const struct fat12fs_extentmap *em,
+		int startpos, int nbytes)
+{
+	struct fat12fs *fs = fh->fh_fs;
+	int sequential;
+	int nextblk;
+
+	sequential = (startpos == fh->fh_nextpos);
+	fh->fh_nextpos = startpos + nbytes;
+	if (!sequential) {
+		fh->fh_rawindow = 0;
+		fh->fh_raend = 0;
+		return;
+	}
+	if (fs->fs_readahead == 0)
+		return;
+
+	nextblk = fh->fh_nextpos >> fs->fs_clustershift;
+	if (fh->fh_raend - nextblk > fh->fh_rawindow / 2)
+		return;
+
+	if (fh->fh_rawindow == 0)
+		fh->fh_rawindow = FAT12FS_READAHEADMIN;
+	else if (fh->fh_rawindow < fs->fs_readahead)
+		fh->fh_rawindow *= 2;
+	if (fh->fh_rawindow > fs->fs_readahead)
+		fh->fh_rawindow = fs->fs_readahead;
+
+	fat12fsPrefetch(fs, em, fh->fh_extent,
+			(fh->fh_raend > nextblk) ? fh->fh_raend : nextblk,
+			nextblk + fh->fh_rawindow);
+	fh->fh_raend = nextblk + fh->fh_rawindow;
+}
+
+
+/**
+ * Read from an open file at the given position, without moving its
+ * cursor, though the cursor's extent is used as the starting hint
+ * and left pointing at the extent where the read finished.
+ *
+ * Like read(2), a request running past the end of the file returns
+ * only the bytes up to the end.  The extent map is used to go
+ * straight to the block holding startpos, rather than walking the
+ * chain from the start of the file, and each physically contiguous
+ * run is then read with a single fat12fsReadRun().  The long runs
+ * are issued to the device as one batch once all are known, and
+ * a sequential reader has the blocks after them read ahead.
+ */
+int
+fat12fsPread(
+	struct fat12fs_file *fh,
+	char *buffer,
+	int nBytesToCopy,
+	int startpos)
+{
+	struct fat12fs *fs = fh->fh_fs;
+	struct fat12fs_extentmap *em;
+	const struct fat12fs_extent *ex;
+	struct fat12fs_readbatch batch;
+	int fileblk, blockOffset;
+	int bytesRead, bytesThisRun, nBytes;
+	int e;
+
+	if (startpos < 0) {
+		return -1;
+	}
+
+	em = fat12fsGetExtents(fs, fh->fh_direntry);
+	if (em == NULL) {
+		return -1;
+	}
+
+	nBytes = fat12fsClampRead(fs, fh->fh_direntry, em,
+			startpos, nBytesToCopy);
+	if (nBytes == 0) {
+		return 0;
+	}
+
+	fileblk = startpos >> fs->fs_clustershift;
+	blockOffset = startpos & (fs->fs_clustersize - 1);
+
+	bytesRead = 0;
+	batch.rb_nreqs = 0;
+	e = fat12fsCursorExtent(em, fh->fh_extent, fileblk);
+	for (;;) {
+		/** a map shorter than its own length is damaged */
+		if (e >= em->em_nextents)
+			return -1;
+		ex = &em->em_extents[e];
+
+		bytesThisRun = ((ex->ex_fileblk + ex->ex_len - fileblk)
+				<< fs->fs_clustershift) - blockOffset;
+		if (bytesThisRun > nBytes - bytesRead)
+			bytesThisRun = nBytes - bytesRead;
+
+		if (fat12fsReadRun(fs,
+				ex->ex_start + (fileblk - ex->ex_fileblk),
+				blockOffset, &buffer[bytesRead],
+				bytesThisRun, &batch) < 0) {
+			return -1;
+		}
+
+		bytesRead += bytesThisRun;
+		if (bytesRead >= nBytes)
+			break;
+		blockOffset = 0;
+		fileblk = ex->ex_fileblk + ex->ex_len;
+		e++;
+	}
+
+	if (fat12fsFlushBatch(fs, &batch) < 0) {
+		return -1;
+	}
+
+	fh->fh_extent = e;
+	fat12fsReadAhead(fh, em, startpos, bytesRead);
+	FS_COUNT(fs, st_filebytes, bytesRead);
+	return bytesRead;
+}
+
+
+/**
+ * Read from an open file at its cursor, advancing the cursor by
+ * the number of bytes read
+ */
+int
+fat12fsRead(struct fat12fs_file *fh, char *buffer, int nBytesToCopy)
+{
+	int status;
+
+	status = fat12fsPread(fh, buffer, nBytesToCopy, fh->fh_pos);
+	if (status > 0)
+		fh->fh_pos += status;
+	return status;
+}
+
+
+/**
+ * Move the cursor of an open file, as lseek(2) does, returning the
+ * new position or (-1) if it would be negative
+ */
+int
+fat12fsSeek(struct fat12fs_file *fh, int offset, int whence)
+{
+	int pos;
+
+	switch (whence) {
+	case SEEK_SET:
+		pos = offset;
+		break;
+	case SEEK_CUR:
+		pos = fh->fh_pos + offset;
+		break;
+	case SEEK_END:
+		pos = (int) fat12fsEntry(fh->fh_fs, fh->fh_direntry)
+				->de_filelen + offset;
+		break;
+	default:
+		return -1;
+	}
+
+	if (pos < 0)
+		return -1;
+	fh->fh_pos = pos;
+	return pos;
+}
+
+
+/**
+ * Return the number of bytes which can actually be read from an open
+ * file: its directory length, cut short if the chain ends early
+ */
+int
+fat12fsFileLength(struct fat12fs_file *fh)
+{
+	struct fat12fs_extentmap *em;
+
+	em = fat12fsGetExtents(fh->fh_fs, fh->fh_direntry);
+	if (em == NULL)
+		return -1;
+	return fat12fsClampRead(fh->fh_fs, fh->fh_direntry, em, 0, INT_MAX);
+}
+
+
+/**
+ * Set up a handle on the given entry index with its cursor at 0
+ */
+static void
+fat12fsHandleInit(struct fat12fs *fs, struct fat12fs_file *fh,
+		int dirEntryIndex)
+{
+	fh->fh_fs = fs;
+	fh->fh_direntry = dirEntryIndex;
+	fh->fh_pos = 0;
+	fh->fh_extent = 0;
+	fh->fh_nextpos = 0;
+	fh->fh_rawindow = 0;
+	fh->fh_raend = 0;
+}
+
+
+/**
+ * Open a file for reading, resolving its name (or path, such as
+ * "A/B/FILE.TXT", for a file in a subdirectory) once so that later
+ * reads go straight to the data.  Returns NULL if the file cannot
+ * be found.
+ */
+struct fat12fs_file *
+fat12fsOpen(struct fat12fs *fs, const char *filename)
+{
+	struct fat12fs_file *fh;
+	int dirEntryIndex;
+
+	dirEntryIndex = fat12fsLookupPath(fs, filename);
+	if (dirEntryIndex == -1) {
+		return NULL;
+	}
+
+	fh = (struct fat12fs_file *) malloc(sizeof(struct fat12fs_file));
+	if (fh == NULL) {
+		fat12fsReleaseEntry(fs, dirEntryIndex);
+		return NULL;
+	}
+	fat12fsHandleInit(fs, fh, dirEntryIndex);
+	return fh;
+}
+
+
+/**
+ * Open a file as fat12fsOpen() does, but into a handle the caller
+ * provides (typically on its stack), which is given back with
+ * fat12fsCloseHandle() rather than fat12fsClose().  Returns (-1) if
+ * the file cannot be found.
+ */
+int
+fat12fsOpenHandle(struct fat12fs *fs, const char *filename,
+		struct fat12fs_file *fh)
+{
+	int dirEntryIndex;
+
+	dirEntryIndex = fat12fsLookupPath(fs, filename);
+	if (dirEntryIndex == -1) {
+		return (-1);
+	}
+	fat12fsHandleInit(fs, fh, dirEntryIndex);
+	return 0;
+}
+
+/**
+ * Release an open file handle
+ */
+int
+fat12fsClose(struct fat12fs_file *fh)
+{
+	fat12fsCloseHandle(fh);
+	free(fh);
+	return 0;
+}
+
+/**
+ * Release a handle from fat12fsOpenHandle(), unpinning the dentry of
+ * a file in a subdirectory so that the cache may reuse it
+ */
+void
+fat12fsCloseHandle(struct fat12fs_file *fh)
+{
+	fat12fsReleaseEntry(fh->fh_fs, fh->fh_direntry);
+}
+
+
+/**
+ * Read the specified data from the file, writing the output
+ * into the given buffer and returning the number of bytes
+ * successfully read or (-1) on failure
+ *
+ * This resolves the name on every call; code making more than one
+ * read of a file should use fat12fsOpen() and fat12fsRead() instead.
+ */
+int
+fat12fsReadData(
+	struct fat12fs *fs,
+	char *buffer,
+	const char *filename,
+	int startpos,
+	int nBytesToCopy)
+{
+	struct fat12fs_file fh;
+	int status;
+
+	if (fat12fsOpenHandle(fs, filename, &fh) < 0) {
+		return -1;
+	}
+
+	status = fat12fsPread(&fh, buffer, nBytesToCopy, startpos);
+	fat12fsCloseHandle(&fh);
+	return status;
+}
+
+/**
+ * Zero-copy version of fat12fsReadData() for mapped filesystems.
+ *
+ * Instead of copying, fill in up to *iovcnt iovec entries pointing
+ * directly into the mapping, one for each run of blocks which are
+ * adjacent in the image.  On return *iovcnt holds the number of
+ * entries used, and the number of bytes described is returned.
+ * If the iovec list fills up before nBytesToCopy is reached, the
+ * (shorter) count described so far is returned; the caller can
+ * continue from startpos plus that count.
+ *
+ * Returns (-1) if the filesystem is not mapped or the file is not found
+ */
+int
+fat12fsReadDataMapped(
+	struct fat12fs *fs,
+	const char *filename,
+	int startpos,
+	int nBytesToCopy,
+	struct iovec *iov,
+	int *iovcnt)
+{
+	struct fat12fs_extentmap *em;
+	const struct fat12fs_extent *ex;
+	const char *src;
+	int dirEntryIndex;
+	int fileblk, blockOffset;
+	int bytesRead, bytesThisRun, nBytes;
+	int maxiov, niov;
+	int e;
+
+	if (fs->fs_map == NULL || startpos < 0) {
+		return -1;
+	}
+
+	dirEntryIndex = fat12fsLookupPath(fs, filename);
+	if (dirEntryIndex == -1) {
+		return -1;
+	}
+
+	em = fat12fsGetExtents(fs, dirEntryIndex);
+	if (em == NULL) {
+		fat12fsReleaseEntry(fs, dirEntryIndex);
+		return -1;
+	}
+
+	maxiov = *iovcnt;
+	niov = 0;
+	*iovcnt = 0;
+
+	nBytes = fat12fsClampRead(fs, dirEntryIndex, em,
+			startpos, nBytesToCopy);
+
+	fileblk = startpos >> fs->fs_clustershift;
+	blockOffset = startpos & (fs->fs_clustersize - 1);
+
+	bytesRead = 0;
+	for (e = (nBytes > 0) ? fat12fsFindExtent(em, fileblk) : 0;
+			bytesRead < nBytes && niov < maxiov
+				&& e < em->em_nextents; e++) {
+		ex = &em->em_extents[e];
+
+		src = fat12fsMapBlocks(fs, fat12fsClusterBlock(fs,
+					ex->ex_start + (fileblk - ex->ex_fileblk)),
+				(ex->ex_fileblk + ex->ex_len - fileblk)
+					* fs->fs_clustersectors);
+		if (src == NULL) {
+			break;
+		}
+		src += blockOffset;
+
+		bytesThisRun = ((ex->ex_fileblk + ex->ex_len - fileblk)
+				<< fs->fs_clustershift) - blockOffset;
+		if (bytesThisRun > nBytes - bytesRead)
+			bytesThisRun = nBytes - bytesRead;
+
+		iov[niov].iov_base = (void *) src;
+		iov[niov].iov_len = bytesThisRun;
+		niov++;
+
+		bytesRead += bytesThisRun;
+		blockOffset = 0;
+		fileblk = ex->ex_fileblk + ex->ex_len;
+	}
+	fat12fsReleaseEntry(fs, dirEntryIndex);
+
+	*iovcnt = niov;
+	FS_COUNT(fs, st_filebytes, bytesRead);
+	return bytesRead;
+}
+
+
+/**
+ * write(2) all of the given bytes, retrying on short writes
+ */
+static int
+fat12fsWriteFull(int fd, const char *buffer, size_t nbytes)
+{
+	ssize_t status;
+
+	while (nbytes > 0) {
+		status = write(fd, buffer, nbytes);
+		if (status < 0 && errno == EINTR)
+			continue;
+		if (status <= 0)
+			return (-1);
+		buffer += status;
+		nbytes -= (size_t) status;
+	}
+	return 0;
+}
+
+
+/**
+ * Ways of moving a run of the image to the output descriptor, from
+ * cheapest to most expensive.  Each export starts at the top and
+ * falls down the list whenever the kernel refuses a method for this
+ * pair of descriptors.
+ */
+#define	EXPORT_COPYRANGE	0	/* copy_file_range(2), file to file */
+#define	EXPORT_SENDFILE		1	/* sendfile(2), file to anything */
+#define	EXPORT_READWRITE	2	/* pread(2)/write(2) via a buffer */
+
+/** the buffer used by the last of them, page aligned for the kernel */
+#define	EXPORT_CHUNK		(1024 * 1024)
+#define	EXPORT_ALIGN		4096
+
+
+/**
+ * Send nbytes from byte offset "offset" of the image to outfd, using
+ * the cheapest method which works, and lowering *method if one fails
+ * in a way that means it is not supported here.
+ */
+static int
+fat12fsExportRun(struct fat12fs *fs, int outfd, off_t offset, size_t nbytes,
+		int *method, char **bounce)
+{
+	ssize_t status;
+	size_t n;
+
+	if (fs->fs_map != NULL) {
+		if (offset + nbytes > fs->fs_mapsize)
+			return (-1);
+		return fat12fsWriteFull(outfd,
+				(const char *) &fs->fs_map[offset], nbytes);
+	}
+
+	while (nbytes > 0) {
+		status = -1;
+#ifdef __linux__
+		if (*method == EXPORT_COPYRANGE) {
+			status = copy_file_range(fs->fs_fd, &offset,
+					outfd, NULL, nbytes, 0);
+		} else if (*method == EXPORT_SENDFILE) {
+			status = sendfile(outfd, fs->fs_fd, &offset, nbytes);
+		}
+		if (*method != EXPORT_READWRITE) {
+			if (status > 0) {
+				nbytes -= (size_t) status;
+				continue;
+			}
+			if (status < 0 && errno == EINTR)
+				continue;
+			if (status == 0)
+				return (-1);
+			if (errno == ENOSYS || errno == EXDEV
+					|| errno == EINVAL || errno == EBADF
+					|| errno == EOPNOTSUPP) {
+				(*method)++;
+				continue;
+			}
+			return (-1);
+		}
+#else
+		*method = EXPORT_READWRITE;
+#endif
+
+		if (*bounce == NULL && posix_memalign((void **) bounce,
+				EXPORT_ALIGN, EXPORT_CHUNK) != 0) {
+			*bounce = NULL;
+			return (-1);
+		}
+		n = (nbytes < EXPORT_CHUNK) ? nbytes : EXPORT_CHUNK;
+		if (blockDeviceRead(fs->fs_bdev, *bounce, n, offset) < 0
+				|| fat12fsWriteFull(outfd, *bounce, n) < 0)
+			return (-1);
+		offset += (off_t) n;
+		nbytes -= n;
+	}
+	return 0;
+}
+
+
+/**
+ * Copy the whole of a rootdir entry's file out to outfd, one run at
+ * a time.  The export method and bounce buffer are the caller's, so
+ * they carry over from one file to the next.
+ */
+static int
+fat12fsExportEntry(struct fat12fs *fs, int dirEntryIndex, int outfd,
+		int *method, char **bounce)
+{
+	struct fat12fs_extentmap *em;
+	const struct fat12fs_extent *ex;
+	int nBytes, done, n;
+	int e;
+
+	em = fat12fsGetExtents(fs, dirEntryIndex);
+	if (em == NULL) {
+		return -1;
+	}
+
+	nBytes = fat12fsClampRead(fs, dirEntryIndex, em, 0, INT_MAX);
+
+	done = 0;
+	for (e = 0; done < nBytes && e < em->em_nextents; e++) {
+		ex = &em->em_extents[e];
+		n = ex->ex_len << fs->fs_clustershift;
+		if (n > nBytes - done)
+			n = nBytes - done;
+
+		/** have the next run on its way while this one is copied */
+		if (fs->fs_readahead > 0 && e + 1 < em->em_nextents)
+			fat12fsPrefetch(fs, em, e + 1,
+				em->em_extents[e + 1].ex_fileblk,
+				em->em_extents[e + 1].ex_fileblk
+					+ fs->fs_readahead);
+
+		if (fat12fsExportRun(fs, outfd,
+				fat12fsClusterOffset(fs, ex->ex_start),
+				(size_t) n, method, bounce) < 0)
+			return -1;
+		done += n;
+	}
+	if (done < nBytes)
+		return -1;
+	return done;
+}
+
+
+/**
+ * Copy the whole of the named file out to the host descriptor outfd,
+ * one physically contiguous run at a time, without passing the data
+ * through user space where the kernel can avoid it.  The data is
+ * written at outfd's current offset.
+ *
+ * Returns the number of bytes written, or (-1) on failure
+ */
+int
+fat12fsExport(struct fat12fs *fs, const char *filename, int outfd)
+{
+	char *bounce = NULL;
+	int method = EXPORT_COPYRANGE;
+	int dirEntryIndex;
+	int status;
+
+	dirEntryIndex = fat12fsLookupPath(fs, filename);
+	if (dirEntryIndex == -1) {
+		return -1;
+	}
+
+	status = fat12fsExportEntry(fs, dirEntryIndex, outfd,
+			&method, &bounce);
+	fat12fsReleaseEntry(fs, dirEntryIndex);
+	free(bounce);
+	return status;
+}
+
+
+/**
+ * Choose how many threads to run over njobs jobs: nThreads if it is
+ * given, or one per CPU, but never more than "most" or than there
+ * are jobs to do
+ */
+static int
+fat12fsThreadCount(int nThreads, int most, int njobs)
+{
+	long ncpus;
+
+	if (nThreads <= 0) {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nThreads = (ncpus > 0) ? (int) ncpus : 1;
+	}
+	if (nThreads > most)
+		nThreads = most;
+	if (nThreads > njobs)
+		nThreads = njobs;
+	return nThreads;
+}
+
+
+/**
+ * Run "worker" on nThreads threads at once, the calling thread being
+ * one of them, and wait for all of them to finish.  If threads cannot
+ * be started, those which did start do all the work.
+ */
+static void
+fat12fsRunWorkers(void *(*worker)(void *), void *arg, int nThreads)
+{
+	pthread_t threads[FS_MAXWORKERS];
+	int started;
+
+	for (started = 0; started < nThreads - 1
+			&& started < FS_MAXWORKERS; started++) {
+		if (pthread_create(&threads[started], NULL, worker, arg) != 0)
+			break;
+	}
+	worker(arg);
+	while (started > 0)
+		pthread_join(threads[--started], NULL);
+}
+
+
+/**
+ * One file for the whole-directory operations, and where its data
+ * starts on disk
+ */
+typedef struct fat12fs_filejob {
+	int fj_direntry;	/* rootdir index of the file */
+	int fj_index;		/* its place among the files, in rootdir order */
+	unsigned int fj_start;	/* its first data cluster, 0 if none */
+} fat12fs_filejob;
+
+
+/**
+ * Order jobs by where their data starts
+ */
+static int
+fat12fsFileJobOrder(const void *a, const void *b)
+{
+	const struct fat12fs_filejob *ja = a, *jb = b;
+
+	if (ja->fj_start != jb->fj_start)
+		return (ja->fj_start < jb->fj_start) ? -1 : 1;
+	return ja->fj_direntry - jb->fj_direntry;
+}
+
+
+/**
+ * List the files of the root directory -- the same ones a search by
+ * name would find, so of two entries with one name only the first --
+ * building each one's extent map, and sort them by where their data
+ * starts so that working through them in turn reads the image nearly
+ * front to back.  Returns the number of files, or (-1).
+ */
+static int
+fat12fsGatherFiles(struct fat12fs *fs, struct fat12fs_filejob **jobsp)
+{
+	struct fat12fs_filejob *jobs;
+	struct fat12fs_extentmap *em;
+	const fat12fs_DIRENTRY *de;
+	unsigned char key[FAT12FS_KEYLEN];
+	int njobs;
+	int i;
+
+	if (fat12fsEnsureFat(fs) < 0 || fat12fsEnsureRootdir(fs) < 0)
+		return (-1);
+	jobs = (struct fat12fs_filejob *) malloc(
+			fs->fs_rootdirsize * sizeof(struct fat12fs_filejob));
+	if (jobs == NULL)
+		return (-1);
+
+	njobs = 0;
+	for (i = 0; i < fs->fs_rootdirsize; i++) {
+		de = &fs->fs_rootdirentry[i];
+		if (de->de_name[0] == NAME0_EMPTY
+				|| de->de_name[0] == NAME0_DELETED
+				|| (de->de_attributes & (ATTR_VOLUME | ATTR_DIR)))
+			continue;
+		fat12fsEntryKey(de, key);
+		if (fat12fsLookupKey(fs, key) != i)
+			continue;
+
+		/** a map which cannot be built fails again in the worker */
+		em = fat12fsGetExtents(fs, i);
+		jobs[njobs].fj_direntry = i;
+		jobs[njobs].fj_index = njobs;
+		jobs[njobs].fj_start = (em != NULL && em->em_nextents > 0)
+				? em->em_extents[0].ex_start : 0;
+		njobs++;
+	}
+	qsort(jobs, njobs, sizeof(struct fat12fs_filejob),
+			fat12fsFileJobOrder);
+
+	*jobsp = jobs;
+	return njobs;
+}
+
+
+/**
+ * Shared state of one fat12fsExportAll() run; the jobs are handed
+ * out in disk order through xa_next
+ */
+typedef struct fat12fs_exportall {
+	struct fat12fs *xa_fs;
+	int xa_dirfd;		/* the host directory written into */
+	struct fat12fs_filejob *xa_jobs;
+	int xa_njobs;
+	int xa_next;		/* next job to hand out */
+	struct fat12fs_exportreport *xa_report;
+} fat12fs_exportall;
+
+
+/**
+ * Build the host name of a rootdir entry: its 8.3 name as stored,
+ * without the padding, and with anything which cannot be in a host
+ * file name replaced
+ */
+static void
+fat12fsHostName(const fat12fs_DIRENTRY *de, char *name)
+{
+	int i, n;
+
+	for (n = 0; n < 8 && de->de_name[n] != ' '; n++)
+		name[n] = de->de_name[n];
+	if (n > 0 && (unsigned char) name[0] == NAME0_E5)
+		name[0] = (char) NAME0_DELETED;
+	if (de->de_nameext[0] != ' ') {
+		name[n++] = '.';
+		for (i = 0; i < 3 && de->de_nameext[i] != ' '; i++)
+			name[n++] = de->de_nameext[i];
+	}
+	name[n] = '\0';
+
+	for (i = 0; i < n; i++) {
+		if (name[i] == '/' || name[i] == '\0')
+			name[i] = '_';
+	}
+}
+
+
+/**
+ * Body of each export worker: take files until none are left.  Each
+ * worker keeps its own export method and bounce buffer for all the
+ * files it writes.
+ */
+static void *
+fat12fsExportWorker(void *arg)
+{
+	struct fat12fs_exportall *xa = (struct fat12fs_exportall *) arg;
+	struct fat12fs *fs = xa->xa_fs;
+	struct fat12fs_filejob *xj;
+	char name[FAT12FS_HOSTNAMELEN];
+	char *bounce = NULL;
+	int method = EXPORT_COPYRANGE;
+	int status;
+	int outfd;
+	int i;
+
+	for (;;) {
+		i = __atomic_fetch_add(&xa->xa_next, 1, __ATOMIC_RELAXED);
+		if (i >= xa->xa_njobs)
+			break;
+		xj = &xa->xa_jobs[i];
+
+		/**
+		 * the names come from the image, so one which would be
+		 * the directory itself or its parent is not written, and
+		 * nor is anything reached through a link already there
+		 */
+		fat12fsHostName(&fs->fs_rootdirentry[xj->fj_direntry], name);
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			outfd = -1;
+		else
+			outfd = openat(xa->xa_dirfd, name, O_WRONLY
+					| O_CREAT | O_TRUNC | O_NOFOLLOW, 0644);
+		if (outfd < 0) {
+			status = -1;
+		} else {
+			status = fat12fsExportEntry(fs, xj->fj_direntry,
+					outfd, &method, &bounce);
+			if (close(outfd) < 0)
+				status = -1;
+		}
+
+		if (status < 0) {
+			(void) __atomic_fetch_add(&xa->xa_report->xr_nfailed,
+					1, __ATOMIC_RELAXED);
+		} else {
+			(void) __atomic_fetch_add(&xa->xa_report->xr_nfiles,
+					1, __ATOMIC_RELAXED);
+			(void) __atomic_fetch_add(&xa->xa_report->xr_nbytes,
+					(unsigned long) status,
+					__ATOMIC_RELAXED);
+		}
+	}
+
+	free(bounce);
+	return NULL;
+}
+
+
+/**
+ * Copy every file in the root directory out to the host directory
+ * hostdir (made if it does not exist), each as a raw file under its
+ * 8.3 name.
+ *
+ * The files are written in order of where their data starts, by up
+ * to nThreads threads (0 to choose automatically) taking them in
+ * turn, so that the image is read nearly front to back however many
+ * threads there are.
+ *
+ * A file whose name would be "." or "..", or which is a symbolic
+ * link already in hostdir, is not written.
+ *
+ * Returns the number of files which could not be written, with the
+ * totals in the report, or (-1) if hostdir cannot be used.
+ */
+int
+fat12fsExportAll(struct fat12fs *fs, const char *hostdir, int nThreads,
+		struct fat12fs_exportreport *report)
+{
+	struct fat12fs_exportall xa;
+
+	memset(report, 0, sizeof(*report));
+	if (mkdir(hostdir, 0755) < 0 && errno != EEXIST)
+		return (-1);
+
+	memset(&xa, 0, sizeof(xa));
+	xa.xa_fs = fs;
+	xa.xa_report = report;
+	xa.xa_dirfd = open(hostdir, O_RDONLY|O_DIRECTORY);
+	if (xa.xa_dirfd < 0)
+		return (-1);
+	xa.xa_njobs = fat12fsGatherFiles(fs, &xa.xa_jobs);
+	if (xa.xa_njobs < 0) {
+		close(xa.xa_dirfd);
+		return (-1);
+	}
+
+	fat12fsRunWorkers(fat12fsExportWorker, &xa,
+			fat12fsThreadCount(nThreads, FAT12FS_EXPORTTHREADS,
+				xa.xa_njobs));
+
+	free(xa.xa_jobs);
+	close(xa.xa_dirfd);
+	return report->xr_nfailed;
+}
+
+
+/**
+ * Carry *crc on over nbytes of the image from byte "offset": straight
+ * from the mapping if there is one, or else a chunk at a time through
+ * the caller's bounce buffer
+ */
+static int
+fat12fsHashRun(struct fat12fs *fs, off_t offset, size_t nbytes,
+		uint32_t *crc, char **bounce)
+{
+	size_t n;
+
+	if (fs->fs_map != NULL) {
+		if (offset + nbytes > fs->fs_mapsize)
+			return (-1);
+		*crc = crc32cUpdate(*crc, &fs->fs_map[offset], nbytes);
+		return 0;
+	}
+
+	if (*bounce == NULL && posix_memalign((void **) bounce,
+			EXPORT_ALIGN, EXPORT_CHUNK) != 0) {
+		*bounce = NULL;
+		return (-1);
+	}
+	while (nbytes > 0) {
+		n = (nbytes < EXPORT_CHUNK) ? nbytes : EXPORT_CHUNK;
+		if (blockDeviceRead(fs->fs_bdev, *bounce, n, offset) < 0)
+			return (-1);
+		*crc = crc32cUpdate(*crc, *bounce, n);
+		offset += (off_t) n;
+		nbytes -= n;
+	}
+	return 0;
+}
+
+
+/**
+ * Compute the CRC-32C of a rootdir entry's file, run by run as the
+ * export does, so that no more than a chunk of it is ever held
+ */
+static int
+fat12fsHashEntry(struct fat12fs *fs, int dirEntryIndex, uint32_t *crc,
+		char **bounce)
+{
+	struct fat12fs_extentmap *em;
+	const struct fat12fs_extent *ex;
+	uint32_t sum = 0;
+	int nBytes, done, n;
+	int e;
+
+	em = fat12fsGetExtents(fs, dirEntryIndex);
+	if (em == NULL) {
+		return -1;
+	}
+
+	nBytes = fat12fsClampRead(fs, dirEntryIndex, em, 0, INT_MAX);
+
+	done = 0;
+	for (e = 0; done < nBytes && e < em->em_nextents; e++) {
+		ex = &em->em_extents[e];
+		n = ex->ex_len << fs->fs_clustershift;
+		if (n > nBytes - done)
+			n = nBytes - done;
+
+		if (fs->fs_readahead > 0 && e + 1 < em->em_nextents)
+			fat12fsPrefetch(fs, em, e + 1,
+				em->em_extents[e + 1].ex_fileblk,
+				em->em_extents[e + 1].ex_fileblk
+					+ fs->fs_readahead);
+
+		if (fat12fsHashRun(fs, fat12fsClusterOffset(fs, ex->ex_start),
+				(size_t) n, &sum, bounce) < 0)
+			return -1;
+		done += n;
+	}
+	if (done < nBytes)
+		return -1;
+
+	*crc = sum;
+	return done;
+}
+
+
+/**
+ * Compute the CRC-32C of the whole of the named file, streaming it
+ * through in runs so that the file is never held in memory.
+ *
+ * Returns the number of bytes hashed, or (-1) on failure
+ */
+int
+fat12fsHashFile(struct fat12fs *fs, const char *filename, uint32_t *crc)
+{
+	char *bounce = NULL;
+	int dirEntryIndex;
+	int status;
+
+	dirEntryIndex = fat12fsLookupPath(fs, filename);
+	if (dirEntryIndex == -1) {
+		return -1;
+	}
+
+	status = fat12fsHashEntry(fs, dirEntryIndex, crc, &bounce);
+	fat12fsReleaseEntry(fs, dirEntryIndex);
+	free(bounce);
+	return status;
+}
+
+
+/**
+ * Shared state of one fat12fsHashAll() run; the jobs are handed out
+ * in disk order through ha_next, and each result goes to the slot of
+ * the report its file has in rootdir order
+ */
+typedef struct fat12fs_hashall {
+	struct fat12fs *ha_fs;
+	struct fat12fs_filejob *ha_jobs;
+	int ha_njobs;
+	int ha_next;		/* next job to hand out */
+	struct fat12fs_hashreport *ha_report;
+} fat12fs_hashall;
+
+
+/**
+ * Body of each hash worker: take files until none are left
+ */
+static void *
+fat12fsHashWorker(void *arg)
+{
+	struct fat12fs_hashall *ha = (struct fat12fs_hashall *) arg;
+	struct fat12fs *fs = ha->ha_fs;
+	struct fat12fs_hashentry *he;
+	struct fat12fs_filejob *fj;
+	char *bounce = NULL;
+	int i;
+
+	for (;;) {
+		i = __atomic_fetch_add(&ha->ha_next, 1, __ATOMIC_RELAXED);
+		if (i >= ha->ha_njobs)
+			break;
+		fj = &ha->ha_jobs[i];
+		he = &ha->ha_report->hr_entries[fj->fj_index];
+
+		he->he_direntry = fj->fj_direntry;
+		fat12fsHostName(&fs->fs_rootdirentry[fj->fj_direntry],
+				he->he_name);
+		he->he_nbytes = fat12fsHashEntry(fs, fj->fj_direntry,
+				&he->he_crc, &bounce);
+		if (he->he_nbytes < 0)
+			(void) __atomic_fetch_add(&ha->ha_report->hr_nfailed,
+					1, __ATOMIC_RELAXED);
+	}
+
+	free(bounce);
+	return NULL;
+}
+
+
+/**
+ * Compute the CRC-32C of every file in the root directory, on up to
+ * nThreads threads (0 to choose automatically) working through the
+ * files in order of where their data starts.  The report lists them
+ * in rootdir order whatever order they were hashed in, and must be
+ * released with fat12fsFreeHashReport().
+ *
+ * Returns the number of files which could not be read, or (-1)
+ */
+int
+fat12fsHashAll(struct fat12fs *fs, int nThreads,
+		struct fat12fs_hashreport *report)
+{
+	struct fat12fs_hashall ha;
+
+	memset(report, 0, sizeof(*report));
+	memset(&ha, 0, sizeof(ha));
+	ha.ha_fs = fs;
+	ha.ha_report = report;
+	ha.ha_njobs = fat12fsGatherFiles(fs, &ha.ha_jobs);
+	if (ha.ha_njobs < 0)
+		return (-1);
+
+	report->hr_nentries = ha.ha_njobs;
+	report->hr_entries = (struct fat12fs_hashentry *) calloc(
+			ha.ha_njobs + 1, sizeof(struct fat12fs_hashentry));
+	if (report->hr_entries == NULL) {
+		free(ha.ha_jobs);
+		return (-1);
+	}
+
+	fat12fsRunWorkers(fat12fsHashWorker, &ha,
+			fat12fsThreadCount(nThreads, FAT12FS_HASHTHREADS,
+				ha.ha_njobs));
+
+	free(ha.ha_jobs);
+	return report->hr_nfailed;
+}
+
+
+/**
+ * Release the storage held by a hash report
+ */
+void
+fat12fsFreeHashReport(struct fat12fs_hashreport *report)
+{
+	free(report->hr_entries);
+	report->hr_entries = NULL;
+}
+
+
+/**
+ * Shared state of one fat12fsCheck() run.  Entries are handed out to
+ * the workers through ck_next, and every claim on a block is made
+ * with atomic operations on the owner arrays, so the workers never
+ * take a lock.
+ *
+ * Keeping both the lowest and the highest report entry to reach
+ * each block, rather than just a first-come owner, means a block is
+ * shared exactly when the two differ, and gives the same answer
+ * whatever order the workers run in.
+ */
+typedef struct fat12fs_checkrun {
+	struct fat12fs *ck_fs;
+	struct fat12fs_checkreport *ck_report;
+	int *ck_minowner;	/* lowest report entry using each block */
+	int *ck_maxowner;	/* highest report entry using each block */
+	int ck_room;		/* report entries allocated */
+	int ck_next;		/* next report entry to hand out */
+	int ck_pass;		/* 0 to walk and claim, 1 to find sharing */
+} fat12fs_checkrun;
+
+
+/**
+ * Follow a chain one link, returning the next data block, or a
+ * negative value if "cluster" is not a data block to be followed
+ */
+static inline int
+fat12fsCheckNext(struct fat12fs *fs, int cluster)
+{
+	if (cluster < 2 || cluster >= fs->fs_fatsize)
+		return (-1);
+	return fs->fs_fattable[cluster];
+}
+
+
+/**
+ * Measure the chain starting at "first" without marking anything,
+ * using Brent's cycle finding so that even a looping chain is
+ * measured in time proportional to its length.
+ *
+ * Returns the number of distinct blocks in the chain, setting
+ * *cycleStart to the block the chain loops back to, or (-1) if the
+ * chain ends.
+ */
+static int
+fat12fsCheckMeasure(struct fat12fs *fs, int first, int *cycleStart)
+{
+	int power, lambda, mu;
+	int tortoise, hare;
+	int i;
+
+	*cycleStart = -1;
+
+	/** find the length of the cycle, if there is one */
+	power = lambda = 1;
+	tortoise = first;
+	hare = fat12fsCheckNext(fs, first);
+	while (tortoise != hare) {
+		if (hare < 2 || hare >= fs->fs_fatsize) {
+			/** the chain ends; count it the plain way */
+			for (i = 0, hare = first;
+					hare >= 2 && hare < fs->fs_fatsize;
+					i++)
+				hare = fat12fsCheckNext(fs, hare);
+			return i;
+		}
+		if (power == lambda) {
+			tortoise = hare;
+			power *= 2;
+			lambda = 0;
+		}
+		hare = fat12fsCheckNext(fs, hare);
+		lambda++;
+	}
+
+	/** then the length of the run leading into it */
+	tortoise = hare = first;
+	for (i = 0; i < lambda; i++)
+		hare = fat12fsCheckNext(fs, hare);
+	for (mu = 0; tortoise != hare; mu++) {
+		tortoise = fat12fsCheckNext(fs, tortoise);
+		hare = fat12fsCheckNext(fs, hare);
+	}
+
+	*cycleStart = tortoise;
+	return mu + lambda;
+}
+
+
+/**
+ * Record that report entry "owner" uses the given block
+ */
+static void
+fat12fsCheckClaim(struct fat12fs_checkrun *ck, int cluster, int owner)
+{
+	int cur;
+
+	cur = __atomic_load_n(&ck->ck_minowner[cluster], __ATOMIC_RELAXED);
+	while ((cur < 0 || cur > owner)
+			&& !__atomic_compare_exchange_n(
+				&ck->ck_minowner[cluster], &cur, owner,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	cur = __atomic_load_n(&ck->ck_maxowner[cluster], __ATOMIC_RELAXED);
+	while (cur < owner
+			&& !__atomic_compare_exchange_n(
+				&ck->ck_maxowner[cluster], &cur, owner,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+
+/**
+ * First pass over an entry: measure its chain, note anything wrong
+ * with its shape or length, and claim every block it uses
+ */
+static void
+fat12fsCheckWalk(struct fat12fs_checkrun *ck, struct fat12fs_checkentry *ce)
+{
+	struct fat12fs *fs = ck->ck_fs;
+	const fat12fs_DIRENTRY *de = &ce->ce_entry;
+	int owner = (int) (ce - ck->ck_report->cr_entries);
+	unsigned int expected;
+	int cycleStart;
+	int cur, next;
+	int i;
+
+	cur = fat12fsFirstCluster(fs, de);
+	if (cur == 0 && de->de_filelen == 0)
+		return;
+	if (cur < 2 || cur >= fs->fs_fatsize) {
+		ce->ce_flags |= FAT12FS_CHECK_BADSTART;
+		ce->ce_endblock = cur;
+		return;
+	}
+
+	ce->ce_nblocks = fat12fsCheckMeasure(fs, cur, &cycleStart);
+	for (i = 0; i < ce->ce_nblocks; i++) {
+		fat12fsCheckClaim(ck, cur, owner);
+		next = fat12fsCheckNext(fs, cur);
+		if (i == ce->ce_nblocks - 1 && cycleStart < 0
+				&& next < (int) fs->fs_fateof) {
+			/** ran off into a free, bad or reserved block */
+			ce->ce_flags |= FAT12FS_CHECK_BADCHAIN;
+			ce->ce_endblock = cur;
+		}
+		cur = next;
+	}
+
+	if (cycleStart >= 0) {
+		ce->ce_flags |= FAT12FS_CHECK_CYCLE;
+		ce->ce_endblock = cycleStart;
+	}
+
+	/** directories have no length of their own to compare */
+	if (de->de_attributes & ATTR_DIR)
+		return;
+	expected = (de->de_filelen + fs->fs_clustersize - 1)
+			>> fs->fs_clustershift;
+	if (expected != (unsigned int) ce->ce_nblocks)
+		ce->ce_flags |= FAT12FS_CHECK_LENGTH;
+}
+
+
+/**
+ * Second pass over an entry, once every block has been claimed:
+ * find the first block it shares with some other entry
+ */
+static void
+fat12fsCheckShared(struct fat12fs_checkrun *ck, struct fat12fs_checkentry *ce)
+{
+	struct fat12fs *fs = ck->ck_fs;
+	int owner = (int) (ce - ck->ck_report->cr_entries);
+	int cur;
+	int i;
+
+	cur = fat12fsFirstCluster(fs, &ce->ce_entry);
+	if (ce->ce_flags & FAT12FS_CHECK_BADSTART)
+		return;
+	for (i = 0; i < ce->ce_nblocks; i++) {
+		if (ck->ck_minowner[cur] != ck->ck_maxowner[cur]) {
+			ce->ce_flags |= FAT12FS_CHECK_CROSSLINK;
+			ce->ce_crossblock = cur;
+			ce->ce_other = (ck->ck_minowner[cur] == owner)
+					? ck->ck_maxowner[cur]
+					: ck->ck_minowner[cur];
+			return;
+		}
+		cur = fat12fsCheckNext(fs, cur);
+	}
+}
+
+
+/**
+ * Body of each check worker: take entries until none are left
+ */
+static void *
+fat12fsCheckWorker(void *arg)
+{
+	struct fat12fs_checkrun *ck = (struct fat12fs_checkrun *) arg;
+	struct fat12fs_checkentry *ce;
+	int i;
+
+	for (;;) {
+		i = __atomic_fetch_add(&ck->ck_next, 1, __ATOMIC_RELAXED);
+		if (i >= ck->ck_report->cr_nentries)
+			break;
+		ce = &ck->ck_report->cr_entries[i];
+		if (ck->ck_pass == 0)
+			fat12fsCheckWalk(ck, ce);
+		else
+			fat12fsCheckShared(ck, ce);
+	}
+	return NULL;
+}
+
+
+/**
+ * Run one pass of the check over every entry on nThreads threads,
+ * with the calling thread doing its share of the work
+ */
+static void
+fat12fsCheckPass(struct fat12fs_checkrun *ck, int pass, int nThreads)
+{
+	ck->ck_pass = pass;
+	ck->ck_next = 0;
+	fat12fsRunWorkers(fat12fsCheckWorker, ck, nThreads);
+}
+
+
+/**
+ * Add an entry found in a directory to the report, to be checked;
+ * returns (-1) if the report cannot grow to hold it
+ */
+static int
+fat12fsCheckAdd(struct fat12fs_checkrun *ck, const fat12fs_DIRENTRY *de,
+		int slot, int parent)
+{
+	struct fat12fs_checkreport *report = ck->ck_report;
+	struct fat12fs_checkentry *grown, *ce;
+
+	if (report->cr_nentries == ck->ck_room) {
+		grown = (struct fat12fs_checkentry *) realloc(
+				report->cr_entries, 2 * ck->ck_room
+					* sizeof(struct fat12fs_checkentry));
+		if (grown == NULL)
+			return (-1);
+		report->cr_entries = grown;
+		ck->ck_room *= 2;
+	}
+
+	ce = &report->cr_entries[report->cr_nentries++];
+	memset(ce, 0, sizeof(*ce));
+	ce->ce_direntry = slot;
+	ce->ce_parent = parent;
+	ce->ce_endblock = -1;
+	ce->ce_crossblock = -1;
+	ce->ce_other = -1;
+	ce->ce_entry = *de;
+	return 0;
+}
+
+
+/**
+ * Add the entries of the directory held by report entry "dir",
+ * reading its chain a cluster at a time.  A cluster already marked
+ * in "seen" is not read again, so a directory chain which loops, or
+ * which another directory also claims, is read at most once; what
+ * is wrong with the chain itself is left for its walk to find.
+ */
+static int
+fat12fsCheckReadDir(struct fat12fs_checkrun *ck, int dir,
+		unsigned char *seen, char *buffer)
+{
+	struct fat12fs *fs = ck->ck_fs;
+	const fat12fs_DIRENTRY *de;
+	int perCluster = fs->fs_clustersize / sizeof(fat12fs_DIRENTRY);
+	int cur, slot;
+	int i;
+
+	cur = fat12fsFirstCluster(fs, &ck->ck_report->cr_entries[dir].ce_entry);
+	for (slot = 0; fat12fsIsDataBlock(fs, cur) && !seen[cur];
+			cur = fs->fs_fattable[cur]) {
+		seen[cur] = 1;
+		if (fat12fsLoadDataBlock(fs, buffer, cur) < 0)
+			return (-1);
+		de = (const fat12fs_DIRENTRY *) buffer;
+		for (i = 0; i < perCluster; i++, de++, slot++) {
+			/** an unused entry is the end of the directory */
+			if (de->de_name[0] == NAME0_EMPTY)
+				return 0;
+			if (de->de_name[0] == NAME0_DELETED
+					|| de->de_name[0] == '.'
+					|| (de->de_attributes & ATTR_VOLUME))
+				continue;
+			if (fat12fsCheckAdd(ck, de, slot, dir) < 0)
+				return (-1);
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Gather the entries which should own chains: those of the root
+ * directory, then (breadth first, to FAT12FS_CHECKDEPTH levels) those
+ * of each directory found.  Every directory is read here, before any
+ * checking starts, so the workers only ever look at the FAT.
+ */
+static int
+fat12fsCheckGather(struct fat12fs_checkrun *ck)
+{
+	struct fat12fs *fs = ck->ck_fs;
+	struct fat12fs_checkreport *report = ck->ck_report;
+	const fat12fs_DIRENTRY *de;
+	unsigned char *seen;
+	char *buffer;
+	int status = 0;
+	int cur, depth, e;
+	int i;
+
+	for (i = 0; i < fs->fs_rootdirsize; i++) {
+		de = &fs->fs_rootdirentry[i];
+		if (de->de_name[0] == NAME0_EMPTY
+				|| de->de_name[0] == NAME0_DELETED
+				|| (de->de_attributes & ATTR_VOLUME))
+			continue;
+		if (fat12fsCheckAdd(ck, de, i, -1) < 0)
+			return (-1);
+	}
+
+	seen = (unsigned char *) calloc(fs->fs_fatsize, 1);
+	buffer = (char *) malloc(fs->fs_clustersize);
+	if (seen == NULL || buffer == NULL) {
+		free(seen);
+		free(buffer);
+		return (-1);
+	}
+
+	/** a FAT-32 rootdir is not to be read again as a subdirectory */
+	for (cur = fs->fs_rootcluster; fat12fsIsDataBlock(fs, cur)
+			&& !seen[cur]; cur = fs->fs_fattable[cur])
+		seen[cur] = 1;
+
+	/** the report grows as this goes, so each directory added is read */
+	for (e = 0; e < report->cr_nentries && status == 0; e++) {
+		if (!(report->cr_entries[e].ce_entry.de_attributes & ATTR_DIR))
+			continue;
+		for (depth = 0, i = e; report->cr_entries[i].ce_parent >= 0;
+				i = report->cr_entries[i].ce_parent)
+			depth++;
+		if (depth < FAT12FS_CHECKDEPTH)
+			status = fat12fsCheckReadDir(ck, e, seen, buffer);
+	}
+
+	free(seen);
+	free(buffer);
+	return status;
+}
+
+
+/**
+ * Check every file and directory, from the root directory down,
+ * against the FAT: each chain must start and stay on data blocks,
+ * end in EOF without looping, cover the file's size, and share no
+ * block with any other entry.  Allocated blocks which no entry
+ * reaches are reported as orphans.
+ *
+ * Subdirectories are read first, each once, and their entries added
+ * to those of the root.  The entries are then checked on up to
+ * nThreads threads (0 to choose automatically) working over the
+ * unpacked FAT in memory, so no more disk I/O is done.
+ *
+ * The report must be released with fat12fsFreeCheckReport().
+ * Returns the number of problems found (entries with a problem, plus
+ * one if there are orphans), or (-1) on failure.
+ */
+int
+fat12fsCheck(struct fat12fs *fs, int nThreads,
+		struct fat12fs_checkreport *report)
+{
+	struct fat12fs_checkrun ck;
+	unsigned int entry;
+	int cur;
+	int i;
+
+	memset(report, 0, sizeof(*report));
+	if (fat12fsEnsureFat(fs) < 0 || fat12fsEnsureRootdir(fs) < 0)
+		return (-1);
+
+	memset(&ck, 0, sizeof(ck));
+	ck.ck_fs = fs;
+	ck.ck_report = report;
+
+	ck.ck_room = fs->fs_rootdirsize + 1;
+	report->cr_entries = (struct fat12fs_checkentry *) malloc(
+			ck.ck_room * sizeof(struct fat12fs_checkentry));
+	report->cr_orphans = (unsigned int *) malloc(
+			fs->fs_fatsize * sizeof(unsigned int));
+	ck.ck_minowner = (int *) malloc(fs->fs_fatsize * sizeof(int));
+	ck.ck_maxowner = (int *) malloc(fs->fs_fatsize * sizeof(int));
+	if (report->cr_entries == NULL || report->cr_orphans == NULL
+			|| ck.ck_minowner == NULL || ck.ck_maxowner == NULL
+			|| fat12fsCheckGather(&ck) < 0) {
+		free(ck.ck_minowner);
+		free(ck.ck_maxowner);
+		fat12fsFreeCheckReport(report);
+		return (-1);
+	}
+
+	/** all bytes 0xff makes every owner -1 */
+	memset(ck.ck_minowner, 0xff, fs->fs_fatsize * sizeof(int));
+	memset(ck.ck_maxowner, 0xff, fs->fs_fatsize * sizeof(int));
+
+	nThreads = fat12fsThreadCount(nThreads, FAT12FS_CHECKTHREADS,
+			report->cr_nentries);
+
+	/**
+	 * a FAT-32 root directory has a chain too, which is claimed
+	 * as the entry one past the last, so that it is neither an
+	 * orphan nor free for a file to share unnoticed
+	 */
+	cur = fs->fs_rootcluster;
+	for (i = (fs->fs_rootdirsize * sizeof(struct fat12fs_DIRENTRY))
+				>> fs->fs_clustershift;
+			i > 0 && cur >= 2 && cur < fs->fs_fatsize; i--) {
+		fat12fsCheckClaim(&ck, cur, report->cr_nentries);
+		cur = fs->fs_fattable[cur];
+	}
+
+	/** sharing can only be judged once every chain is claimed */
+	fat12fsCheckPass(&ck, 0, nThreads);
+	fat12fsCheckPass(&ck, 1, nThreads);
+
+	for (i = 0; i < report->cr_nentries; i++) {
+		if (report->cr_entries[i].ce_flags != 0)
+			report->cr_nproblems++;
+	}
+
+	for (i = 2; i < fs->fs_fatsize; i++) {
+		entry = fs->fs_fattable[i];
+		if (entry != FAT12_FREE && entry != fs->fs_fateof - 1
+				&& ck.ck_minowner[i] < 0)
+			report->cr_orphans[report->cr_norphans++] = i;
+	}
+
+	free(ck.ck_minowner);
+	free(ck.ck_maxowner);
+	return report->cr_nproblems + (report->cr_norphans > 0);
+}
+
+
+/**
+ * Print the path of the directory held by a checked entry, from the
+ * root down, each name followed by a '/'
+ */
+static void
+fat12fsDumpCheckPath(FILE *ofp, const struct fat12fs_checkreport *report,
+		int dir)
+{
+	const struct fat12fs_checkentry *ce = &report->cr_entries[dir];
+	char name[FAT12FS_HOSTNAMELEN];
+
+	if (ce->ce_parent >= 0)
+		fat12fsDumpCheckPath(ofp, report, ce->ce_parent);
+	fat12fsHostName(&ce->ce_entry, name);
+	fprintf(ofp, "%s/", name);
+}
+
+
+/**
+ * Print where a checked entry is: its slot in the root directory, or
+ * the path of the directory holding it and its slot there
+ */
+static void
+fat12fsDumpCheckPlace(FILE *ofp, const struct fat12fs_checkreport *report,
+		int e)
+{
+	const struct fat12fs_checkentry *ce = &report->cr_entries[e];
+
+	/** one past the last entry stands for a FAT-32 rootdir chain */
+	if (e == report->cr_nentries) {
+		fprintf(ofp, "the root directory");
+		return;
+	}
+	if (ce->ce_parent >= 0)
+		fat12fsDumpCheckPath(ofp, report, ce->ce_parent);
+	fprintf(ofp, "%d", ce->ce_direntry);
+}
+
+
+/**
+ * Print the findings of fat12fsCheck(), one line per entry with a
+ * problem, followed by the orphaned blocks as runs
+ */
+int
+fat12fsDumpCheck(FILE *ofp, struct fat12fs *fs,
+		const struct fat12fs_checkreport *report)
+{
+	const struct fat12fs_checkentry *ce;
+	const fat12fs_DIRENTRY *de;
+	int i, j;
+
+	(void) fs;
+	fprintf(ofp, "Filesystem check of %d entries:\n", report->cr_nentries);
+	for (i = 0; i < report->cr_nentries; i++) {
+		ce = &report->cr_entries[i];
+		if (ce->ce_flags == 0)
+			continue;
+		de = &ce->ce_entry;
+		fat12fsDumpCheckPlace(ofp, report, i);
+		fprintf(ofp, " : [%.8s.%.3s]", de->de_name, de->de_nameext);
+		if (ce->ce_flags & FAT12FS_CHECK_BADSTART)
+			fprintf(ofp, " BAD START %d", ce->ce_endblock);
+		if (ce->ce_flags & FAT12FS_CHECK_BADCHAIN)
+			fprintf(ofp, " BAD LINK at %d", ce->ce_endblock);
+		if (ce->ce_flags & FAT12FS_CHECK_CYCLE)
+			fprintf(ofp, " CYCLE at %d", ce->ce_endblock);
+		if (ce->ce_flags & FAT12FS_CHECK_LENGTH)
+			fprintf(ofp, " LENGTH %d blocks for %x bytes",
+					ce->ce_nblocks, de->de_filelen);
+		if (ce->ce_flags & FAT12FS_CHECK_CROSSLINK) {
+			fprintf(ofp, " CROSSLINKED with ");
+			fat12fsDumpCheckPlace(ofp, report, ce->ce_other);
+			fprintf(ofp, " at %d", ce->ce_crossblock);
+		}
+		fprintf(ofp, "\n");
+	}
+
+	if (report->cr_norphans > 0) {
+		fprintf(ofp, "%d orphaned blocks:", report->cr_norphans);
+		for (i = 0; i < report->cr_norphans; i = j) {
+			for (j = i + 1; j < report->cr_norphans
+					&& report->cr_orphans[j]
+						== report->cr_orphans[j - 1] + 1;
+					j++)
+				;
+			if (j - i == 1)
+				fprintf(ofp, " %d", report->cr_orphans[i]);
+			else
+				fprintf(ofp, " %d-%d", report->cr_orphans[i],
+						report->cr_orphans[j - 1]);
+		}
+		fprintf(ofp, "\n");
+	}
+
+	if (report->cr_nproblems == 0 && report->cr_norphans == 0)
+		fprintf(ofp, "Filesystem is OK\n");
+	else
+		fprintf(ofp, "Filesystem has %d damaged entries,"
+				" %d orphaned blocks\n",
+				report->cr_nproblems, report->cr_norphans);
+	return 1;
+}
+
+
+/**
+ * Release the storage held by a check report
+ */
+void
+fat12fsFreeCheckReport(struct fat12fs_checkreport *report)
+{
+	free(report->cr_entries);
+	free(report->cr_orphans);
+	report->cr_entries = NULL;
+	report->cr_orphans = NULL;
+}
+
+
+/**
+ * The device reads a full read of nbytes from a run of nblocks takes
+ * on a cold mount which is not mapped: fat12fsReadRun() sends a run
+ * of FAT12FS_DIRECTMIN clusters or more to the device in one read,
+ * and a shorter one through the cache a cluster at a time
+ */
+static int
+fat12fsRunReads(const struct fat12fs *fs, int nblocks, unsigned int nbytes)
+{
+	if (nbytes >= (unsigned int) FAT12FS_DIRECTMIN << fs->fs_clustershift)
+		return 1;
+	return nblocks;
+}
+
+
+/**
+ * Measure how fragmented the volume is: the runs each file's chain
+ * is broken into (through its extent map), the reads it would take
+ * to read every file whole as they lie and as they would if each
+ * were contiguous, and the runs the free space is broken into.  The
+ * files are those fat12fsGatherFiles() finds, listed in rootdir
+ * order, and the report must be released with fat12fsFreeFragReport().
+ *
+ * Returns 0, or (-1) if the FAT or rootdir cannot be loaded
+ */
+int
+fat12fsFragReport(struct fat12fs *fs, struct fat12fs_fragreport *report)
+{
+	struct fat12fs_filejob *jobs;
+	struct fat12fs_fragentry *fe;
+	struct fat12fs_extentmap *em;
+	uint64_t word, carry;
+	unsigned int filelen, nbytes;
+	int njobs, nwords;
+	int e, i, w;
+
+	memset(report, 0, sizeof(*report));
+	njobs = fat12fsGatherFiles(fs, &jobs);
+	if (njobs < 0)
+		return (-1);
+	report->fr_entries = (struct fat12fs_fragentry *) calloc(
+			njobs + 1, sizeof(struct fat12fs_fragentry));
+	if (report->fr_entries == NULL) {
+		free(jobs);
+		return (-1);
+	}
+	report->fr_nentries = njobs;
+
+	for (i = 0; i < njobs; i++) {
+		fe = &report->fr_entries[jobs[i].fj_index];
+		fe->fe_direntry = jobs[i].fj_direntry;
+		fat12fsHostName(&fs->fs_rootdirentry[fe->fe_direntry],
+				fe->fe_name);
+
+		/** a chain which cannot be mapped counts as empty */
+		em = fat12fsGetExtents(fs, fe->fe_direntry);
+		if (em == NULL)
+			continue;
+		filelen = (unsigned int) fat12fsClampRead(fs, fe->fe_direntry,
+				em, 0, INT_MAX);
+		fe->fe_nblocks = em->em_nblocks;
+		fe->fe_nruns = em->em_nextents;
+		for (e = 0; e < em->em_nextents; e++) {
+			nbytes = em->em_extents[e].ex_len << fs->fs_clustershift;
+			if (nbytes > filelen)
+				nbytes = filelen;
+			filelen -= nbytes;
+			fe->fe_nreads += fat12fsRunReads(fs,
+					em->em_extents[e].ex_len, nbytes);
+		}
+
+		if (fe->fe_nruns > 1)
+			report->fr_nfragmented++;
+		report->fr_nblocks += fe->fe_nblocks;
+		report->fr_nruns += fe->fe_nruns;
+		report->fr_nreads += fe->fe_nreads;
+		if (fe->fe_nblocks > 0)
+			report->fr_minreads += fat12fsRunReads(fs,
+				fe->fe_nblocks, fat12fsClampRead(fs,
+					fe->fe_direntry, em, 0, INT_MAX));
+	}
+	free(jobs);
+
+	/** a free run starts at each set bit whose lower neighbour is clear */
+	nwords = (fs->fs_fatsize + 63) / 64;
+	carry = 0;
+	for (w = 0; w < nwords; w++) {
+		word = fs->fs_freemap[w];
+		report->fr_nfreeruns += __builtin_popcountll(
+				word & ~((word << 1) | carry));
+		carry = word >> 63;
+	}
+	return 0;
+}
+
+
+/**
+ * Print a fragmentation report: a line for each file, then the
+ * totals for the volume
+ */
+int
+fat12fsDumpFrag(FILE *ofp, const struct fat12fs_fragreport *report)
+{
+	const struct fat12fs_fragentry *fe;
+	unsigned long nbreaks, nlinks;
+	int i;
+
+	fprintf(ofp, "Fragmentation of %d files:\n", report->fr_nentries);
+	fprintf(ofp, "%7s %8s %6s %6s  %s\n",
+			"entry", "blocks", "runs", "reads", "name");
+	nlinks = 0;
+	for (i = 0; i < report->fr_nentries; i++) {
+		fe = &report->fr_entries[i];
+		fprintf(ofp, "%7d %8d %6d %6d  %s\n", fe->fe_direntry,
+				fe->fe_nblocks, fe->fe_nruns, fe->fe_nreads,
+				fe->fe_name);
+		if (fe->fe_nblocks > 0)
+			nlinks += fe->fe_nblocks - 1;
+	}
+
+	/**
+	 * the volume's fragmentation is the share of links from one
+	 * block of a file to the next which are not to the block
+	 * physically following
+	 */
+	nbreaks = report->fr_nruns;
+	for (i = 0; i < report->fr_nentries; i++) {
+		if (report->fr_entries[i].fe_nruns > 0)
+			nbreaks--;
+	}
+	fprintf(ofp, "%d of %d files fragmented, %lu blocks in %lu runs"
+			" (%.1f blocks per run)\n",
+			report->fr_nfragmented, report->fr_nentries,
+			report->fr_nblocks, report->fr_nruns,
+			(report->fr_nruns > 0) ? (double) report->fr_nblocks
+				/ report->fr_nruns : 0.0);
+	fprintf(ofp, "Volume fragmentation %.1f%%\n",
+			(nlinks > 0) ? 100.0 * nbreaks / nlinks : 0.0);
+	fprintf(ofp, "Reading every file takes %lu device reads,"
+			" %lu if each were contiguous\n",
+			report->fr_nreads, report->fr_minreads);
+	fprintf(ofp, "Free space in %d runs\n", report->fr_nfreeruns);
+	return 1;
+}
+
+
+/**
+ * Release the storage held by a fragmentation report
+ */
+void
+fat12fsFreeFragReport(struct fat12fs_fragreport *report)
+{
+	free(report->fr_entries);
+	report->fr_entries = NULL;
+}
+
+
+/**
+ * Store one entry into a packed FAT of the mount's width, leaving
+ * alone the neighbouring bits the entry shares its bytes with (for
+ * FAT-32, the top four bits, which are reserved)
+ */
+static void
+fat12fsPackFatEntry(const struct fat12fs *fs, unsigned char *packed,
+		int index, uint32_t val)
+{
+	unsigned char *p;
+
+	if (fs->fs_fatbits == 32) {
+		p = &packed[(size_t) index * 4];
+		p[0] = val & 0xff;
+		p[1] = (val >> 8) & 0xff;
+		p[2] = (val >> 16) & 0xff;
+		p[3] = (p[3] & 0xf0) | ((val >> 24) & 0x0f);
+	} else if (fs->fs_fatbits == 16) {
+		p = &packed[(size_t) index * 2];
+		p[0] = val & 0xff;
+		p[1] = (val >> 8) & 0xff;
+	} else {
+		p = &packed[((size_t) index * 3) / 2];
+		if (index & 0x1) {
+			p[0] = (p[0] & 0x0f) | ((val & 0x0f) << 4);
+			p[1] = (val >> 4) & 0xff;
+		} else {
+			p[0] = val & 0xff;
+			p[1] = (p[1] & 0xf0) | ((val >> 8) & 0x0f);
+		}
+	}
+}
+
+
+/**
+ * Give out the first n physically consecutive blocks at or after
+ * *nextp which are free in a repacked image's table, chaining them
+ * there; the only blocks already in use are those marked bad, which
+ * a run steps over.  Returns the first block, or (-1) if there is
+ * no room.
+ */
+static int
+fat12fsRepackRun(struct fat12fs *fs, uint32_t *table, int *nextp, int n)
+{
+	int start, i;
+
+	for (start = i = *nextp; i < start + n; i++) {
+		if (i >= fs->fs_fatsize)
+			return (-1);
+		if (table[i] != FAT12_FREE)
+			start = i + 1;
+	}
+	for (i = start; i < start + n - 1; i++)
+		table[i] = i + 1;
+	table[start + n - 1] = fs->fs_fatmask;
+	*nextp = start + n;
+	return start;
+}
+
+
+/**
+ * Store a little-endian 32-bit value into an on-disk structure
+ */
+static void
+fat12fsPutLong(unsigned char *p, uint32_t val)
+{
+	p[0] = val & 0xff;
+	p[1] = (val >> 8) & 0xff;
+	p[2] = (val >> 16) & 0xff;
+	p[3] = (val >> 24) & 0xff;
+}
+
+
+/**
+ * Bring the reserved sectors of a repacked FAT-32 image up to date:
+ * the root directory cluster in the boot sector and its backup, and
+ * the free count and next free hint of the FS information sector
+ */
+static void
+fat12fsRepackReserved(struct fat12fs *fs, unsigned char *reserved,
+		unsigned int rootcluster, unsigned int nfree, unsigned int next)
+{
+	const struct fat12fs_BOOTBLOCK32 *bb32;
+	unsigned short fsinfo, backup;
+	size_t rootfield;
+
+	bb32 = (const struct fat12fs_BOOTBLOCK32 *)
+			((const fat12fs_BOOTBLOCK *) reserved)->bb_extra;
+	bcopy((const char *) bb32->bb_fsinfo_sector, (char *) &fsinfo, 2);
+	bcopy((const char *) bb32->bb_backup_boot_sector, (char *) &backup, 2);
+
+	rootfield = offsetof(struct fat12fs_BOOTBLOCK, bb_extra)
+			+ offsetof(struct fat12fs_BOOTBLOCK32, bb_root_cluster);
+	fat12fsPutLong(&reserved[rootfield], rootcluster);
+	if (backup > 0 && backup < fs->fs_fatblock)
+		fat12fsPutLong(&reserved[(size_t) backup * FS_BLKSIZE
+				+ rootfield], rootcluster);
+
+	/** only a sector carrying both FS information signatures */
+	if (fsinfo > 0 && fsinfo < fs->fs_fatblock
+			&& memcmp(&reserved[(size_t) fsinfo * FS_BLKSIZE],
+				"RRaA", 4) == 0
+			&& memcmp(&reserved[(size_t) fsinfo * FS_BLKSIZE + 484],
+				"rrAa", 4) == 0) {
+		fat12fsPutLong(&reserved[(size_t) fsinfo * FS_BLKSIZE + 488],
+				nfree);
+		fat12fsPutLong(&reserved[(size_t) fsinfo * FS_BLKSIZE + 492],
+				next);
+	}
+}
+
+
+/**
+ * Write a repacked copy of the image to the host file "path": the
+ * same geometry, boot block and reserved sectors, but with the data
+ * of every file (and of a FAT-32 root directory) stored in one run,
+ * in rootdir order from the start of the data area, and the FAT
+ * copies and directory entries rewritten to match.  Blocks marked
+ * bad stay so, and are stepped over.  Every entry with a chain gets
+ * a copy of it, so cross-linked files come out apart; only as much
+ * of a chain as the file's length needs is kept.  The root directory
+ * may not hold subdirectories, whose entries could not be followed.
+ *
+ * The copy is written to a new file which is then renamed to path,
+ * so path may even be the image being read.
+ *
+ * Returns the number of files written, or (-1) on failure
+ */
+int
+fat12fsRepack(struct fat12fs *fs, const char *path)
+{
+	struct fat12fs_extentmap *em;
+	fat12fs_DIRENTRY *dir = NULL, *de;
+	unsigned char *packed = NULL, *reserved = NULL;
+	uint32_t *table = NULL;
+	char tmppath[PATH_MAX];
+	char *bounce = NULL;
+	struct stat sb;
+	size_t dirbytes, fatbytes, resbytes;
+	unsigned int nfree;
+	int rootcluster = 0;
+	int method = EXPORT_COPYRANGE;
+	int nfiles = 0;
+	int status = -1;
+	int next, start;
+	int fd = -1;
+	int c, i;
+
+	tmppath[0] = '\0';
+	if (fat12fsEnsureFat(fs) < 0 || fat12fsEnsureRootdir(fs) < 0
+			|| fstat(fs->fs_fd, &sb) < 0)
+		return (-1);
+
+	dirbytes = fs->fs_rootdirsize * sizeof(fat12fs_DIRENTRY);
+	fatbytes = (size_t) fs->fs_fatsectors * FS_BLKSIZE;
+	resbytes = (size_t) fs->fs_fatblock * FS_BLKSIZE;
+	dir = (fat12fs_DIRENTRY *) malloc(dirbytes);
+	table = (uint32_t *) calloc(fs->fs_fatsize, sizeof(uint32_t));
+	packed = (unsigned char *) calloc(1, fatbytes);
+	reserved = (unsigned char *) malloc(resbytes);
+	if (dir == NULL || table == NULL || packed == NULL
+			|| reserved == NULL)
+		goto DONE;
+	memcpy(dir, fs->fs_rootdirentry, dirbytes);
+
+	/** the media and end marks of entries 0 and 1 carry over */
+	table[0] = fs->fs_fattable[0];
+	table[1] = fs->fs_fattable[1];
+	for (i = 2; i < fs->fs_fatsize; i++) {
+		if (fs->fs_fattable[i] == fs->fs_fateof - 1)
+			table[i] = fs->fs_fattable[i];
+	}
+
+	/** lay out the FAT-32 root directory first, then the files */
+	next = 2;
+	if (fs->fs_rootcluster != 0) {
+		rootcluster = fat12fsRepackRun(fs, table, &next,
+				(int) (dirbytes >> fs->fs_clustershift));
+		if (rootcluster < 0) {
+			fprintf(stderr, "No room for the root directory\n");
+			goto DONE;
+		}
+	}
+	for (i = 0; i < fs->fs_rootdirsize; i++) {
+		de = &dir[i];
+		if (de->de_name[0] == NAME0_EMPTY
+				|| de->de_name[0] == NAME0_DELETED
+				|| (de->de_attributes & ATTR_VOLUME))
+			continue;
+		if (de->de_attributes & ATTR_DIR) {
+			fprintf(stderr, "Cannot repack subdirectory"
+					" [%.8s.%.3s]\n",
+					de->de_name, de->de_nameext);
+			goto DONE;
+		}
+
+		em = fat12fsGetExtents(fs, i);
+		if (em == NULL)
+			goto DONE;
+		start = 0;
+		if (em->em_nblocks > 0) {
+			start = fat12fsRepackRun(fs, table, &next,
+					em->em_nblocks);
+			if (start < 0) {
+				fprintf(stderr, "No room for [%.8s.%.3s]\n",
+						de->de_name, de->de_nameext);
+				goto DONE;
+			}
+		}
+		de->de_fileblock0 = start & 0xffff;
+		if (fs->fs_fatbits == 32) {
+			de->de_file_block0high[0] = (start >> 16) & 0xff;
+			de->de_file_block0high[1] = (start >> 24) & 0xff;
+		}
+		nfiles++;
+	}
+
+	nfree = 0;
+	for (i = 2; i < fs->fs_fatsize; i++) {
+		if (table[i] == FAT12_FREE)
+			nfree++;
+	}
+	for (i = 0; i < fs->fs_fatsize; i++)
+		fat12fsPackFatEntry(fs, packed, i, table[i]);
+
+	if (blockDeviceRead(fs->fs_bdev, (char *) reserved, resbytes, 0) < 0)
+		goto DONE;
+	if (fs->fs_rootcluster != 0)
+		fat12fsRepackReserved(fs, reserved, rootcluster, nfree,
+				(next < fs->fs_fatsize)
+					? (unsigned int) next : 0xffffffff);
+
+	if (snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", path)
+			>= (int) sizeof(tmppath))
+		goto DONE;
+	fd = mkstemp(tmppath);
+	if (fd < 0) {
+		tmppath[0] = '\0';
+		goto DONE;
+	}
+	(void) fchmod(fd, 0644);
+
+	/** blocks no file was given are left as holes, reading as 0 */
+	if (ftruncate(fd, sb.st_size) < 0
+			|| fat12fsPwriteFull(fd, reserved, resbytes, 0) < 0)
+		goto DONE;
+	for (c = 0; c < fs->fs_numfats; c++) {
+		if (fat12fsPwriteFull(fd, packed, fatbytes,
+				(off_t) (fs->fs_fatblock
+					+ c * fs->fs_fatsectors) * FS_BLKSIZE) < 0)
+			goto DONE;
+	}
+	if (fat12fsPwriteFull(fd, dir, dirbytes, (rootcluster != 0)
+				? fat12fsClusterOffset(fs, rootcluster)
+				: (off_t) fs->fs_rootdirblock * FS_BLKSIZE) < 0)
+		goto DONE;
+
+	/** each file is one run in the copy, so one export writes it */
+	for (i = 0; i < fs->fs_rootdirsize; i++) {
+		start = fat12fsFirstCluster(fs, &dir[i]);
+		if (start < 2 || dir[i].de_name[0] == NAME0_EMPTY
+				|| dir[i].de_name[0] == NAME0_DELETED
+				|| (dir[i].de_attributes & ATTR_VOLUME))
+			continue;
+		if (lseek(fd, fat12fsClusterOffset(fs, start), SEEK_SET) < 0
+				|| fat12fsExportEntry(fs, i, fd,
+					&method, &bounce) < 0)
+			goto DONE;
+	}
+
+	if (close(fd) == 0 && rename(tmppath, path) == 0)
+		status = nfiles;
+	fd = -1;
+
+DONE:
+	if (fd >= 0)
+		(void) close(fd);
+	if (status < 0 && tmppath[0] != '\0')
+		(void) unlink(tmppath);
+	free(bounce);
+	free(reserved);
+	free(packed);
+	free(table);
+	free(dir);
+	return status;
+}
+
+
+/**
+ * Whether the free map has data block "cluster" as free
+ */
+static inline int
+fat12fsIsFree(const struct fat12fs *fs, int cluster)
+{
+	return (fs->fs_freemap[cluster / 64] >> (cluster % 64)) & 0x1;
+}
+
+
+/**
+ * Test and clear the bits of the dirty sector maps
+ */
+static inline int
+fat12fsIsMarked(const uint64_t *map, unsigned int i)
+{
+	return (map[i / 64] >> (i % 64)) & 0x1;
+}
+
+static inline void
+fat12fsUnmark(uint64_t *map, unsigned int i)
+{
+	map[i / 64] &= ~((uint64_t) 1 << (i % 64));
+}
+
+
+/**
+ * Mark the FAT sectors holding an entry as changed; a FAT-12 entry
+ * may straddle two of them
+ */
+static void
+fat12fsDirtyFatEntry(struct fat12fs *fs, int index)
+{
+	size_t first, last;
+
+	first = ((size_t) index * fs->fs_fatbits) / 8 / FS_BLKSIZE;
+	last = (((size_t) index * fs->fs_fatbits + fs->fs_fatbits - 1) / 8)
+			/ FS_BLKSIZE;
+	fs->fs_fatdirty[first / 64] |= (uint64_t) 1 << (first % 64);
+	fs->fs_fatdirty[last / 64] |= (uint64_t) 1 << (last % 64);
+}
+
+
+/**
+ * Mark the rootdir sector holding an entry as changed
+ */
+static void
+fat12fsDirtyDirEntry(struct fat12fs *fs, int dirEntryIndex)
+{
+	int blk = dirEntryIndex / FAT_DIRPERBLK;
+
+	fs->fs_dirdirty[blk / 64] |= (uint64_t) 1 << (blk % 64);
+}
+
+
+/**
+ * Change one entry of the FAT: in the unpacked table, in the packed
+ * copy which fat12fsSync() writes out, and in the free map and count
+ */
+static void
+fat12fsSetFatEntry(struct fat12fs *fs, int index, uint32_t val)
+{
+	uint64_t bit = (uint64_t) 1 << (index % 64);
+	int wasFree = (fs->fs_fattable[index] == FAT12_FREE);
+
+	fs->fs_fattable[index] = val;
+	fat12fsPackFatEntry(fs, fs->fs_fatdata, index, val);
+	fat12fsDirtyFatEntry(fs, index);
+
+	if (wasFree && val != FAT12_FREE) {
+		fs->fs_freemap[index / 64] &= ~bit;
+		fs->fs_nfree--;
+		fs->fs_freestale = 1;
+	} else if (!wasFree && val == FAT12_FREE) {
+		fs->fs_freemap[index / 64] |= bit;
+		fs->fs_nfree++;
+		fs->fs_freestale = 1;
 	}
-	return 1;
 }
 
+
 /**
- * Print out the root directory, printing out only entries
- * which are not empty, and labelling each type of entry:
- *   VOL(ume)
- *   DEL(eted)
- *   FILE
+ * Find the lowest free block at or after "from", or (-1)
  */
-int
-fat12fsDumpRootdir(FILE *ofp, struct fat12fs *fs)
+static int
+fat12fsNextFree(const struct fat12fs *fs, int from)
 {
-	fprintf(ofp, "Root directory dump:\n");
-	for (int i = 0; i < fs->fs_rootdirsize; i++) {
-		fat12fs_DIRENTRY cur = fs->fs_rootdirentry[i];
-		if (cur.de_name[0] == NAME0_EMPTY) {
+	uint64_t word;
+	int nwords = (fs->fs_fatsize + 63) / 64;
+	int w = from / 64;
+
+	if (from >= fs->fs_fatsize)
+		return (-1);
+	word = fs->fs_freemap[w] & (~(uint64_t) 0 << (from % 64));
+	for (;;) {
+		if (word != 0)
+			return w * 64 + __builtin_ctzll(word);
+		if (++w >= nwords)
+			return (-1);
+		word = fs->fs_freemap[w];
+	}
+}
+
+
+/**
+ * Find the first run of at least n free blocks, or (-1) if there is
+ * none.  Whole words of the free map are stepped over at a time, so
+ * a full FAT costs one test per 64 blocks.
+ */
+static int
+fat12fsFindFreeRunOf(const struct fat12fs *fs, int n)
+{
+	uint64_t word;
+	int nwords = (fs->fs_fatsize + 63) / 64;
+	int run = 0, start = 0;
+	int i, w;
+
+	for (w = 0; w < nwords; w++) {
+		word = fs->fs_freemap[w];
+		if (word == 0) {
+			run = 0;
 			continue;
 		}
-		if (cur.de_name[0] == NAME0_DELETED) {
-			fprintf(ofp, "%d : DEL  ", i);
-		} else if (cur.de_attributes & ATTR_VOLUME) {
-			fprintf(ofp, "%d : VOL  ", i);
-		} else {
-			fprintf(ofp, "%d : FILE ", i);
+		if (word == ~(uint64_t) 0 && run + 64 < n) {
+			if (run == 0)
+				start = w * 64;
+			run += 64;
+			continue;
+		}
+		for (i = 0; i < 64; i++) {
+			if (!(word & ((uint64_t) 1 << i))) {
+				run = 0;
+				continue;
+			}
+			if (run++ == 0)
+				start = w * 64 + i;
+			if (run >= n)
+				return start;
 		}
-		fprintf(ofp, "[%.8s.%.3s] (%x bytes, start %d)\n", cur.de_name, cur.de_nameext, cur.de_filelen, cur.de_fileblock0);
 	}
-	return 1;
+	return (-1);
 }
 
+
 /**
- * Search through the root directory, looking for the given
- * file name.
- *
- * Note that as is typical with DOS, search should be case
- * insensitive.  Be sure to handle the fact that the "extension"
- * is stored separately from the "name" portion.
+ * Add n blocks to the chain ending at block "last" (0 for a file
+ * which has none yet), placing them contiguous-first: straight after
+ * last while those blocks are free, so the file stays in one run,
+ * then at the first free run which holds all that remain, and only
+ * failing that in the lowest free blocks, in order.
  *
- * Only "files" should be found -- Volumes or "deleted" items
- * should be skipped
+ * Returns the first block added, or (-1), having changed nothing, if
+ * the volume has fewer than n blocks free
  */
-int
-fat12fsSearchRootdir(
-	struct fat12fs *fs,
-	const char *filename)
+static int
+fat12fsAllocBlocks(struct fat12fs *fs, int last, int n)
 {
+	int first = 0;
+	int cur;
 
-	char* per = strchr(filename, '.');
-	char* name = malloc(per - filename);
-	strncpy(name, filename, per - filename);
-	name[per - filename] = '\0';
-	char* ext = malloc(strlen(per) - 1);
-	strcpy(ext, per + 1);
-	ext[strlen(per) - 1] = '\0';
+	if (n > fs->fs_nfree)
+		return (-1);
 
-	for (int i = 0; i < strlen(name); i++) {
-		name[i] = toupper(name[i]);
+	cur = last + 1;
+	while (n > 0) {
+		if (last < 2 || cur >= fs->fs_fatsize
+				|| !fat12fsIsFree(fs, cur)) {
+			cur = fat12fsFindFreeRunOf(fs, n);
+			if (cur < 0)
+				cur = fat12fsNextFree(fs, 2);
+		}
+		fat12fsSetFatEntry(fs, cur, fs->fs_fatmask);
+		if (last >= 2)
+			fat12fsSetFatEntry(fs, last, cur);
+		if (first == 0)
+			first = cur;
+		last = cur++;
+		n--;
 	}
+	return first;
+}
+
+
+/**
+ * Free every block of the chain starting at "cur".  A chain which
+ * loops back on itself stops at the first block already freed.
+ */
+static void
+fat12fsFreeChain(struct fat12fs *fs, uint32_t cur)
+{
+	uint32_t next;
+
+	while (fat12fsIsDataBlock(fs, cur)
+			&& fs->fs_fattable[cur] != FAT12_FREE) {
+		next = fs->fs_fattable[cur];
+		fat12fsSetFatEntry(fs, cur, FAT12_FREE);
+		cur = next;
+	}
+}
 
-	for (int i = 0; i < fs->fs_rootdirsize; i++) {
-		int correct = 1;
-		if (*fs->fs_rootdirentry[i].de_nameext == '\0') {
-			continue;
-		}
-		char* fname = fs->fs_rootdirentry[i].de_name;
 
-		//doing it this way because the last 3 char of de_name seem to include EXT too as its not \0'd
-		for (int j = 0; j < strlen(name); j++) {
-			if (fname[j] != name[j]) {
-				correct = 0;
+/**
+ * Point a directory entry at the first block of its chain
+ */
+static void
+fat12fsSetFirstCluster(struct fat12fs *fs, fat12fs_DIRENTRY *de,
+		int cluster)
+{
+	de->de_fileblock0 = cluster & 0xffff;
+	if (fs->fs_fatbits == 32) {
+		de->de_file_block0high[0] = (cluster >> 16) & 0xff;
+		de->de_file_block0high[1] = (cluster >> 24) & 0xff;
+	}
+}
+
+
+/**
+ * Make the chain of a rootdir entry long enough for "length" bytes,
+ * from where its extent map (built for the current length) leaves
+ * off, so that appending to a long file does not walk all of it.
+ * Blocks already chained past the end of the file are used first.
+ */
+static int
+fat12fsGrowChain(struct fat12fs *fs, int dirEntryIndex, unsigned int length)
+{
+	fat12fs_DIRENTRY *de = &fs->fs_rootdirentry[dirEntryIndex];
+	const struct fat12fs_extentmap *em;
+	const struct fat12fs_extent *ex;
+	uint32_t cur;
+	int have, need, last, first;
+
+	need = (int) (((uint64_t) length + fs->fs_clustersize - 1)
+			>> fs->fs_clustershift);
+	em = fat12fsGetExtents(fs, dirEntryIndex);
+	if (em == NULL)
+		return (-1);
+
+	have = em->em_nblocks;
+	if (have > 0) {
+		ex = &em->em_extents[em->em_nextents - 1];
+		last = ex->ex_start + ex->ex_len - 1;
+		cur = fs->fs_fattable[last];
+	} else {
+		last = 0;
+		cur = fat12fsFirstCluster(fs, de);
+	}
+	for (; have < need && fat12fsIsDataBlock(fs, cur)
+			&& fs->fs_fattable[cur] != FAT12_FREE;
+			cur = fs->fs_fattable[cur]) {
+		last = cur;
+		have++;
+	}
+	if (have >= need)
+		return 0;
+
+	first = fat12fsAllocBlocks(fs, last, need - have);
+	if (first < 0)
+		return (-1);
+	if (last == 0)
+		fat12fsSetFirstCluster(fs, de, first);
+	return 0;
+}
+
+
+/**
+ * Cut the chain of a rootdir entry down to what "length" bytes need,
+ * freeing the rest; a length of 0 leaves the file with no chain
+ */
+static void
+fat12fsShrinkChain(struct fat12fs *fs, int dirEntryIndex, unsigned int length)
+{
+	fat12fs_DIRENTRY *de = &fs->fs_rootdirentry[dirEntryIndex];
+	uint32_t cur, rest;
+	int need, have;
+
+	need = (int) (((uint64_t) length + fs->fs_clustersize - 1)
+			>> fs->fs_clustershift);
+	cur = fat12fsFirstCluster(fs, de);
+	if (need == 0) {
+		fat12fsFreeChain(fs, cur);
+		fat12fsSetFirstCluster(fs, de, 0);
+		return;
+	}
+
+	for (have = 1; have < need && fat12fsIsDataBlock(fs, cur); have++)
+		cur = fs->fs_fattable[cur];
+	if (!fat12fsIsDataBlock(fs, cur))
+		return;
+
+	rest = fs->fs_fattable[cur];
+	if (rest != fs->fs_fatmask) {
+		fat12fsSetFatEntry(fs, cur, fs->fs_fatmask);
+		fat12fsFreeChain(fs, rest);
+	}
+}
+
+
+/**
+ * Set the modification (and if "created", the creation) time of a
+ * directory entry to now, in the DOS packed form; the access date
+ * goes with it
+ */
+static void
+fat12fsStampEntry(fat12fs_DIRENTRY *de, int created)
+{
+	unsigned short dostime, dosdate;
+	struct tm tm;
+	time_t now;
+
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	if (tm.tm_year < 80) {
+		dostime = 0;
+		dosdate = (1 << 5) | 1;
+	} else {
+		dostime = (tm.tm_hour << 11) | (tm.tm_min << 5)
+				| (tm.tm_sec / 2);
+		dosdate = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5)
+				| tm.tm_mday;
+	}
+
+	de->de_modtime = dostime;
+	de->de_moddate = dosdate;
+	de->de_adate[0] = dosdate & 0xff;
+	de->de_adate[1] = dosdate >> 8;
+	if (created) {
+		de->de_ctime100thsec = (tm.tm_sec % 2) * 100;
+		de->de_ctime[0] = dostime & 0xff;
+		de->de_ctime[1] = dostime >> 8;
+		de->de_cdate[0] = dosdate & 0xff;
+		de->de_cdate[1] = dosdate >> 8;
+	}
+}
+
+
+/** what is written into blocks which are to read as zeros */
+static const char fat12fsZeros[FS_MAXCLUSTERSECTORS * FS_BLKSIZE];
+
+/**
+ * Write nbytes at startpos of a file whose chain and length already
+ * cover them, from buffer, or as zeros if buffer is NULL.  Each run
+ * of physically contiguous blocks is a single write (or, for zeros,
+ * as few as the zero buffer allows), and any cached copies of the
+ * blocks are brought up to date.
+ */
+static int
+fat12fsWriteRange(struct fat12fs *fs, int dirEntryIndex,
+		const char *buffer, unsigned int startpos, unsigned int nbytes)
+{
+	const struct fat12fs_extentmap *em;
+	const struct fat12fs_extent *ex;
+	unsigned int fileblk, blockOffset;
+	unsigned int n, k, done;
+	off_t offset;
+	int cluster, e;
+
+	em = fat12fsGetExtents(fs, dirEntryIndex);
+	if (em == NULL)
+		return (-1);
+
+	fileblk = startpos >> fs->fs_clustershift;
+	blockOffset = startpos & (fs->fs_clustersize - 1);
+	e = (em->em_nextents > 0) ? fat12fsFindExtent(em, fileblk) : 0;
+	while (nbytes > 0) {
+		if (e >= em->em_nextents || em->em_nblocks < 0
+				|| fileblk >= (unsigned int) em->em_nblocks)
+			return (-1);
+		ex = &em->em_extents[e];
+		cluster = ex->ex_start + (fileblk - ex->ex_fileblk);
+		n = ((ex->ex_fileblk + ex->ex_len - fileblk)
+				<< fs->fs_clustershift) - blockOffset;
+		if (n > nbytes)
+			n = nbytes;
+		offset = fat12fsClusterOffset(fs, cluster) + blockOffset;
+
+		if (buffer != NULL) {
+			if (fat12fsPwriteFull(fs->fs_fd, buffer, n, offset) < 0)
+				return (-1);
+			FS_COUNT(fs, st_datawrites, 1);
+		} else {
+			for (done = 0; done < n; done += k) {
+				k = n - done;
+				if (k > sizeof(fat12fsZeros))
+					k = sizeof(fat12fsZeros);
+				if (fat12fsPwriteFull(fs->fs_fd, fat12fsZeros,
+						k, offset + done) < 0)
+					return (-1);
+				FS_COUNT(fs, st_datawrites, 1);
 			}
 		}
 
-		if (correct == 1) {
-			free(name);
-			free(ext);
-			return i;
+		for (done = 0; done < n; done += k, cluster++) {
+			k = fs->fs_clustersize - blockOffset;
+			if (k > n - done)
+				k = n - done;
+			fat12fsCacheUpdate(fs, cluster,
+					(buffer != NULL) ? buffer + done : NULL,
+					blockOffset, k);
+			blockOffset = 0;
 		}
+
+		if (buffer != NULL)
+			buffer += n;
+		startpos += n;
+		nbytes -= n;
+		fileblk = startpos >> fs->fs_clustershift;
+		blockOffset = startpos & (fs->fs_clustersize - 1);
+		e++;
 	}
-	/* ??? */
-	return -1;
+	return 0;
 }
 
+
 /**
- * Use the fat12fsRawDiskRead() function to load a logical
- * data block into the provided buffer, remembering that
- * the first data block is numbered "2"
+ * Check that a mount may be written, and return the rootdir entry
+ * of a file which may be changed, or NULL
  */
-int
-fat12fsLoadDataBlock(
-	struct fat12fs *fs,
-	char *buffer,
-	int index)
+static fat12fs_DIRENTRY *
+fat12fsWritableEntry(struct fat12fs *fs, int dirEntryIndex)
 {
-	int blknum = fs->fs_datablock0 + index - 2; // Corrected block calculation
+	fat12fs_DIRENTRY *de;
 
-	return fat12fsRawDiskRead(fs->fs_fd, blknum, buffer);
+	if (!(fs->fs_flags & FAT12FS_MOUNT_WRITE)
+			|| fat12fsEnsureFat(fs) < 0
+			|| fat12fsEnsureRootdir(fs) < 0
+			|| dirEntryIndex < 0
+			|| dirEntryIndex >= fs->fs_rootdirsize)
+		return NULL;
+	de = &fs->fs_rootdirentry[dirEntryIndex];
+	if (de->de_attributes & (ATTR_READONLY | ATTR_VOLUME | ATTR_DIR))
+		return NULL;
+	return de;
 }
 
+
 /**
- * If the indicated dirEntry is a FILE, verify its integrity
- * by processing through the file-block list and ensuring
- * that the last FAT entry is marked EOF.  Ensure that the
- * number of bytes reported by the file matches this length
- * in file blocks.
+ * Write nbytes from buffer into an open file at startpos, without
+ * moving its cursor.  Writing past the end makes the file longer,
+ * with blocks taken contiguous-first, and a gap between the old end
+ * and startpos reads back as zeros.
  *
- * If everything is OK, return 1.
- * If the entry is a FILE, but it does not check out, return 0;
- * If the entry does not correspond to a FILE, or some other
- * problem is encountered, return -1
+ * The data goes straight to the image, one write per physically
+ * contiguous run; the FAT and the directory entry are only changed
+ * in memory, and are written out by fat12fsSync() or fat12fsUmount().
+ *
+ * Returns the number of bytes written, or (-1) on failure
  */
 int
-fat12fsVerifyEOF(
-	struct fat12fs *fs,
-	int dirEntryIndex)
+fat12fsPwrite(struct fat12fs_file *fh, const char *buffer, int nbytes,
+		int startpos)
 {
-	int bytesRemainInFile, bytesThisBlock;
-	short curblock;
+	struct fat12fs *fs = fh->fh_fs;
+	fat12fs_DIRENTRY *de;
+	unsigned int oldlen, end;
 
-	fat12fs_DIRENTRY entry = fs->fs_rootdirentry[dirEntryIndex];
-	curblock = fs->fs_rootdirentry[dirEntryIndex].de_fileblock0;
-	bytesRemainInFile = fs->fs_rootdirentry[dirEntryIndex].de_filelen;
+	de = fat12fsWritableEntry(fs, fh->fh_direntry);
+	if (de == NULL || startpos < 0 || nbytes < 0
+			|| nbytes > INT_MAX - startpos)
+		return (-1);
+	if (nbytes == 0)
+		return 0;
 
-	while (bytesRemainInFile > 0) {
+	oldlen = de->de_filelen;
+	end = (unsigned int) startpos + nbytes;
+	if (end > oldlen) {
+		if (fat12fsGrowChain(fs, fh->fh_direntry, end) < 0)
+			return (-1);
+		de->de_filelen = end;
+		fat12fsInvalidateExtents(fs, fh->fh_direntry);
+	}
+	fat12fsStampEntry(de, 0);
+	de->de_attributes |= ATTR_ARCHIVE;
+	fat12fsDirtyDirEntry(fs, fh->fh_direntry);
 
-		if (bytesRemainInFile < FS_BLKSIZE)
-			bytesThisBlock = bytesRemainInFile;
-		else
-			bytesThisBlock = FS_BLKSIZE;
+	if ((unsigned int) startpos > oldlen
+			&& fat12fsWriteRange(fs, fh->fh_direntry, NULL,
+				oldlen, startpos - oldlen) < 0)
+		return (-1);
+	if (fat12fsWriteRange(fs, fh->fh_direntry, buffer,
+			startpos, nbytes) < 0)
+		return (-1);
+
+	FS_COUNT(fs, st_filewrites, nbytes);
+	return nbytes;
+}
 
-		bytesRemainInFile -= FS_BLKSIZE;
 
-		if (bytesRemainInFile > 0) {
-			if (curblock >= FAT12_EOF1 && curblock <= FAT12_EOFF)
-			    return 0;
-			curblock = fat12fsGetFatEntry(fs, curblock);
-		}
+/**
+ * Write to an open file at its cursor, advancing the cursor by
+ * the number of bytes written
+ */
+int
+fat12fsWrite(struct fat12fs_file *fh, const char *buffer, int nbytes)
+{
+	int status;
+
+	status = fat12fsPwrite(fh, buffer, nbytes, fh->fh_pos);
+	if (status > 0)
+		fh->fh_pos += status;
+	return status;
+}
+
+
+/**
+ * Set the length of a file, freeing the blocks past a shorter end,
+ * or adding blocks which read as zeros up to a longer one
+ */
+int
+fat12fsTruncate(struct fat12fs *fs, const char *filename, int length)
+{
+	fat12fs_DIRENTRY *de;
+	unsigned int oldlen;
+	int dirEntryIndex;
+
+	if (!(fs->fs_flags & FAT12FS_MOUNT_WRITE) || length < 0)
+		return (-1);
+	dirEntryIndex = fat12fsSearchRootdir(fs, filename);
+	de = fat12fsWritableEntry(fs, dirEntryIndex);
+	if (de == NULL)
+		return (-1);
+
+	oldlen = de->de_filelen;
+	if ((unsigned int) length > oldlen) {
+		if (fat12fsGrowChain(fs, dirEntryIndex, length) < 0)
+			return (-1);
+	} else {
+		fat12fsShrinkChain(fs, dirEntryIndex, length);
 	}
+	de->de_filelen = length;
+	fat12fsInvalidateExtents(fs, dirEntryIndex);
+	fat12fsStampEntry(de, 0);
+	de->de_attributes |= ATTR_ARCHIVE;
+	fat12fsDirtyDirEntry(fs, dirEntryIndex);
 
-	curblock = fat12fsGetFatEntry(fs, curblock);
-	if ((curblock & FAT12_EOF1) == FAT12_EOF1) {
-		return 1;
+	if ((unsigned int) length > oldlen)
+		return fat12fsWriteRange(fs, dirEntryIndex, NULL,
+				oldlen, length - oldlen);
+	return 0;
+}
+
+
+/**
+ * Delete a file, freeing its chain.  As DOS does, the entry is only
+ * marked deleted, along with any long name pieces just before it.
+ */
+int
+fat12fsDelete(struct fat12fs *fs, const char *filename)
+{
+	fat12fs_DIRENTRY *de;
+	int dirEntryIndex, i;
+
+	if (!(fs->fs_flags & FAT12FS_MOUNT_WRITE))
+		return (-1);
+	dirEntryIndex = fat12fsSearchRootdir(fs, filename);
+	de = fat12fsWritableEntry(fs, dirEntryIndex);
+	if (de == NULL)
+		return (-1);
+
+	fat12fsFreeChain(fs, fat12fsFirstCluster(fs, de));
+	de->de_name[0] = NAME0_DELETED;
+	fat12fsDirtyDirEntry(fs, dirEntryIndex);
+	for (i = dirEntryIndex - 1; i >= 0
+			&& fs->fs_rootdirentry[i].de_attributes == ATTR_LONGNAME
+			&& fs->fs_rootdirentry[i].de_name[0] != NAME0_DELETED;
+			i--) {
+		fs->fs_rootdirentry[i].de_name[0] = NAME0_DELETED;
+		fat12fsDirtyDirEntry(fs, i);
 	}
 
-	return -1;
+	fat12fsInvalidateExtents(fs, dirEntryIndex);
+	fat12fsFillDirIndex(fs);
+	return 0;
 }
 
+
 /**
- * Read the specified data from the file, writing the output
- * to the given FILE pointer and returning the number of
- * bytes successfully read or (-1) on failure
- *
- * Notes:
- *    - use the fat12fsLoadDataBlock() function to load the blocks
- *	of data from the file
+ * Whether a normalized key is a name DOS would store: no control
+ * characters or the few DOS reserves, and no spaces inside a part
+ */
+static int
+fat12fsValidKey(const unsigned char *key)
+{
+	int i, space;
+
+	for (i = 0; i < FAT12FS_KEYLEN; i++) {
+		if (key[i] < 0x20 || key[i] == 0x7f
+				|| strchr("\"*+,/:;<=>?[\\]|", key[i]) != NULL)
+			return 0;
+	}
+	for (i = 0, space = 0; i < FAT12FS_KEYLEN; i++) {
+		if (i == 8)
+			space = 0;
+		if (key[i] == ' ')
+			space = 1;
+		else if (space)
+			return 0;
+	}
+	return 1;
+}
+
+
+/**
+ * Create an empty file in the first unused rootdir slot.  Returns
+ * its rootdir index, or (-1) if the name is not a valid 8.3 name, is
+ * already taken, or the rootdir is full.
  */
 int
-fat12fsReadData(
-	struct fat12fs *fs,
-	char *buffer,
-	const char *filename,
-	int startpos,
-	int nBytesToCopy)
+fat12fsCreate(struct fat12fs *fs, const char *filename)
 {
-	int bytesRemainInFile, bytesThisBlock;
-	short curblock;
+	unsigned char key[FAT12FS_KEYLEN];
+	fat12fs_DIRENTRY *de;
+	int i;
 
-	int bytesRead = 0;
+	if (!(fs->fs_flags & FAT12FS_MOUNT_WRITE)
+			|| fat12fsNameKey(filename, key) < 0
+			|| !fat12fsValidKey(key)
+			|| fat12fsEnsureFat(fs) < 0
+			|| fat12fsEnsureRootdir(fs) < 0
+			|| fat12fsLookupKey(fs, key) >= 0)
+		return (-1);
 
-	int dirEntryIndex = fat12fsSearchRootdir(fs, filename);
-	if (dirEntryIndex == -1) {
-		return -1;
+	for (i = 0; i < fs->fs_rootdirsize; i++) {
+		if (fs->fs_rootdirentry[i].de_name[0] == NAME0_EMPTY
+				|| fs->fs_rootdirentry[i].de_name[0]
+					== NAME0_DELETED)
+			break;
 	}
-	
-	curblock = fs->fs_rootdirentry[dirEntryIndex].de_fileblock0;
-	bytesRemainInFile = fs->fs_rootdirentry[dirEntryIndex].de_filelen;
-	int fileSize = fs->fs_rootdirentry[dirEntryIndex].de_filelen;
+	if (i == fs->fs_rootdirsize)
+		return (-1);
 
-	int initStartPos = startpos;
+	de = &fs->fs_rootdirentry[i];
+	memset(de, 0, sizeof(*de));
+	memcpy(de->de_name, key, 8);
+	memcpy(de->de_nameext, key + 8, 3);
+	if (de->de_name[0] == NAME0_DELETED)
+		de->de_name[0] = NAME0_E5;
+	de->de_attributes = ATTR_ARCHIVE;
+	fat12fsStampEntry(de, 1);
+	fat12fsDirtyDirEntry(fs, i);
 
-	int reading = 0;
+	fat12fsInvalidateExtents(fs, i);
+	fat12fsFillDirIndex(fs);
+	return i;
+}
 
-	while (bytesRemainInFile > 0) {
 
+/**
+ * The disk block holding rootdir sector "sector": the fixed rootdir
+ * of FAT-12 and FAT-16 is in order on the disk, while a FAT-32 one
+ * is found by walking its chain
+ */
+static int
+fat12fsDirSectorBlock(const struct fat12fs *fs, int sector)
+{
+	uint32_t cur = fs->fs_rootcluster;
+	int n;
 
-		if (bytesRemainInFile < FS_BLKSIZE)
-			bytesThisBlock = bytesRemainInFile;
-		else
-			bytesThisBlock = FS_BLKSIZE;
+	if (cur == 0)
+		return fs->fs_rootdirblock + sector;
+	for (n = sector / fs->fs_clustersectors; n > 0; n--)
+		cur = fs->fs_fattable[cur];
+	return fat12fsClusterBlock(fs, cur) + sector % fs->fs_clustersectors;
+}
 
-		if (startpos - FS_BLKSIZE < 0) {
-			// read the block and other blocks
-			reading = 1;
-		}
 
+/**
+ * Give the FS information sector of a FAT-32 volume the new count of
+ * free blocks, dropping its next-free hint, if it has one
+ */
+static int
+fat12fsSyncFsInfo(struct fat12fs *fs)
+{
+	unsigned char boot[FS_BLKSIZE], info[FS_BLKSIZE];
+	const struct fat12fs_BOOTBLOCK32 *bb32;
+	unsigned short fsinfo;
 
-		if (reading == 1 && bytesRead < nBytesToCopy && bytesRead < (fileSize - initStartPos)) {
-			char* temp = malloc(FS_BLKSIZE);
-			fat12fsLoadDataBlock(fs, temp, curblock);
+	if (blockDeviceRead(fs->fs_bdev, (char *) boot, FS_BLKSIZE, 0) < 0)
+		return (-1);
+	bb32 = (const struct fat12fs_BOOTBLOCK32 *)
+			((const fat12fs_BOOTBLOCK *) boot)->bb_extra;
+	bcopy((const char *) bb32->bb_fsinfo_sector, (char *) &fsinfo, 2);
+	if (fsinfo == 0 || fsinfo >= fs->fs_fatblock)
+		return 0;
 
-			for (int i = 0; i < bytesThisBlock; i++) {
-				if (bytesRead >= nBytesToCopy) {
-					break;
-				}
-				buffer[bytesRead] = temp[i];
-				bytesRead++;
-			}
-			free(temp);
-		}
+	if (blockDeviceRead(fs->fs_bdev, (char *) info, FS_BLKSIZE,
+			(off_t) fsinfo * FS_BLKSIZE) < 0)
+		return (-1);
+	if (memcmp(&info[0], "RRaA", 4) != 0
+			|| memcmp(&info[484], "rrAa", 4) != 0)
+		return 0;
+	fat12fsPutLong(&info[488], fs->fs_nfree);
+	fat12fsPutLong(&info[492], 0xffffffff);
+	FS_COUNT(fs, st_metawrites, 1);
+	return fat12fsPwriteFull(fs->fs_fd, &info[488], 8,
+			(off_t) fsinfo * FS_BLKSIZE + 488);
+}
 
-		bytesRemainInFile -= FS_BLKSIZE;
-		startpos -= FS_BLKSIZE;
 
-		
+/**
+ * Write out the FAT and rootdir sectors a write mount has changed.
+ * Each run of adjacent changed FAT sectors is written to every copy
+ * of the FAT with one write per copy, and each run of changed rootdir
+ * sectors which also lie together on the disk with one write, so
+ * however many blocks have been allocated only a handful of writes
+ * are made.  The image is then flushed to stable storage.
+ *
+ * Returns 0 (straight away for a mount which cannot write), or (-1)
+ * if anything could not be written; what was not stays marked, to be
+ * tried again.
+ */
+int
+fat12fsSync(struct fat12fs *fs)
+{
+	const char *dir = (const char *) fs->fs_rootdirentry;
+	unsigned int a, b, i;
+	int ndirblocks, blk;
+	int fatChanged = 0;
+	int status = 0;
+	int c, ok;
 
-		if (bytesRemainInFile > 0) {
-			if (curblock >= FAT12_EOF1 && curblock <= FAT12_EOFF)
-			    return bytesRead;
-			curblock = fat12fsGetFatEntry(fs, curblock);
+	if (!(fs->fs_flags & FAT12FS_MOUNT_WRITE))
+		return 0;
+
+	if (fs->fs_fatdirty != NULL) {
+		for (a = 0; a < fs->fs_fatsectors; a = b) {
+			if (!fat12fsIsMarked(fs->fs_fatdirty, a)) {
+				b = a + 1;
+				continue;
+			}
+			for (b = a + 1; b < fs->fs_fatsectors
+					&& fat12fsIsMarked(fs->fs_fatdirty, b); b++)
+				;
+
+			ok = 1;
+			for (c = 0; c < fs->fs_numfats; c++) {
+				if (fat12fsPwriteFull(fs->fs_fd,
+						fs->fs_fatdata
+						+ (size_t) a * FS_BLKSIZE,
+						(size_t) (b - a) * FS_BLKSIZE,
+						((off_t) fs->fs_fatblock
+						+ (off_t) c * fs->fs_fatsectors
+						+ a) * FS_BLKSIZE) < 0)
+					ok = 0;
+				FS_COUNT(fs, st_metawrites, 1);
+			}
+			if (!ok) {
+				status = (-1);
+				continue;
+			}
+			for (i = a; i < b; i++)
+				fat12fsUnmark(fs->fs_fatdirty, i);
+			fatChanged = 1;
 		}
 	}
-	return bytesRead;
-}
 
+	ndirblocks = fs->fs_rootdirsize / FAT_DIRPERBLK;
+	for (a = 0; a < (unsigned int) ndirblocks; a = b) {
+		if (!fat12fsIsMarked(fs->fs_dirdirty, a)) {
+			b = a + 1;
+			continue;
+		}
+		blk = fat12fsDirSectorBlock(fs, a);
+		for (b = a + 1; b < (unsigned int) ndirblocks
+				&& fat12fsIsMarked(fs->fs_dirdirty, b)
+				&& fat12fsDirSectorBlock(fs, b)
+					== blk + (int) (b - a); b++)
+			;
+
+		FS_COUNT(fs, st_metawrites, 1);
+		if (fat12fsPwriteFull(fs->fs_fd, dir + (size_t) a * FS_BLKSIZE,
+				(size_t) (b - a) * FS_BLKSIZE,
+				(off_t) blk * FS_BLKSIZE) < 0) {
+			status = (-1);
+			continue;
+		}
+		for (i = a; i < b; i++) {
+			fat12fsUnmark(fs->fs_dirdirty, i);
+			/** a FAT-32 rootdir was read through the cache */
+			if (fs->fs_rootcluster != 0)
+				fat12fsCacheUpdate(fs,
+					(int) ((blk + (i - a)
+						- fs->fs_datablock0)
+						/ fs->fs_clustersectors) + 2,
+					dir + (size_t) i * FS_BLKSIZE,
+					((blk + (i - a) - fs->fs_datablock0)
+						% fs->fs_clustersectors)
+						* FS_BLKSIZE,
+					FS_BLKSIZE);
+		}
+	}
 
+	if (fatChanged && fs->fs_rootcluster != 0
+			&& fat12fsSyncFsInfo(fs) < 0)
+		status = (-1);
+	if (fs->fs_freestale)
+		fat12fsFindFreeRun(fs);
+	if (fdatasync(fs->fs_fd) < 0)
+		status = (-1);
+	return status;
+}
@@ -1,10 +1,92 @@
 #ifndef	__DOS12_FILESYSTEM_HEADER__
 #define	__DOS12_FILESYSTEM_HEADER__
 
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
-/** define the number of bytes per block */
+#include "arena.h"
+
+
+/**
+ * define the number of bytes per block (sector); data is allocated
+ * in clusters of one or more of these, as the boot block says
+ */
 #define	FS_BLKSIZE	512
 
+/** the most sectors per cluster we accept, for 32kB clusters */
+#define	FS_MAXCLUSTERSECTORS	64
+
+/** flags selecting how a filesystem image is accessed at mount time */
+#define	FAT12FS_MOUNT_MAPPED	0x0001	/* mmap() the image read-only */
+#define	FAT12FS_MOUNT_CHECKFATS	0x0002	/* compare all copies of the FAT */
+#define	FAT12FS_MOUNT_URING	0x0004	/* queue reads through io_uring */
+#define	FAT12FS_MOUNT_LAZY	0x0008	/* load FAT and rootdir on first use */
+#define	FAT12FS_MOUNT_SIDECAR	0x0010	/* keep them in a sidecar index file */
+#define	FAT12FS_MOUNT_WRITE	0x0020	/* open read-write, to change files */
+
+/** what is added to an image's name to name its sidecar index */
+#define	FAT12FS_SIDECARSUFFIX	".idx"
+
+/** what has been loaded so far, as fs_loaded bits */
+#define	FAT12FS_LOADED_FAT	0x0001	/* FAT, its table and free map */
+#define	FAT12FS_LOADED_ROOTDIR	0x0002	/* rootdir and its name index */
+
+/**
+ * Statistics are counted unless this is defined to 0 (for instance
+ * with -DFAT12FS_STATS=0), in which case the counting compiles away
+ */
+#ifndef	FAT12FS_STATS
+#define	FAT12FS_STATS		1
+#endif
+
+/** default number of clusters held in the block cache */
+#define	FAT12FS_CACHEBLOCKS	64
+
+/**
+ * most shards the block cache is split into, and the fewest blocks
+ * a shard is left with
+ */
+#define	FAT12FS_CACHESHARDS	16
+#define	FAT12FS_SHARDMIN	8
+
+/**
+ * most clusters read ahead of a handle being read sequentially, and
+ * the window it starts with
+ */
+#define	FAT12FS_READAHEAD	64
+#define	FAT12FS_READAHEADMIN	4
+
+/** contiguous reads of this many clusters bypass the block cache */
+#define	FAT12FS_DIRECTMIN	2
+
+/** most sectors a root directory may take up */
+#define	FAT12FS_MAXDIRBLOCKS	256
+
+/**
+ * default number of subdirectory entries held in the dentry cache,
+ * and the fewest it is given, since open files pin theirs
+ */
+#define	FAT12FS_DENTRIES	1024
+#define	FAT12FS_DENTRIESMIN	16
+
+/**
+ * Options controlling a mount; fill in with fat12fsDefaultOptions()
+ * and adjust before calling fat12fsMountOpts()
+ */
+typedef struct fat12fs_options {
+	int mo_flags;		/* FAT12FS_MOUNT_xxx flags */
+	int mo_cacheblocks;	/* block cache capacity in clusters, 0 for none */
+	FILE *mo_logfp;		/* mount/unmount messages; NULL for stdout */
+	int mo_queuedepth;	/* reads kept in flight by a queued backend */
+	int mo_readahead;	/* most clusters to read ahead, 0 for none */
+	const char *mo_sidecar;	/* sidecar index; NULL for the image's name
+				   with FAT12FS_SIDECARSUFFIX added */
+	int mo_dentries;	/* dentry cache capacity, in entries */
+} fat12fs_options;
+
 
 
 
@@ -13,7 +95,8 @@
  * follows:
  * (The fields lowercase, ctime100thsec, ctime, cdate, adate, file_block0high
  *  were added for VFAT for Win95. For DOS, they were reserved and
- *  are not used by this program.)
+ *  are not used by this program, but for file_block0high, which holds
+ *  the top half of the first block on FAT-32.)
  */
 typedef struct fat12fs_DIRENTRY {
 	unsigned char	de_name[8];	/* File name */
@@ -32,28 +115,378 @@ typedef struct fat12fs_DIRENTRY {
 } fat12fs_DIRENTRY;
 
 
+/**
+ * One buffer in the block cache, holding a single data cluster
+ */
+typedef struct fat12fs_cachebuf {
+	int cb_blknum;		/* cluster held, or -1 if empty */
+	int cb_next;		/* next buffer on this hash chain, or -1 */
+	unsigned char cb_ref;	/* CLOCK reference bit */
+	char *cb_data;		/* fs_clustersize bytes of cluster data */
+} fat12fs_cachebuf;
+
+
+/**
+ * One shard of the block cache: a fixed set of buffers evicted in
+ * CLOCK order, found through a small chained hash on block number,
+ * all guarded by the shard's own lock.  Shards are kept a cache line
+ * apart so that threads using different ones do not share lines.
+ */
+typedef struct fat12fs_cacheshard {
+	pthread_mutex_t cs_lock;
+	int cs_nbufs;		/* buffers in this shard */
+	int cs_hand;		/* CLOCK hand */
+	int cs_hashmask;	/* cs_hash has cs_hashmask + 1 chains */
+	int *cs_hash;		/* chain heads, indexes into cs_bufs */
+	struct fat12fs_cachebuf *cs_bufs;
+	unsigned long cs_hits;	/* lookups satisfied from the shard */
+	unsigned long cs_misses; /* lookups which went to the disk */
+} __attribute__((aligned(64))) fat12fs_cacheshard;
+
+
+/**
+ * A fixed-size cache of data clusters, split into shards by cluster
+ * number so that threads reading different clusters rarely wait for
+ * each other
+ */
+typedef struct fat12fs_cache {
+	int bc_nbufs;		/* capacity in clusters, 0 if disabled */
+	int bc_bufsize;		/* bytes in each buffer */
+	int bc_nshards;		/* a power of two */
+	int bc_shardshift;	/* log2 of bc_nshards */
+	struct fat12fs_cacheshard *bc_shards;
+	char *bc_data;		/* storage for all buffers */
+} fat12fs_cache;
+
+
+/**
+ * A run of physically contiguous clusters within a file
+ */
+typedef struct fat12fs_extent {
+	unsigned int ex_fileblk;	/* cluster # within the file of the run */
+	unsigned int ex_start;		/* first data cluster of the run */
+	unsigned int ex_len;		/* number of clusters in the run */
+} fat12fs_extent;
+
+
+/**
+ * The whole chain of a file summarized as runs, in file order,
+ * built lazily from the FAT by fat12fsGetExtents()
+ */
+typedef struct fat12fs_extentmap {
+	int em_nextents;	/* number of runs in em_extents */
+	int em_nblocks;		/* number of clusters the chain covers */
+	struct fat12fs_extent em_extents[];
+} fat12fs_extentmap;
+
+
+/**
+ * Counts of the work done on a mounted filesystem, as returned by
+ * fat12fsGetStats()
+ */
+typedef struct fat12fs_stats {
+	unsigned long st_devreads;	/* reads asked of the block device */
+	unsigned long st_syscalls;	/* system calls issued for them */
+	unsigned long st_devbytes;	/* bytes read from the device */
+	unsigned long st_batches;	/* batches of reads issued together */
+	unsigned long st_cachehits;	/* block lookups found in the cache */
+	unsigned long st_cachemisses;	/* and those which were not */
+	unsigned long st_fatlookups;	/* fat12fsGetFatEntry() calls */
+	unsigned long st_dirsearches;	/* rootdir name lookups */
+	unsigned long st_dirprobes;	/* hash slots looked at by them */
+	unsigned long st_filebytes;	/* file data handed to callers */
+	unsigned long st_prefetches;	/* readahead hints given */
+	unsigned long st_prefetchbytes;	/* bytes they covered */
+	unsigned long st_filewrites;	/* bytes of file data written */
+	unsigned long st_datawrites;	/* device writes of file data */
+	unsigned long st_metawrites;	/* and of FAT and directory sectors */
+	unsigned long st_dentryhits;	/* subdirectory lookups from memory */
+	unsigned long st_dentrymisses;	/* and those which read the directory */
+} fat12fs_stats;
+
+
+/**
+ * How a volume's data blocks are used, from fat12fsGetSpaceInfo()
+ */
+typedef struct fat12fs_spaceinfo {
+	int si_nblocks;		/* data blocks in the volume */
+	int si_free;		/* of which are free */
+	int si_used;		/* and in use (or marked bad) */
+	int si_largestfree;	/* longest run of free blocks */
+	int si_largeststart;	/* first block of that run, or -1 */
+} fat12fs_spaceinfo;
+
+
+/** problems fat12fsCheck() can find with an entry, as ce_flags bits */
+#define	FAT12FS_CHECK_BADSTART	0x0001	/* first block is not a data block */
+#define	FAT12FS_CHECK_BADCHAIN	0x0002	/* chain links to a non-data block */
+#define	FAT12FS_CHECK_CYCLE	0x0004	/* chain loops back on itself */
+#define	FAT12FS_CHECK_LENGTH	0x0008	/* chain length disagrees with size */
+#define	FAT12FS_CHECK_CROSSLINK	0x0010	/* block also used by another entry */
+
+/** most threads fat12fsCheck() will use when left to choose */
+#define	FAT12FS_CHECKTHREADS	8
+
+/** deepest directory below the root fat12fsCheck() will look into */
+#define	FAT12FS_CHECKDEPTH	32
+
+/**
+ * The result of checking the chain of one directory entry, in the
+ * root directory or in a directory below it
+ */
+typedef struct fat12fs_checkentry {
+	int ce_direntry;	/* slot of the entry in its directory */
+	int ce_parent;		/* report entry of that directory, or -1 */
+	int ce_flags;		/* FAT12FS_CHECK_xxx problems found */
+	int ce_nblocks;		/* distinct blocks in the chain */
+	int ce_endblock;	/* block with the bad link, or where a cycle starts */
+	int ce_crossblock;	/* first block shared with another entry */
+	int ce_other;		/* report entry sharing ce_crossblock */
+	fat12fs_DIRENTRY ce_entry;	/* the entry as it was checked */
+} fat12fs_checkentry;
+
+
+/**
+ * The result of a whole-volume fat12fsCheck()
+ */
+typedef struct fat12fs_checkreport {
+	int cr_nentries;	/* entries checked */
+	int cr_nproblems;	/* entries with any problem */
+	int cr_norphans;	/* allocated blocks used by no entry */
+	unsigned int *cr_orphans;	/* those blocks, in order */
+	struct fat12fs_checkentry *cr_entries;
+} fat12fs_checkreport;
+
+
+/** most threads fat12fsExportAll() will use when left to choose */
+#define	FAT12FS_EXPORTTHREADS	8
+
+/**
+ * The totals of a whole-directory fat12fsExportAll()
+ */
+typedef struct fat12fs_exportreport {
+	int xr_nfiles;		/* files written out whole */
+	int xr_nfailed;		/* files which could not be */
+	unsigned long xr_nbytes;	/* bytes written, in all */
+} fat12fs_exportreport;
+
+
+/** length of a normalized "NAME    EXT" directory key */
+#define	FAT12FS_KEYLEN	11
+
+/** room for a "NAME.EXT" host file name and its terminator */
+#define	FAT12FS_HOSTNAMELEN	(FAT12FS_KEYLEN + 2)
+
+/** most threads fat12fsHashAll() will use when left to choose */
+#define	FAT12FS_HASHTHREADS	8
+
+/**
+ * The checksum of one file, from fat12fsHashAll()
+ */
+typedef struct fat12fs_hashentry {
+	int he_direntry;	/* rootdir index of the file */
+	int he_nbytes;		/* bytes hashed, or (-1) if it could not be */
+	uint32_t he_crc;	/* their CRC-32C */
+	char he_name[FAT12FS_HOSTNAMELEN];	/* as "NAME.EXT" */
+} fat12fs_hashentry;
+
+/**
+ * The checksums of every file in the root directory, in rootdir order
+ */
+typedef struct fat12fs_hashreport {
+	int hr_nentries;	/* files hashed */
+	int hr_nfailed;		/* of which could not be read */
+	struct fat12fs_hashentry *hr_entries;
+} fat12fs_hashreport;
+
+/**
+ * How the chain of one file lies on the disk, from fat12fsFragReport()
+ */
+typedef struct fat12fs_fragentry {
+	int fe_direntry;	/* rootdir index of the file */
+	int fe_nblocks;		/* blocks in its chain */
+	int fe_nruns;		/* physically contiguous runs they make */
+	int fe_nreads;		/* device reads to read it whole, cold */
+	char fe_name[FAT12FS_HOSTNAMELEN];	/* as "NAME.EXT" */
+} fat12fs_fragentry;
+
+/**
+ * The fragmentation of every file in the root directory, in rootdir
+ * order, and of the volume as a whole
+ */
+typedef struct fat12fs_fragreport {
+	int fr_nentries;	/* files measured */
+	int fr_nfragmented;	/* of which are in more than one run */
+	unsigned long fr_nblocks;	/* blocks in all of their chains */
+	unsigned long fr_nruns;		/* and runs */
+	unsigned long fr_nreads;	/* device reads to read every file */
+	unsigned long fr_minreads;	/* the same, were each contiguous */
+	int fr_nfreeruns;	/* runs the free blocks are in */
+	struct fat12fs_fragentry *fr_entries;
+} fat12fs_fragreport;
+
+/**
+ * One slot of the root directory hash: the normalized 8.3 key of a
+ * file and the rootdir index holding it, or dh_slot -1 if unused
+ */
+typedef struct fat12fs_dirhash {
+	short dh_slot;
+	unsigned char dh_key[FAT12FS_KEYLEN];
+} fat12fs_dirhash;
+
+
+/**
+ * Open-addressed (linear probe) hash over the files and directories
+ * in the rootdir
+ */
+typedef struct fat12fs_dirindex {
+	int di_mask;		/* number of slots - 1 */
+	struct fat12fs_dirhash *di_hash;
+} fat12fs_dirindex;
+
+
+/**
+ * One entry of the dentry cache: a name looked up (or read along
+ * with one) in a subdirectory, and the directory entry it has there.
+ * A name the directory does not have is kept too, with de_name[0]
+ * NAME0_EMPTY, so asking again costs nothing either.
+ */
+typedef struct fat12fs_dentry {
+	uint32_t dn_parent;	/* first cluster of the directory, 0 if unused */
+	unsigned char dn_key[FAT12FS_KEYLEN];
+	unsigned char dn_ref;	/* CLOCK reference bit */
+	int dn_pins;		/* open handles on the file */
+	int dn_next;		/* next dentry on this hash chain, or -1 */
+	struct fat12fs_DIRENTRY dn_entry;
+	struct fat12fs_extentmap *dn_extents; /* as fs_extents, for the file */
+} fat12fs_dentry;
+
+
+/**
+ * A fixed-size cache of subdirectory entries, found through a chained
+ * hash on parent cluster and name and evicted in CLOCK order, but for
+ * those pinned by an open file.  A directory is read (through the
+ * block cache) into dc_buf one cluster at a time, under dc_lock.
+ */
+typedef struct fat12fs_dcache {
+	pthread_mutex_t dc_lock;
+	int dc_nentries;	/* capacity */
+	int dc_hand;		/* CLOCK hand */
+	int dc_mask;		/* dc_buckets has dc_mask + 1 chains */
+	int *dc_buckets;	/* chain heads, indexes into dc_dentries */
+	struct fat12fs_dentry *dc_dentries;
+	char *dc_buf;		/* one cluster of directory being read */
+	unsigned long dc_hits;	/* lookups answered from the cache */
+	unsigned long dc_misses; /* and those which read the directory */
+} fat12fs_dcache;
+
+
+struct blockDevice;
+
+/**
+ * A mounted filesystem.  Once mounted (and once a lazy mount has
+ * loaded what it needs) nothing here changes but the block cache,
+ * the dentry cache, the extent maps and the counters, all of which
+ * are safe to share, so any number of threads may read through one
+ * mount, each with its own handles.  The calls which change a
+ * FAT12FS_MOUNT_WRITE mount are the exception: they must have the
+ * mount to themselves.
+ */
 typedef struct fat12fs  {
 	/* file desc to access the device */
 	int fs_fd;
 
+	/** what all reads of fs_fd go through */
+	struct blockDevice *fs_bdev;
+
+	int fs_flags;		/* FAT12FS_MOUNT_xxx flags mounted with */
+	int fs_loaded;		/* FAT12FS_LOADED_xxx parts in memory */
+	pthread_mutex_t fs_loadlock;	/* held while loading them */
+	int fs_readahead;	/* most blocks a handle reads ahead */
+
+	/** where mount and unmount messages are printed */
+	FILE *fs_logfp;
+
+	/** read-only mapping of the whole image, if mounted mapped */
+	const unsigned char *fs_map;
+	size_t fs_mapsize;
+
+	/** private mapping of the sidecar index, if the mount used one */
+	unsigned char *fs_sidecar;
+	size_t fs_sidecarsize;
+
+	/** holds the structure itself and everything loaded with it */
+	struct arena fs_arena;
+
+	/** managed buffers for recently used blocks */
+	struct fat12fs_cache fs_cache;
+
 	/** data copied or calculated from boot block info */
 	unsigned short fs_fatblock;	/* location of first FAT block */
-	unsigned short fs_rootdirblock;	/* location of first DIR block */
-	unsigned short fs_datablock0;	/* location of "data block 0" */
-	unsigned short fs_fatsize;	/* number of entries in FAT table */
-	unsigned short fs_fatsectors;	/* number of sectors of FAT info */
+	unsigned int fs_rootdirblock;	/* location of first DIR block */
+	unsigned int fs_datablock0;	/* location of "data block 0" */
+	unsigned short fs_clustersectors; /* sectors in each cluster */
+	unsigned char fs_clustershift;	/* log2 of fs_clustersize */
+	unsigned int fs_clustersize;	/* bytes in each cluster */
+	unsigned char fs_fatbits;	/* 12, 16 or 32 bits per FAT entry */
+	unsigned int fs_fateof;		/* first entry value meaning EOF */
+	unsigned int fs_fatmask;	/* bits of an entry which are used */
+	int fs_fatsize;			/* number of entries in FAT table */
+	unsigned int fs_fatsectors;	/* number of sectors of FAT info */
 	unsigned short fs_rootdirsize;	/* number of entries in rootdir */
+	unsigned int fs_rootcluster;	/* FAT-32 rootdir chain, else 0 */
 	unsigned char fs_numfats;	/* number of copies of FAT table */
-	unsigned int fs_fssize;	/* number of data blocks in fs */
+	unsigned int fs_fssize;	/* number of data clusters in fs, + 2 */
 
 	/** working space */
 	unsigned char *fs_fatdata;	/* in-memory array of FAT values */ 
+	uint32_t *fs_fattable;		/* FAT unpacked, one entry per slot */
+	int fs_fatmismatch;	/* entries differing between FAT copies */
+	uint64_t *fs_freemap;	/* bit set for each free data block */
+	int fs_nfree;		/* number of free data blocks */
+	int fs_freerun;		/* longest run of free blocks */
+	int fs_freerunstart;	/* first block of that run, or -1 */
 	fat12fs_DIRENTRY *fs_rootdirentry; /* in-memory rootdir image */
 	//^^^ this is an array, direntry is not a file.
+	struct fat12fs_extentmap **fs_extents; /* per-rootdir-slot maps */
+	struct fat12fs_dirindex fs_dirindex;	/* rootdir name lookup */
+	struct fat12fs_dcache fs_dcache;	/* and subdirectory lookup */
+
+	/**
+	 * changes made by a write mount, held in fs_fatdata and the
+	 * rootdir until fat12fsSync() writes the sectors marked here
+	 */
+	uint64_t *fs_fatdirty;	/* bit set for each changed FAT sector */
+	uint64_t fs_dirdirty[FAT12FS_MAXDIRBLOCKS / 64]; /* and rootdir sector */
+	int fs_freestale;	/* fs_freerun needs finding again */
+
+	/** counters kept here; the device and cache keep their own */
+	struct fat12fs_stats fs_stats;
 } fat12fs;
 
 
+/**
+ * An open file: the resolved directory entry, plus a cursor holding
+ * the current byte position and the extent it was last found in, and
+ * the state of its readahead
+ */
+typedef struct fat12fs_file {
+	struct fat12fs *fh_fs;
+	int fh_direntry;	/* rootdir index of the file, or past the
+				   rootdir, its dentry cache slot */
+	int fh_pos;		/* byte position of the cursor */
+	int fh_extent;		/* extent the last read finished in */
+	int fh_nextpos;		/* where a sequential read would start */
+	int fh_rawindow;	/* current readahead window, in blocks */
+	int fh_raend;		/* file block readahead has reached */
+} fat12fs_file;
+
+
 struct fat12fs *fat12fsMount(const char *filename);
+struct fat12fs *fat12fsMountMapped(const char *filename);
+void fat12fsDefaultOptions(struct fat12fs_options *opts);
+struct fat12fs *fat12fsMountOpts(const char *filename,
+		const struct fat12fs_options *opts);
 int fat12fsUmount(struct fat12fs *fs);
 int fat12fsDumpFat(FILE *ofp, struct fat12fs *fs);
 int fat12fsDumpRootdir(FILE *ofp, struct fat12fs *fs);
@@ -61,8 +494,56 @@ int fat12fsDumpRootdir(FILE *ofp, struct fat12fs *fs);
 int fat12fsReadData(struct fat12fs *fs,
 		char *buffer,
 		const char *filename, int startpos, int nbytes);
+int fat12fsReadDataMapped(struct fat12fs *fs,
+		const char *filename, int startpos, int nbytes,
+		struct iovec *iov, int *iovcnt);
+const char *fat12fsMapDataBlock(struct fat12fs *fs, int index);
+int fat12fsLoadDataBlock(struct fat12fs *fs, char *buffer, int index);
+struct fat12fs_file *fat12fsOpen(struct fat12fs *fs, const char *filename);
+int fat12fsOpenHandle(struct fat12fs *fs, const char *filename,
+		struct fat12fs_file *fh);
+int fat12fsRead(struct fat12fs_file *fh, char *buffer, int nbytes);
+int fat12fsPread(struct fat12fs_file *fh, char *buffer, int nbytes,
+		int startpos);
+int fat12fsSeek(struct fat12fs_file *fh, int offset, int whence);
+int fat12fsFileLength(struct fat12fs_file *fh);
+int fat12fsClose(struct fat12fs_file *fh);
+void fat12fsCloseHandle(struct fat12fs_file *fh);
+int fat12fsExport(struct fat12fs *fs, const char *filename, int outfd);
+int fat12fsExportAll(struct fat12fs *fs, const char *hostdir, int nThreads,
+		struct fat12fs_exportreport *report);
+int fat12fsHashFile(struct fat12fs *fs, const char *filename, uint32_t *crc);
+int fat12fsHashAll(struct fat12fs *fs, int nThreads,
+		struct fat12fs_hashreport *report);
+void fat12fsFreeHashReport(struct fat12fs_hashreport *report);
 int fat12fsFindFile(struct fat12fs *fs, const char *filename);
+int fat12fsSearchRootdir(struct fat12fs *fs, const char *filename);
 int fat12fsVerifyEOF(struct fat12fs *fs, int dirEntry);
+unsigned int fat12fsGetFatEntry(struct fat12fs *fs, int index);
+int fat12fsGetSpaceInfo(struct fat12fs *fs, struct fat12fs_spaceinfo *si);
+size_t fat12fsMemoryUsage(struct fat12fs *fs);
+int fat12fsGetStats(struct fat12fs *fs, struct fat12fs_stats *st);
+void fat12fsResetStats(struct fat12fs *fs);
+int fat12fsBlockIsFree(struct fat12fs *fs, int index);
+struct fat12fs_extentmap *fat12fsGetExtents(struct fat12fs *fs,
+		int dirEntry);
+void fat12fsInvalidateExtents(struct fat12fs *fs, int dirEntry);
+int fat12fsCheck(struct fat12fs *fs, int nThreads,
+		struct fat12fs_checkreport *report);
+int fat12fsDumpCheck(FILE *ofp, struct fat12fs *fs,
+		const struct fat12fs_checkreport *report);
+void fat12fsFreeCheckReport(struct fat12fs_checkreport *report);
+int fat12fsFragReport(struct fat12fs *fs, struct fat12fs_fragreport *report);
+int fat12fsDumpFrag(FILE *ofp, const struct fat12fs_fragreport *report);
+void fat12fsFreeFragReport(struct fat12fs_fragreport *report);
+int fat12fsRepack(struct fat12fs *fs, const char *path);
+int fat12fsCreate(struct fat12fs *fs, const char *filename);
+int fat12fsWrite(struct fat12fs_file *fh, const char *buffer, int nbytes);
+int fat12fsPwrite(struct fat12fs_file *fh, const char *buffer, int nbytes,
+		int startpos);
+int fat12fsTruncate(struct fat12fs *fs, const char *filename, int length);
+int fat12fsDelete(struct fat12fs *fs, const char *filename);
+int fat12fsSync(struct fat12fs *fs);
 
 
 #endif /* __DOS12_FILESYSTEM_HEADER__ */
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "lathist.h"
+
+
+/**
+ * Find the bucket a value falls in: values below LATHIST_SUBCOUNT
+ * have a bucket each, and above that the leading LATHIST_SUBBITS
+ * bits after the top one pick the bucket within its power of two
+ */
+static int
+latHistBucket(unsigned long long value)
+{
+	int top, shift;
+
+	if (value < LATHIST_SUBCOUNT)
+		return (int) value;
+
+	top = 63 - __builtin_clzll(value);
+	shift = top - LATHIST_SUBBITS;
+	return (shift + 1) * LATHIST_SUBCOUNT
+			+ (int) ((value >> shift) - LATHIST_SUBCOUNT);
+}
+
+/**
+ * The largest value which falls in the given bucket
+ */
+static unsigned long long
+latHistBucketValue(int bucket)
+{
+	int shift;
+
+	if (bucket < LATHIST_SUBCOUNT)
+		return (unsigned long long) bucket;
+
+	shift = bucket / LATHIST_SUBCOUNT - 1;
+	return (((unsigned long long) LATHIST_SUBCOUNT
+			+ bucket % LATHIST_SUBCOUNT + 1) << shift) - 1;
+}
+
+
+void
+latHistInit(struct latHist *lh)
+{
+	memset(lh, 0, sizeof(struct latHist));
+}
+
+void
+latHistRecord(struct latHist *lh, unsigned long long value)
+{
+	if (lh->lh_count == 0 || value < lh->lh_min)
+		lh->lh_min = value;
+	if (value > lh->lh_max)
+		lh->lh_max = value;
+	lh->lh_count++;
+	lh->lh_sum += (double) value;
+	lh->lh_buckets[latHistBucket(value)]++;
+}
+
+/**
+ * Return the value below which pct percent of the recorded values
+ * fall, to the precision of the buckets (but never beyond the
+ * largest value actually seen)
+ */
+unsigned long long
+latHistPercentile(const struct latHist *lh, double pct)
+{
+	unsigned long target, seen = 0;
+	unsigned long long value;
+	int i;
+
+	if (lh->lh_count == 0)
+		return 0;
+
+	target = (unsigned long) (pct / 100.0 * lh->lh_count + 0.5);
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < LATHIST_NBUCKETS; i++) {
+		seen += lh->lh_buckets[i];
+		if (seen >= target)
+			break;
+	}
+	value = latHistBucketValue(i);
+	return (value > lh->lh_max) ? lh->lh_max : value;
+}
+
+void
+latHistPrintHeader(FILE *ofp)
+{
+	fprintf(ofp, "  %-6s %8s %10s %10s %10s %10s %10s %10s\n",
+		"cmd", "count", "mean us", "p50 us", "p90 us",
+		"p99 us", "p99.9 us", "max us");
+}
+
+/**
+ * Print one histogram as a line of summary figures, in microseconds
+ * (the values recorded are taken to be nanoseconds)
+ */
+void
+latHistPrint(FILE *ofp, const char *label, const struct latHist *lh)
+{
+	if (lh->lh_count == 0)
+		return;
+
+	fprintf(ofp, "  %-6s %8lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		label, lh->lh_count,
+		lh->lh_sum / lh->lh_count / 1e3,
+		latHistPercentile(lh, 50) / 1e3,
+		latHistPercentile(lh, 90) / 1e3,
+		latHistPercentile(lh, 99) / 1e3,
+		latHistPercentile(lh, 99.9) / 1e3,
+		lh->lh_max / 1e3);
+}
@@ -0,0 +1,30 @@
+#ifndef	__LATHIST_HEADER__
+#define	__LATHIST_HEADER__
+
+#include <stdio.h>
+
+/**
+ * A log-linear latency histogram in the style of HdrHistogram: each
+ * power of two is split into LATHIST_SUBCOUNT equal buckets, so any
+ * value is recorded to within 1 / LATHIST_SUBCOUNT of itself, from
+ * nanoseconds to hours, in a fixed amount of space.
+ */
+#define	LATHIST_SUBBITS		4
+#define	LATHIST_SUBCOUNT	(1 << LATHIST_SUBBITS)
+#define	LATHIST_NBUCKETS	((64 - LATHIST_SUBBITS + 1) * LATHIST_SUBCOUNT)
+
+typedef struct latHist {
+	unsigned long lh_count;
+	unsigned long long lh_min;
+	unsigned long long lh_max;
+	double lh_sum;
+	unsigned long lh_buckets[LATHIST_NBUCKETS];
+} latHist;
+
+void latHistInit(struct latHist *lh);
+void latHistRecord(struct latHist *lh, unsigned long long value);
+unsigned long long latHistPercentile(const struct latHist *lh, double pct);
+void latHistPrintHeader(FILE *ofp);
+void latHistPrint(FILE *ofp, const char *label, const struct latHist *lh);
+
+#endif /* __LATHIST_HEADER__ */
@@ -1,80 +1,453 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "fat12fs.h"
 #include "commands.h"
+#include "server.h"
+
+
+/**
+ * One image named on the command line, along with the settings that
+ * were in effect where it appeared, and (when run by the worker pool)
+ * the output it produced
+ */
+typedef struct imageJob {
+	const char *ij_image;		/* image file to mount */
+	const char *ij_script;		/* command file, or NULL for stdin */
+	struct fat12fs_options ij_opts;
+	struct commandConfig ij_cfg;
+
+	char *ij_out;			/* captured stdout of the job */
+	size_t ij_outlen;
+	char *ij_err;			/* captured stderr of the job */
+	size_t ij_errlen;
+	int ij_status;			/* 0 if it mounted and ran */
+	int ij_done;			/* set once the job has finished */
+} imageJob;
+
+
+/**
+ * The work shared by the pool: jobs are handed out in order, and the
+ * main thread prints each one's output once it (and every job before
+ * it) has finished, so output order does not depend on timing
+ */
+typedef struct jobPool {
+	struct imageJob *jp_jobs;
+	int jp_njobs;
+	int jp_next;			/* next job to hand out */
+	const char *jp_script;		/* stdin, read once and shared */
+	size_t jp_scriptlen;
+	pthread_mutex_t jp_lock;
+	pthread_cond_t jp_finished;
+} jobPool;
+
+
+static void
+printSummary(FILE *ofp, struct fat12fs *fs)
+{
+	struct fat12fs_spaceinfo si;
+	unsigned long long nbytes;
+
+	nbytes = (unsigned long long) fs->fs_fssize * fs->fs_clustersize;
+	fprintf(ofp, "Filesystem data:\n");
+	fprintf(ofp, "   size (bytes): 0x%06llx (%llu) %llukB\n",
+			nbytes, nbytes, nbytes / 1024);
+	fprintf(ofp, "  size (blocks):   0x%04x (%d)\n",
+			fs->fs_fssize, fs->fs_fssize);
+	if (fs->fs_fatbits != 12)
+		fprintf(ofp, "      FAT width:   %d bits\n", fs->fs_fatbits);
+	if (fs->fs_clustersectors > 1)
+		fprintf(ofp, "   cluster size:   0x%04x (%d) bytes\n",
+				fs->fs_clustersize, fs->fs_clustersize);
+	fprintf(ofp, "    FAT sectors:   0x%04x (%d)\n",
+			fs->fs_fatsectors, fs->fs_fatsectors);
+	fprintf(ofp, "     Rootdir at:   0x%04x (%d)\n",
+			fs->fs_rootdirblock,
+			fs->fs_rootdirblock);
+	fprintf(ofp, " Datablock 0 at:   0x%04x (%d)\n",
+			fs->fs_datablock0,
+			fs->fs_datablock0);
+
+	/** a lazy mount has no FAT to count yet, and need not load one */
+	if ((fs->fs_loaded & FAT12FS_LOADED_FAT)
+			&& fat12fsGetSpaceInfo(fs, &si) == 0) {
+		fprintf(ofp, "    Free blocks:   0x%04x (%d) %dkB\n",
+				si.si_free, si.si_free,
+				(int) (((unsigned long long) si.si_free
+					* fs->fs_clustersize) / 1024));
+		fprintf(ofp, "   Largest free:   0x%04x (%d) at %d\n",
+				si.si_largestfree, si.si_largestfree,
+				si.si_largeststart);
+	}
+	fprintf(ofp, "\n");
+}
+
+
+/**
+ * Mount one image, run the commands from ifp against it, and unmount
+ * it again, with all output going to ofp and efp
+ */
+static int
+runImage(struct imageJob *job, FILE *ifp, FILE *ofp, FILE *efp)
+{
+	struct fat12fs_options opts = job->ij_opts;
+	struct commandConfig cfg = job->ij_cfg;
+	fat12fs *fs;
+
+	opts.mo_logfp = ofp;
+	cfg.cc_errfp = efp;
+	cfg.cc_traceName = job->ij_image;
+
+	fs = fat12fsMountOpts(job->ij_image, &opts);
+	if (fs == NULL) {
+		fprintf(efp,
+			"Cannot mount filesystem in"
+			" '%s'\n", job->ij_image);
+		return (1);
+	}
+
+	printSummary(ofp, fs);
+	processCommandsConfig(ifp, ofp, fs, &cfg);
+
+	fat12fsUmount(fs);
+	return 0;
+}
+
+
+/**
+ * Read all of a stream into memory, so it can be replayed for
+ * every image
+ */
+static char *
+readAll(FILE *ifp, size_t *len)
+{
+	char *data = NULL, *grown;
+	size_t size = 0, n;
+
+	*len = 0;
+	do {
+		if (*len == size) {
+			size = (size == 0) ? 4096 : size * 2;
+			grown = (char *) realloc(data, size);
+			if (grown == NULL) {
+				free(data);
+				return NULL;
+			}
+			data = grown;
+		}
+		n = fread(data + *len, 1, size - *len, ifp);
+		*len += n;
+	} while (n > 0);
+
+	return data;
+}
+
+
+/**
+ * A pool worker: take the next job, run it with its output captured
+ * in memory, and mark it finished
+ */
+static void *
+poolWorker(void *arg)
+{
+	struct jobPool *pool = (struct jobPool *) arg;
+	struct imageJob *job;
+	FILE *ifp, *ofp, *efp;
+	int status;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->jp_lock);
+		if (pool->jp_next >= pool->jp_njobs) {
+			pthread_mutex_unlock(&pool->jp_lock);
+			break;
+		}
+		job = &pool->jp_jobs[pool->jp_next++];
+		pthread_mutex_unlock(&pool->jp_lock);
+
+		ofp = open_memstream(&job->ij_out, &job->ij_outlen);
+		efp = open_memstream(&job->ij_err, &job->ij_errlen);
+		if (job->ij_script != NULL) {
+			ifp = fopen(job->ij_script, "r");
+		} else if (pool->jp_scriptlen > 0) {
+			ifp = fmemopen((void *) pool->jp_script,
+					pool->jp_scriptlen, "r");
+		} else {
+			ifp = fopen("/dev/null", "r");
+		}
+
+		if (ofp == NULL || efp == NULL || ifp == NULL) {
+			if (efp != NULL)
+				fprintf(efp, "Cannot set up a run of '%s'\n",
+					job->ij_image);
+			status = 1;
+		} else {
+			status = runImage(job, ifp, ofp, efp);
+		}
+
+		if (ifp != NULL)
+			fclose(ifp);
+		if (ofp != NULL)
+			fclose(ofp);
+		if (efp != NULL)
+			fclose(efp);
+
+		pthread_mutex_lock(&pool->jp_lock);
+		job->ij_status = status;
+		job->ij_done = 1;
+		pthread_cond_broadcast(&pool->jp_finished);
+		pthread_mutex_unlock(&pool->jp_lock);
+	}
+	return NULL;
+}
+
+
+/**
+ * Run all the jobs on nThreads workers, printing the output of each
+ * in command line order as soon as it is available
+ */
+static int
+runPool(struct imageJob *jobs, int njobs, int nThreads)
+{
+	struct jobPool pool;
+	pthread_t *threads;
+	int failed = 0;
+	int useStdin = 0;
+	int i;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.jp_jobs = jobs;
+	pool.jp_njobs = njobs;
+	pthread_mutex_init(&pool.jp_lock, NULL);
+	pthread_cond_init(&pool.jp_finished, NULL);
+
+	/** every image without its own script runs all of stdin */
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].ij_script == NULL)
+			useStdin = 1;
+	}
+	if (useStdin) {
+		pool.jp_script = readAll(stdin, &pool.jp_scriptlen);
+		if (pool.jp_script == NULL) {
+			fprintf(stderr, "Cannot read commands from stdin\n");
+			return (1);
+		}
+	}
+
+	if (nThreads > njobs)
+		nThreads = njobs;
+	threads = (nThreads > 0)
+			? (pthread_t *) malloc(nThreads * sizeof(pthread_t)) : NULL;
+	for (i = 0; threads != NULL && i < nThreads; i++) {
+		if (pthread_create(&threads[i], NULL, poolWorker, &pool) != 0)
+			break;
+	}
+	nThreads = i;
+	if (nThreads == 0) {
+		/** no threads (or no room for them) to be had; do the work here */
+		poolWorker(&pool);
+	}
+
+	for (i = 0; i < njobs; i++) {
+		pthread_mutex_lock(&pool.jp_lock);
+		while (!jobs[i].ij_done)
+			pthread_cond_wait(&pool.jp_finished, &pool.jp_lock);
+		pthread_mutex_unlock(&pool.jp_lock);
+
+		fflush(stdout);
+		fwrite(jobs[i].ij_err, 1, jobs[i].ij_errlen, stderr);
+		fwrite(jobs[i].ij_out, 1, jobs[i].ij_outlen, stdout);
+		fflush(stdout);
+		free(jobs[i].ij_out);
+		free(jobs[i].ij_err);
+		if (jobs[i].ij_status != 0)
+			failed = 1;
+	}
+
+	for (i = 0; i < nThreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	free((void *) pool.jp_script);
+	pthread_mutex_destroy(&pool.jp_lock);
+	pthread_cond_destroy(&pool.jp_finished);
+
+	return failed;
+}
+
+
+/**
+ * Serve all the images to clients over a socket rather than running
+ * commands once against each, until the server is stopped
+ */
+static int
+runServer(struct imageJob *jobs, int njobs, const struct serverConfig *sc)
+{
+	struct serverImage *images;
+	int status;
+	int i;
+
+	images = (struct serverImage *) calloc(njobs,
+			sizeof(struct serverImage));
+	if (images == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return (1);
+	}
+	for (i = 0; i < njobs; i++) {
+		images[i].si_image = jobs[i].ij_image;
+		images[i].si_opts = jobs[i].ij_opts;
+		images[i].si_cfg = jobs[i].ij_cfg;
+	}
+
+	status = serverRun(sc, images, njobs);
+	free(images);
+	return (status < 0) ? 1 : 0;
+}
+
 
 int
 main(int argc, char **argv)
 {
-	fat12fs *fs;
-	int didSomething = 0;
+	struct imageJob *jobs;
+	int njobs = 0;
+	int nThreads = 0;
 	int base = 16;
+	const char *script = NULL;
+	struct fat12fs_options opts;
+	struct commandConfig cfg;
+	struct serverConfig sc;
+	FILE *ifp, *tracefp = NULL;
+	int status;
 	int i;
 
+	fat12fsDefaultOptions(&opts);
+	defaultCommandConfig(&cfg);
+	defaultServerConfig(&sc);
+
+	jobs = (struct imageJob *) calloc(argc, sizeof(struct imageJob));
+	if (jobs == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return (1);
+	}
+
+	/**
+	 * options apply to the images which follow them, so gather up
+	 * the images with the settings in effect for each
+	 */
 	for (i = 1; i < argc; i++) {
 		if (argv[i][0] == '-') {
-			if (argv[i][0] == 'x') {
+			if (argv[i][1] == 'x') {
 				base = 16;
-			} else if (argv[i][0] == 'd') {
+			} else if (argv[i][1] == 'd') {
 				base = 10;
+			} else if (argv[i][1] == 'm') {
+				opts.mo_flags |= FAT12FS_MOUNT_MAPPED;
+			} else if (argv[i][1] == 'F') {
+				opts.mo_flags |= FAT12FS_MOUNT_CHECKFATS;
+			} else if (argv[i][1] == 'L') {
+				opts.mo_flags |= FAT12FS_MOUNT_LAZY;
+			} else if (argv[i][1] == 'I') {
+				opts.mo_flags |= FAT12FS_MOUNT_SIDECAR;
+			} else if (argv[i][1] == 'U') {
+				opts.mo_flags |= FAT12FS_MOUNT_URING;
+			} else if (argv[i][1] == 'w') {
+				opts.mo_flags |= FAT12FS_MOUNT_WRITE;
+			} else if (argv[i][1] == 'Q' && i + 1 < argc) {
+				opts.mo_queuedepth = atoi(argv[++i]);
+			} else if (argv[i][1] == 'C' && i + 1 < argc) {
+				opts.mo_cacheblocks = atoi(argv[++i]);
+			} else if (argv[i][1] == 'R' && i + 1 < argc) {
+				opts.mo_readahead = atoi(argv[++i]);
+			} else if (argv[i][1] == 'D' && i + 1 < argc) {
+				opts.mo_dentries = atoi(argv[++i]);
+			} else if (argv[i][1] == 'B' && i + 1 < argc) {
+				cfg.cc_chunkSize = atoi(argv[++i]);
+			} else if (argv[i][1] == 'c' && i + 1 < argc) {
+				script = argv[++i];
+			} else if (argv[i][1] == 'j' && i + 1 < argc) {
+				nThreads = atoi(argv[++i]);
+			} else if (argv[i][1] == 'S' && i + 1 < argc) {
+				sc.sc_listen = argv[++i];
+			} else if (argv[i][1] == 'M' && i + 1 < argc) {
+				/** memory cap on the server's mounts, in MB */
+				sc.sc_memcap = (size_t) atol(argv[++i])
+						* 1024 * 1024;
+			} else if (argv[i][1] == 'H') {
+				cfg.cc_histograms = 1;
+			} else if (argv[i][1] == 'T' && i + 1 < argc) {
+				/** one trace stream, shared by every image */
+				i++;
+				if (strcmp(argv[i], "-") == 0) {
+					cfg.cc_tracefp = stderr;
+				} else if (tracefp == NULL) {
+					tracefp = fopen(argv[i], "w");
+					if (tracefp == NULL) {
+						fprintf(stderr, "Cannot open trace"
+							" file '%s'\n", argv[i]);
+						return (1);
+					}
+					cfg.cc_tracefp = tracefp;
+				}
 			} else {
 				fprintf(stderr, "Unknown option '%s'\n",
 					argv[i]);
 				return (-1);
 			}
 		} else {
-			fs = fat12fsMount(argv[i]);
-			if (fs == NULL) {
-				fprintf(stderr,
-					"Cannot mount filesystem in"
-					" '%s'\n", argv[i]);
-				return (1);
-			}
-
-			printf("Filesystem data:\n");
-			printf("   size (bytes): 0x%06x (%d) %dkB\n",
-					fs->fs_fssize * FS_BLKSIZE,
-					fs->fs_fssize * FS_BLKSIZE,
-					(fs->fs_fssize * FS_BLKSIZE) / 1024);
-			printf("  size (blocks):   0x%04x (%d)\n",
-					fs->fs_fssize, fs->fs_fssize);
-			printf("    FAT sectors:   0x%04x (%d)\n",
-					fs->fs_fatsectors, fs->fs_fatsectors);
-			printf("     Rootdir at:   0x%04x (%d)\n",
-					fs->fs_rootdirblock,
-					fs->fs_rootdirblock);
-			printf(" Datablock 0 at:   0x%04x (%d)\n",
-					fs->fs_datablock0,
-					fs->fs_datablock0);
-			printf("\n");
-
-			//FILE* file = fopen("fat12fs_dump_fat.txt", "w");
-			//fat12fsDumpFat(file, fs);
-			// char buffer[512];
-			// fat12fsLoadDataBlock(fs, buffer, 3);
-			// for (int i = 0; i < 512; i++) {
-			// 	printf("%c", buffer[i]);
-			// }
-			//printf("%d\n", fat12fsSearchRootdir(fs, "LETTERS.txt"));
-			//fat12fsDumpRootdir(stdout, fs);
-			// char buffer[8280];
-			// fat12fsReadData(fs, buffer, "JABBER.txt", 0, 8280);
-			// for (int i = 0; i < 8280; i++) {
-			// 	printf("%c", buffer[i]);
-			// }
-			//fclose(file);
-			processCommands(stdin, stdout, fs, base);
-
-			fat12fsUmount(fs);
-
-			didSomething = 1;
+			jobs[njobs].ij_image = argv[i];
+			jobs[njobs].ij_script = script;
+			jobs[njobs].ij_opts = opts;
+			jobs[njobs].ij_cfg = cfg;
+			jobs[njobs].ij_cfg.cc_displayBase = base;
+			njobs++;
 		}
 	}
 
-	if (didSomething == 0) {
+	if (njobs == 0) {
 		fprintf(stderr, "No filesystem given\n");
 		return (1);
 	}
 
+	if (sc.sc_listen != NULL) {
+		status = runServer(jobs, njobs, &sc);
+		free(jobs);
+		if (tracefp != NULL)
+			fclose(tracefp);
+		return status;
+	}
+
+	if (nThreads > 0) {
+		status = runPool(jobs, njobs, nThreads);
+		free(jobs);
+		if (tracefp != NULL)
+			fclose(tracefp);
+		return status;
+	}
+
+	/**
+	 * without a pool, images are run one after another and share
+	 * stdin, each reading commands up to its own "q"
+	 */
+	for (i = 0; i < njobs; i++) {
+		ifp = stdin;
+		if (jobs[i].ij_script != NULL) {
+			ifp = fopen(jobs[i].ij_script, "r");
+			if (ifp == NULL) {
+				fprintf(stderr, "Cannot open script '%s'\n",
+					jobs[i].ij_script);
+				return (1);
+			}
+		}
+
+		status = runImage(&jobs[i], ifp, stdout, stderr);
+		if (ifp != stdin)
+			fclose(ifp);
+		if (status != 0)
+			return (status);
+	}
+
+	free(jobs);
+	if (tracefp != NULL)
+		fclose(tracefp);
 	return 0;
 }
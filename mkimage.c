@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * A utility to build synthetic FAT images for benchmarking: a
+ * floppy-style layout (1 reserved sector, 2 FATs, 224 root entries,
+ * 512 byte sectors, and clusters of one sector unless asked for
+ * more) holding a chosen number of files, with sizes drawn from a
+ * range and clusters scattered to a chosen degree.
+ *
+ * FAT-16 images are laid out the same way, with wider entries.  A
+ * FAT-32 image has 32 reserved sectors instead, and its root
+ * directory is a chain of clusters starting at cluster 2.  Which
+ * width an image is depends only on its number of clusters, so each
+ * width needs an image size to suit it.
+ *
+ * Every file is named "Fnnnn.BIN" and filled with bytes from a
+ * seeded generator, so that the same arguments always give the
+ * same image.
+ */
+
+#define	BLKSIZE		512
+#define	ROOTENTRIES	224
+#define	DIRENTSIZE	32
+#define	FAT32RESERVED	32
+
+static unsigned int randState;
+
+/** xorshift32; small, fast and the same everywhere */
+static unsigned int
+nextRandom(void)
+{
+	randState ^= randState << 13;
+	randState ^= randState >> 17;
+	randState ^= randState << 5;
+	return randState;
+}
+
+static void
+putShort(unsigned char *p, unsigned int val)
+{
+	p[0] = val & 0xff;
+	p[1] = (val >> 8) & 0xff;
+}
+
+static void
+putLong(unsigned char *p, unsigned int val)
+{
+	putShort(p, val & 0xffff);
+	putShort(p + 2, val >> 16);
+}
+
+/** store an entry of the given width into a packed FAT */
+static void
+putFatEntry(unsigned char *fat, int fatBits, int index, unsigned int val)
+{
+	unsigned char *p = &fat[(index * 3) / 2];
+
+	if (fatBits == 16) {
+		putShort(&fat[index * 2], val);
+	} else if (fatBits == 32) {
+		putLong(&fat[index * 4], val & 0x0fffffff);
+	} else if (index & 0x1) {
+		p[0] = (p[0] & 0x0f) | ((val & 0x0f) << 4);
+		p[1] = (val >> 4) & 0xff;
+	} else {
+		p[0] = val & 0xff;
+		p[1] = (p[1] & 0xf0) | ((val >> 8) & 0x0f);
+	}
+}
+
+/**
+ * Pick the next cluster for a file: usually the first free one after
+ * the previous cluster, but with a probability of fragPct percent a
+ * free cluster somewhere at random
+ */
+static int
+pickCluster(const unsigned char *used, int nclusters, int prev, int fragPct)
+{
+	int c, n;
+
+	if (prev < 2 || (int) (nextRandom() % 100) < fragPct)
+		c = 2 + (int) (nextRandom() % nclusters);
+	else
+		c = prev + 1;
+
+	for (n = 0; n < nclusters; n++, c++) {
+		if (c >= nclusters + 2)
+			c = 2;
+		if (!used[c])
+			return c;
+	}
+	return (-1);
+}
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage:\n");
+	fprintf(stderr, "  %s [options] imagefile\n", progname);
+	fprintf(stderr, "    -n <files>    number of files (default 100)\n");
+	fprintf(stderr, "    -s <min:max>  file size range in bytes"
+			" (default 0:20000)\n");
+	fprintf(stderr, "    -f <percent>  chance of a cluster being placed"
+			" at random (default 0)\n");
+	fprintf(stderr, "    -t <sectors>  image size (default 2880)\n");
+	fprintf(stderr, "    -c <sectors>  sectors per cluster, a power"
+			" of two (default 1)\n");
+	fprintf(stderr, "    -F <bits>     FAT width, 12, 16 or 32"
+			" (default 12)\n");
+	fprintf(stderr, "    -S <seed>     random seed (default 1)\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned char *image, *fat, *root, *used;
+	unsigned char *de, *data;
+	const char *outname = NULL;
+	int nfiles = 100, minSize = 0, maxSize = 20000;
+	int fragPct = 0, totalSectors = 2880, clusterSectors = 1;
+	int fatBits = 12, seed = 1;
+	int reserved, minClusters, maxClusters;
+	int fatSectors, rootSectors, dataStart, nclusters;
+	int rootClusters, eof;
+	int size, cur, prev, first, written, n;
+	int f, i, fd;
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] != '-') {
+			outname = argv[i];
+		} else if (i + 1 >= argc) {
+			usage(argv[0]);
+			return (-1);
+		} else if (argv[i][1] == 'n') {
+			nfiles = atoi(argv[++i]);
+		} else if (argv[i][1] == 's') {
+			if (sscanf(argv[++i], "%d:%d", &minSize, &maxSize) != 2
+					|| minSize < 0 || maxSize < minSize) {
+				fprintf(stderr, "Cannot parse size range '%s'\n",
+					argv[i]);
+				return (-1);
+			}
+		} else if (argv[i][1] == 'f') {
+			fragPct = atoi(argv[++i]);
+		} else if (argv[i][1] == 't') {
+			totalSectors = atoi(argv[++i]);
+		} else if (argv[i][1] == 'c') {
+			clusterSectors = atoi(argv[++i]);
+		} else if (argv[i][1] == 'F') {
+			fatBits = atoi(argv[++i]);
+		} else if (argv[i][1] == 'S') {
+			seed = atoi(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return (-1);
+		}
+	}
+	if (outname == NULL || nfiles < 0 || nfiles > ROOTENTRIES
+			|| clusterSectors < 1 || clusterSectors > 128
+			|| (clusterSectors & (clusterSectors - 1)) != 0
+			|| (fatBits != 12 && fatBits != 16 && fatBits != 32)) {
+		usage(argv[0]);
+		return (-1);
+	}
+	randState = (seed != 0) ? (unsigned int) seed : 1;
+
+	/** the range of cluster counts which makes each width */
+	reserved = 1;
+	rootSectors = (ROOTENTRIES * DIRENTSIZE) / BLKSIZE;
+	if (fatBits == 12) {
+		minClusters = 1;
+		maxClusters = 4084;
+		eof = 0xfff;
+	} else if (fatBits == 16) {
+		minClusters = 4085;
+		maxClusters = 65524;
+		eof = 0xffff;
+	} else {
+		minClusters = 65525;
+		maxClusters = 0x0ffffff5;
+		eof = 0x0fffffff;
+		reserved = FAT32RESERVED;
+		rootSectors = 0;
+	}
+
+	/**
+	 * size the FAT for the clusters that remain after it: grow it a
+	 * sector at a time until it can describe them all
+	 */
+	for (fatSectors = 1; ; fatSectors++) {
+		dataStart = reserved + 2 * fatSectors + rootSectors;
+		nclusters = (totalSectors - dataStart) / clusterSectors;
+		if ((((long) nclusters + 2) * fatBits + 7) / 8
+				<= (long) fatSectors * BLKSIZE)
+			break;
+	}
+	if (nclusters < minClusters || nclusters > maxClusters) {
+		fprintf(stderr, "%d sectors do not make a FAT-%d image\n",
+			totalSectors, fatBits);
+		return (-1);
+	}
+
+	image = (unsigned char *) calloc(totalSectors, BLKSIZE);
+	used = (unsigned char *) calloc(nclusters + 2, 1);
+	if (image == NULL || used == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return (-1);
+	}
+	fat = &image[reserved * BLKSIZE];
+	root = &image[(reserved + 2 * fatSectors) * BLKSIZE];
+
+	/** the boot block */
+	image[0] = 0xeb;
+	image[1] = 0x3c;
+	image[2] = 0x90;
+	memcpy(&image[3], "MKIMAGE ", 8);
+	putShort(&image[11], BLKSIZE);
+	image[13] = clusterSectors;		/* sectors per cluster */
+	putShort(&image[14], reserved);		/* reserved sectors */
+	image[16] = 2;				/* number of FATs */
+	image[21] = 0xf0;			/* media type */
+	putShort(&image[24], 18);		/* sectors per track */
+	putShort(&image[26], 2);		/* heads */
+	if (totalSectors < 0x10000)
+		putShort(&image[19], totalSectors);
+	else
+		putLong(&image[32], totalSectors);
+	if (fatBits == 32) {
+		putLong(&image[36], fatSectors);
+		putLong(&image[44], 2);		/* root directory cluster */
+		putShort(&image[48], 1);	/* FS information sector */
+		putShort(&image[50], 6);	/* backup boot sector */
+	} else {
+		putShort(&image[17], ROOTENTRIES);
+		putShort(&image[22], fatSectors);
+	}
+	image[510] = 0x55;
+	image[511] = 0xaa;
+
+	putFatEntry(fat, fatBits, 0, eof & ~0xf);
+	putFatEntry(fat, fatBits, 1, eof);
+
+	/**
+	 * a FAT-32 root directory takes the first clusters, chained in
+	 * order, and the files are placed after it
+	 */
+	if (fatBits == 32) {
+		rootClusters = (ROOTENTRIES * DIRENTSIZE
+				+ clusterSectors * BLKSIZE - 1)
+				/ (clusterSectors * BLKSIZE);
+		for (i = 0; i < rootClusters; i++) {
+			used[2 + i] = 1;
+			putFatEntry(fat, fatBits, 2 + i,
+				(i + 1 < rootClusters) ? 3 + i : eof);
+		}
+		root = &image[dataStart * BLKSIZE];
+	}
+
+	for (f = 0; f < nfiles; f++) {
+		size = minSize;
+		if (maxSize > minSize)
+			size += (int) (nextRandom() % (maxSize - minSize + 1));
+
+		first = 0;
+		prev = 0;
+		for (written = 0; written < size; written += n) {
+			cur = pickCluster(used, nclusters, prev, fragPct);
+			if (cur < 0) {
+				fprintf(stderr, "Image full after %d files\n", f);
+				return (-1);
+			}
+			used[cur] = 1;
+			if (prev == 0)
+				first = cur;
+			else
+				putFatEntry(fat, fatBits, prev, cur);
+			prev = cur;
+
+			data = &image[(size_t) (dataStart
+					+ (cur - 2) * clusterSectors) * BLKSIZE];
+			n = size - written;
+			if (n > BLKSIZE * clusterSectors)
+				n = BLKSIZE * clusterSectors;
+			for (i = 0; i < n; i++)
+				data[i] = (unsigned char) nextRandom();
+		}
+		if (prev != 0)
+			putFatEntry(fat, fatBits, prev, eof);
+
+		de = &root[f * DIRENTSIZE];
+		n = snprintf((char *) de, 9, "F%04d", f);
+		memset(de + n, ' ', 8 - n);
+		memcpy(de + 8, "BIN", 3);
+		de[11] = 0x20;				/* archive */
+		putShort(de + 20, first >> 16);
+		putShort(de + 26, first);
+		putLong(de + 28, size);
+	}
+
+	/** and the second copy of the FAT */
+	memcpy(fat + fatSectors * BLKSIZE, fat, fatSectors * BLKSIZE);
+
+	fd = open(outname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr,
+			"Cannot open file '%s' for output : %s\n",
+			outname, strerror(errno));
+		return (-1);
+	}
+	if (write(fd, image, (size_t) totalSectors * BLKSIZE)
+			!= (ssize_t) totalSectors * BLKSIZE) {
+		fprintf(stderr,
+			"Failed writing to file : %s\n",
+			strerror(errno));
+		return (-1);
+	}
+	(void) close(fd);
+
+	free(image);
+	free(used);
+	return 0;
+}
@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+
+#include "outbuf.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+
+/** longest single item any of the Put routines adds at once */
+#define	OB_MAXITEM	32
+
+static const char hexDigits[] = "0123456789abcdef";
+
+/**
+ * Bytes printed as themselves by the escaped dump: those isprint()
+ * accepts in the C locale, plus newline.  Everything else is
+ * printed as a backslash and an octal number.
+ */
+static const unsigned char printable[256] = {
+	['\n'] = 1,
+	[0x20 ... 0x7e] = 1
+};
+
+
+/**
+ * Set up a buffer of the given size, allocated here
+ */
+int
+outBufferInit(struct outBuffer *ob, FILE *fp, size_t size)
+{
+	if (size < OB_MAXITEM)
+		size = OB_MAXITEM;
+
+	ob->ob_fp = fp;
+	ob->ob_len = 0;
+	ob->ob_size = size;
+	ob->ob_owned = 1;
+	ob->ob_data = (char *) malloc(size);
+	return (ob->ob_data == NULL) ? -1 : 0;
+}
+
+/**
+ * Set up a buffer over storage the caller provides (such as an array
+ * on the stack), which must be at least OB_MAXITEM bytes
+ */
+void
+outBufferInitStatic(struct outBuffer *ob, FILE *fp, char *data, size_t size)
+{
+	ob->ob_fp = fp;
+	ob->ob_len = 0;
+	ob->ob_size = size;
+	ob->ob_owned = 0;
+	ob->ob_data = data;
+}
+
+/**
+ * Hand everything gathered so far to stdio in a single fwrite()
+ */
+int
+outBufferFlush(struct outBuffer *ob)
+{
+	size_t n;
+
+	if (ob->ob_len == 0)
+		return 0;
+
+	n = fwrite(ob->ob_data, 1, ob->ob_len, ob->ob_fp);
+	ob->ob_len = 0;
+	return (n == 0) ? -1 : 0;
+}
+
+/**
+ * Flush, and release the buffer if we allocated it
+ */
+void
+outBufferFree(struct outBuffer *ob)
+{
+	outBufferFlush(ob);
+	if (ob->ob_owned)
+		free(ob->ob_data);
+	ob->ob_data = NULL;
+	ob->ob_size = 0;
+}
+
+/**
+ * Make sure there is room for n more bytes, flushing if not
+ */
+static inline char *
+outBufferReserve(struct outBuffer *ob, size_t n)
+{
+	if (ob->ob_len + n > ob->ob_size)
+		outBufferFlush(ob);
+	return &ob->ob_data[ob->ob_len];
+}
+
+void
+outBufferPut(struct outBuffer *ob, const char *data, size_t n)
+{
+	size_t room;
+
+	while (n > 0) {
+		room = ob->ob_size - ob->ob_len;
+		if (room == 0) {
+			outBufferFlush(ob);
+			room = ob->ob_size;
+		}
+		if (room > n)
+			room = n;
+		memcpy(&ob->ob_data[ob->ob_len], data, room);
+		ob->ob_len += room;
+		data += room;
+		n -= room;
+	}
+}
+
+void
+outBufferPuts(struct outBuffer *ob, const char *str)
+{
+	outBufferPut(ob, str, strlen(str));
+}
+
+void
+outBufferPrintf(struct outBuffer *ob, const char *fmt, ...)
+{
+	char line[256];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+
+	if (n < 0)
+		return;
+	if ((size_t) n >= sizeof(line)) {
+		/** too long for the line buffer, so let stdio have it */
+		outBufferFlush(ob);
+		va_start(ap, fmt);
+		vfprintf(ob->ob_fp, fmt, ap);
+		va_end(ap);
+		return;
+	}
+	outBufferPut(ob, line, n);
+}
+
+/**
+ * Add an unsigned number, zero padded to at least "digits" digits,
+ * as printf("%.*u") or printf("%.*x") would
+ */
+static void
+outBufferPutNumber(struct outBuffer *ob, unsigned int val, int digits,
+		unsigned int base)
+{
+	char tmp[OB_MAXITEM];
+	char *p, *dst;
+	int n;
+
+	if (digits > OB_MAXITEM - 2)
+		digits = OB_MAXITEM - 2;
+
+	p = &tmp[sizeof(tmp)];
+	n = 0;
+	while (val != 0 || n < digits) {
+		*--p = hexDigits[val % base];
+		val /= base;
+		n++;
+	}
+
+	dst = outBufferReserve(ob, n);
+	memcpy(dst, p, n);
+	ob->ob_len += n;
+}
+
+void
+outBufferPutDec(struct outBuffer *ob, unsigned int val, int digits)
+{
+	outBufferPutNumber(ob, val, digits, 10);
+}
+
+void
+outBufferPutHex(struct outBuffer *ob, unsigned int val, int digits)
+{
+	outBufferPutNumber(ob, val, digits, 16);
+}
+
+/**
+ * Add the escape for one unprintable byte, exactly as
+ * fprintf(ofp, "\\%03o", (char) byte) has always printed it --
+ * which, where char is signed, means bytes of 0x80 and up are sign
+ * extended and come out as eleven octal digits
+ */
+static inline void
+outBufferPutEscape(struct outBuffer *ob, unsigned char c)
+{
+	char *dst = outBufferReserve(ob, 12);
+	int n = 0;
+
+	dst[n++] = '\\';
+#if CHAR_MIN < 0
+	if (c & 0x80) {
+		memcpy(&dst[n], "37777777", 8);
+		n += 8;
+		dst[n++] = '0' + (4 | (c >> 6));
+	} else
+#endif
+	{
+		dst[n++] = '0' + (c >> 6);
+	}
+	dst[n++] = '0' + ((c >> 3) & 7);
+	dst[n++] = '0' + (c & 7);
+	ob->ob_len += n;
+}
+
+/**
+ * Return a bitmask with bit i set if data[i] is printable, for the
+ * 16 bytes at data, using whatever vector unit we have
+ */
+#if defined(__SSE2__)
+static inline unsigned int
+printableMask16(const char *data)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *) data);
+	__m128i ok;
+
+	/** signed compares: 0x80 and up are negative, so fail > 0x1f */
+	ok = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1f)),
+			_mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+	ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+	return (unsigned int) _mm_movemask_epi8(ok);
+}
+#define	HAVE_PRINTABLEMASK16
+#elif defined(__aarch64__)
+static inline unsigned int
+printableMask16(const char *data)
+{
+	static const uint8_t bitval[16] = {
+		1, 2, 4, 8, 16, 32, 64, 128,
+		1, 2, 4, 8, 16, 32, 64, 128
+	};
+	uint8x16_t v = vld1q_u8((const uint8_t *) data);
+	uint8x16_t ok;
+	uint8x16_t bits;
+
+	ok = vandq_u8(vcgtq_u8(v, vdupq_n_u8(0x1f)),
+			vcltq_u8(v, vdupq_n_u8(0x7f)));
+	ok = vorrq_u8(ok, vceqq_u8(v, vdupq_n_u8('\n')));
+	bits = vandq_u8(ok, vld1q_u8(bitval));
+	return (unsigned int) vaddv_u8(vget_low_u8(bits))
+		| ((unsigned int) vaddv_u8(vget_high_u8(bits)) << 8);
+}
+#define	HAVE_PRINTABLEMASK16
+#endif
+
+/**
+ * Add a run of raw file data, with printable bytes copied as they
+ * are and all others escaped.  Sixteen bytes are classified at a
+ * time, and fully printable stretches are copied in bulk.
+ */
+void
+outBufferPutEscaped(struct outBuffer *ob, const char *data, size_t n)
+{
+	size_t i = 0;
+	size_t run;
+	char *dst;
+
+#ifdef HAVE_PRINTABLEMASK16
+	unsigned int mask;
+
+	while (i + 16 <= n) {
+		mask = printableMask16(&data[i]);
+		if (mask == 0xffff) {
+			dst = outBufferReserve(ob, 16);
+			memcpy(dst, &data[i], 16);
+			ob->ob_len += 16;
+			i += 16;
+			continue;
+		}
+
+		/** copy the printable prefix, then escape the first misfit */
+		run = (size_t) __builtin_ctz(~mask);
+		if (run > 0) {
+			dst = outBufferReserve(ob, run);
+			memcpy(dst, &data[i], run);
+			ob->ob_len += run;
+			i += run;
+		}
+		outBufferPutEscape(ob, (unsigned char) data[i]);
+		i++;
+	}
+#endif
+
+	while (i < n) {
+		for (run = 0; i + run < n
+				&& printable[(unsigned char) data[i + run]];
+				run++)
+			;
+		if (run > 0) {
+			outBufferPut(ob, &data[i], run);
+			i += run;
+		}
+		if (i < n) {
+			outBufferPutEscape(ob, (unsigned char) data[i]);
+			i++;
+		}
+	}
+}
@@ -0,0 +1,38 @@
+#ifndef	__OUTBUF_HEADER__
+#define	__OUTBUF_HEADER__
+
+#include <stdio.h>
+#include <stddef.h>
+
+/**
+ * A buffer that formatted output is gathered into, so that it can
+ * be handed to stdio with one fwrite() per buffer-full rather than
+ * with a call per byte or per number.
+ *
+ * Anything else written to ob_fp must be preceded by an
+ * outBufferFlush(), or the output will come out of order.
+ */
+typedef struct outBuffer {
+	FILE *ob_fp;		/* where flushed output goes */
+	char *ob_data;		/* the buffer itself */
+	size_t ob_len;		/* bytes waiting in ob_data */
+	size_t ob_size;		/* capacity of ob_data */
+	int ob_owned;		/* ob_data was malloc'ed by us */
+} outBuffer;
+
+int outBufferInit(struct outBuffer *ob, FILE *fp, size_t size);
+void outBufferInitStatic(struct outBuffer *ob, FILE *fp,
+		char *data, size_t size);
+int outBufferFlush(struct outBuffer *ob);
+void outBufferFree(struct outBuffer *ob);
+
+void outBufferPut(struct outBuffer *ob, const char *data, size_t n);
+void outBufferPuts(struct outBuffer *ob, const char *str);
+void outBufferPrintf(struct outBuffer *ob, const char *fmt, ...)
+		__attribute__((format(printf, 2, 3)));
+void outBufferPutDec(struct outBuffer *ob, unsigned int val, int digits);
+void outBufferPutHex(struct outBuffer *ob, unsigned int val, int digits);
+void outBufferPutEscaped(struct outBuffer *ob,
+		const char *data, size_t n);
+
+#endif /* __OUTBUF_HEADER__ */
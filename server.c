@@ -0,0 +1,699 @@
+#define	_GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "server.h"
+
+/**
+ * A server keeping a pool of images mounted, and running the usual
+ * command protocol for any number of clients over a Unix or TCP
+ * socket.  Everything is driven from one epoll loop: a client's
+ * commands are run a line at a time as they arrive, each through
+ * the client's own command session, with what they print queued
+ * until the client takes it.
+ *
+ * A client's commands run against the first image served unless it
+ * picks another with "o <image>"; "q" ends its session and closes
+ * the connection.  Mounts stay resident once made, so that later
+ * clients find their FAT, rootdir, index and cache already loaded,
+ * and are only unmounted (least recently used first) once no
+ * session is using them and their total size is over the cap.
+ */
+
+#define	SERVER_NEVENTS		64
+#define	SERVER_BACKLOG		64
+
+/**
+ * One connected client: the bytes it has sent which do not yet make
+ * up a whole line, the output waiting for it to take, and the
+ * session its commands run in, once it has an image
+ */
+typedef struct serverClient {
+	int cl_fd;
+	struct serverImage *cl_image;	/* image of the session, or NULL */
+	struct commandSession cl_session;
+	char cl_in[SERVER_LINELEN];	/* input not yet run */
+	size_t cl_inlen;
+	char *cl_out;			/* output not yet sent */
+	size_t cl_outlen;		/* bytes in cl_out */
+	size_t cl_outoff;		/* of which have been sent */
+	int cl_eof;			/* the client has sent all it will */
+	int cl_closing;			/* close once cl_out is sent */
+	unsigned int cl_events;		/* epoll events asked for */
+	struct serverClient *cl_next;	/* all clients, in a list */
+	struct serverClient *cl_prev;
+} serverClient;
+
+/**
+ * The state of a running server
+ */
+typedef struct server {
+	const struct serverConfig *sv_cfg;
+	FILE *sv_logfp;
+	struct serverImage *sv_images;
+	int sv_nimages;
+	int sv_listenfd;
+	int sv_epollfd;
+	int sv_unixsocket;		/* sc_listen names a socket to remove */
+	struct serverClient *sv_clients;
+	int sv_nclients;
+	unsigned long sv_tick;		/* commands run, to age the mounts */
+} server;
+
+static volatile sig_atomic_t serverStopping;
+
+
+static void
+serverSignal(int sig)
+{
+	(void) sig;
+	serverStopping = 1;
+}
+
+
+void
+defaultServerConfig(struct serverConfig *sc)
+{
+	sc->sc_listen = NULL;
+	sc->sc_memcap = 0;
+	sc->sc_maxclients = SERVER_MAXCLIENTS;
+	sc->sc_logfp = NULL;
+}
+
+
+/**
+ * Open the listening socket: "host:port" (with an empty host for
+ * loopback only) is TCP, and anything else names a Unix socket,
+ * replacing any socket left there by an earlier server
+ */
+static int
+serverListen(struct server *sv, const char *spec)
+{
+	struct addrinfo hints, *ai, *aip;
+	struct sockaddr_un sun;
+	struct stat sb;
+	char host[256];
+	const char *colon;
+	int one = 1;
+	int fd = -1;
+	int status;
+
+	colon = strrchr(spec, ':');
+	if (colon != NULL && strchr(spec, '/') == NULL) {
+		if ((size_t) (colon - spec) >= sizeof(host)) {
+			fprintf(sv->sv_logfp, "Host name in '%s' is too long\n",
+				spec);
+			return (-1);
+		}
+		memcpy(host, spec, colon - spec);
+		host[colon - spec] = '\0';
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		/** with no host given, listen on loopback only */
+		status = getaddrinfo((host[0] != '\0') ? host : "127.0.0.1",
+				colon + 1, &hints, &ai);
+		if (status != 0) {
+			fprintf(sv->sv_logfp, "Cannot resolve '%s' : %s\n",
+				spec, gai_strerror(status));
+			return (-1);
+		}
+		for (aip = ai; aip != NULL; aip = aip->ai_next) {
+			fd = socket(aip->ai_family, aip->ai_socktype
+					| SOCK_NONBLOCK | SOCK_CLOEXEC,
+					aip->ai_protocol);
+			if (fd < 0)
+				continue;
+			(void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+					&one, sizeof(one));
+			if (bind(fd, aip->ai_addr, aip->ai_addrlen) == 0)
+				break;
+			(void) close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(ai);
+
+	} else {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(spec) >= sizeof(sun.sun_path)) {
+			fprintf(sv->sv_logfp, "Socket path '%s' is too long\n",
+				spec);
+			return (-1);
+		}
+		strcpy(sun.sun_path, spec);
+
+		/** only ever remove a socket, never a file */
+		if (lstat(spec, &sb) == 0 && S_ISSOCK(sb.st_mode))
+			(void) unlink(spec);
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				0);
+		if (fd >= 0 && bind(fd, (struct sockaddr *) &sun,
+				sizeof(sun)) < 0) {
+			(void) close(fd);
+			fd = -1;
+		}
+		sv->sv_unixsocket = (fd >= 0);
+	}
+
+	if (fd < 0 || listen(fd, SERVER_BACKLOG) < 0) {
+		fprintf(sv->sv_logfp, "Cannot listen on '%s' : %s\n",
+			spec, strerror(errno));
+		if (fd >= 0)
+			(void) close(fd);
+		return (-1);
+	}
+	return fd;
+}
+
+
+/**
+ * Find a served image by the name it was given, or failing that by
+ * the last part of its path
+ */
+static struct serverImage *
+serverFindImage(struct server *sv, const char *name)
+{
+	const char *base;
+	int i;
+
+	for (i = 0; i < sv->sv_nimages; i++) {
+		if (strcmp(sv->sv_images[i].si_image, name) == 0)
+			return &sv->sv_images[i];
+	}
+	for (i = 0; i < sv->sv_nimages; i++) {
+		base = strrchr(sv->sv_images[i].si_image, '/');
+		if (base != NULL && strcmp(base + 1, name) == 0)
+			return &sv->sv_images[i];
+	}
+	return NULL;
+}
+
+
+/**
+ * Unmount idle images, least recently used first, until the mounts
+ * together hold no more than the cap.  Mounts with sessions running
+ * on them are never evicted, so the cap can be exceeded while they
+ * are in use.
+ */
+static void
+serverEvict(struct server *sv)
+{
+	struct serverImage *si, *victim;
+	size_t used;
+	int i;
+
+	if (sv->sv_cfg->sc_memcap == 0)
+		return;
+
+	for (;;) {
+		used = 0;
+		victim = NULL;
+		for (i = 0; i < sv->sv_nimages; i++) {
+			si = &sv->sv_images[i];
+			if (si->si_fs == NULL)
+				continue;
+			used += fat12fsMemoryUsage(si->si_fs);
+			if (si->si_nclients == 0 && (victim == NULL
+					|| si->si_lastused < victim->si_lastused))
+				victim = si;
+		}
+		if (used <= sv->sv_cfg->sc_memcap || victim == NULL)
+			return;
+
+		fprintf(sv->sv_logfp, "Evicting '%s' (%lu bytes resident)\n",
+			victim->si_image, (unsigned long) used);
+		fat12fsUmount(victim->si_fs);
+		victim->si_fs = NULL;
+	}
+}
+
+
+/**
+ * Add output to what is waiting to go to a client
+ */
+static int
+serverQueue(struct serverClient *cl, const char *data, size_t n)
+{
+	char *grown;
+
+	if (n == 0)
+		return 0;
+
+	/** move what is left to the front before growing */
+	if (cl->cl_outoff > 0) {
+		memmove(cl->cl_out, cl->cl_out + cl->cl_outoff,
+				cl->cl_outlen - cl->cl_outoff);
+		cl->cl_outlen -= cl->cl_outoff;
+		cl->cl_outoff = 0;
+	}
+	grown = (char *) realloc(cl->cl_out, cl->cl_outlen + n);
+	if (grown == NULL)
+		return (-1);
+	cl->cl_out = grown;
+	memcpy(cl->cl_out + cl->cl_outlen, data, n);
+	cl->cl_outlen += n;
+	return 0;
+}
+
+
+/**
+ * Send a client as much of its output as it will take without
+ * blocking; returns (-1) if the connection has failed
+ */
+static int
+serverFlush(struct serverClient *cl)
+{
+	ssize_t n;
+
+	while (cl->cl_outoff < cl->cl_outlen) {
+		n = send(cl->cl_fd, cl->cl_out + cl->cl_outoff,
+				cl->cl_outlen - cl->cl_outoff, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return (-1);
+		}
+		cl->cl_outoff += (size_t) n;
+	}
+	if (cl->cl_outoff == cl->cl_outlen) {
+		cl->cl_outoff = 0;
+		cl->cl_outlen = 0;
+	}
+	return 0;
+}
+
+
+/**
+ * Start a client's session on an image, mounting it first if it is
+ * not already resident
+ */
+static int
+serverOpenSession(struct server *sv, struct serverClient *cl,
+		struct serverImage *si, FILE *efp)
+{
+	struct fat12fs_options opts = si->si_opts;
+	struct commandConfig cfg = si->si_cfg;
+
+	if (si->si_fs == NULL) {
+		opts.mo_logfp = sv->sv_logfp;
+		si->si_fs = fat12fsMountOpts(si->si_image, &opts);
+		if (si->si_fs == NULL) {
+			fprintf(efp, "Cannot mount filesystem in '%s'\n",
+				si->si_image);
+			return (-1);
+		}
+	}
+
+	cfg.cc_errfp = sv->sv_logfp;
+	cfg.cc_traceName = si->si_image;
+	cfg.cc_noHostFiles = 1;
+	if (commandSessionInit(&cl->cl_session, si->si_fs, &cfg) < 0) {
+		fprintf(efp, "Cannot start a session on '%s'\n",
+			si->si_image);
+		return (-1);
+	}
+	cl->cl_image = si;
+	si->si_nclients++;
+	si->si_lastused = ++sv->sv_tick;
+	return 0;
+}
+
+
+/**
+ * End a client's session, if it has one, sending it the session's
+ * latency histograms if it was keeping them.  The mount is left
+ * resident.
+ */
+static void
+serverCloseSession(struct server *sv, struct serverClient *cl)
+{
+	char *out = NULL;
+	size_t outlen = 0;
+	FILE *mfp;
+
+	if (cl->cl_image == NULL)
+		return;
+
+	mfp = open_memstream(&out, &outlen);
+	commandSessionEnd(&cl->cl_session, (mfp != NULL) ? mfp : sv->sv_logfp);
+	if (mfp != NULL) {
+		fclose(mfp);
+		(void) serverQueue(cl, out, outlen);
+		free(out);
+	}
+
+	cl->cl_image->si_nclients--;
+	cl->cl_image->si_lastused = ++sv->sv_tick;
+	cl->cl_image = NULL;
+}
+
+
+/**
+ * Run one line from a client, with all it prints (diagnostics too)
+ * queued for the client in the order it was printed
+ */
+static void
+serverRunLine(struct server *sv, struct serverClient *cl, char *line)
+{
+	struct serverImage *si;
+	char copy[SERVER_LINELEN];
+	char *out = NULL;
+	size_t outlen = 0;
+	char *tokenState;
+	char *command, *name;
+	FILE *mfp;
+
+	mfp = open_memstream(&out, &outlen);
+	if (mfp == NULL) {
+		cl->cl_closing = 1;
+		return;
+	}
+
+	strcpy(copy, line);
+	command = strtok_r(copy, " \t\r\n", &tokenState);
+	if (command == NULL) {
+		/** nothing was typed */
+
+	} else if (strcmp(command, "o") == 0) {
+		/** switch the client to another image */
+		name = strtok_r(NULL, " \t\r\n", &tokenState);
+		si = (name == NULL) ? NULL : serverFindImage(sv, name);
+		if (name == NULL) {
+			fprintf(mfp, "Need <image>\n");
+		} else if (si == NULL) {
+			fprintf(mfp, "No image '%s' is served\n", name);
+		} else {
+			fclose(mfp);
+			(void) serverQueue(cl, out, outlen);
+			free(out);
+			serverCloseSession(sv, cl);
+
+			out = NULL;
+			outlen = 0;
+			mfp = open_memstream(&out, &outlen);
+			if (mfp == NULL) {
+				cl->cl_closing = 1;
+				return;
+			}
+			if (serverOpenSession(sv, cl, si, mfp) == 0)
+				fprintf(mfp, "Opened '%s'\n", si->si_image);
+		}
+
+	} else if (cl->cl_image != NULL || serverOpenSession(sv, cl,
+			&sv->sv_images[0], mfp) == 0) {
+		/** an ordinary command, in the client's session */
+		if (commandSessionLine(&cl->cl_session, line, mfp, mfp))
+			cl->cl_closing = 1;
+		cl->cl_image->si_lastused = ++sv->sv_tick;
+	}
+
+	fclose(mfp);
+	(void) serverQueue(cl, out, outlen);
+	free(out);
+
+	if (cl->cl_closing)
+		serverCloseSession(sv, cl);
+	serverEvict(sv);
+}
+
+
+/**
+ * Run whatever whole lines a client has sent, for as long as its
+ * output is not backed up; what is left over at the end of its input
+ * is run as a line of its own, as fgets() would return it
+ */
+static void
+serverRunInput(struct server *sv, struct serverClient *cl)
+{
+	char line[SERVER_LINELEN];
+	char *nl;
+	size_t n;
+
+	while (!cl->cl_closing && cl->cl_inlen > 0
+			&& cl->cl_outlen - cl->cl_outoff < SERVER_OUTMAX) {
+		nl = (char *) memchr(cl->cl_in, '\n', cl->cl_inlen);
+		if (nl != NULL) {
+			n = (size_t) (nl - cl->cl_in) + 1;
+		} else if (cl->cl_eof || cl->cl_inlen == SERVER_LINELEN - 1) {
+			n = cl->cl_inlen;
+		} else {
+			break;
+		}
+
+		memcpy(line, cl->cl_in, n);
+		line[n] = '\0';
+		cl->cl_inlen -= n;
+		memmove(cl->cl_in, cl->cl_in + n, cl->cl_inlen);
+
+		serverRunLine(sv, cl, line);
+	}
+
+	/** a client which has said all it will is done with */
+	if (cl->cl_eof && cl->cl_inlen == 0 && !cl->cl_closing) {
+		cl->cl_closing = 1;
+		serverCloseSession(sv, cl);
+		serverEvict(sv);
+	}
+}
+
+
+static void
+serverDropClient(struct server *sv, struct serverClient *cl)
+{
+	serverCloseSession(sv, cl);
+	serverEvict(sv);
+
+	(void) epoll_ctl(sv->sv_epollfd, EPOLL_CTL_DEL, cl->cl_fd, NULL);
+	(void) close(cl->cl_fd);
+
+	if (cl->cl_prev != NULL)
+		cl->cl_prev->cl_next = cl->cl_next;
+	else
+		sv->sv_clients = cl->cl_next;
+	if (cl->cl_next != NULL)
+		cl->cl_next->cl_prev = cl->cl_prev;
+	sv->sv_nclients--;
+
+	free(cl->cl_out);
+	free(cl);
+}
+
+
+/**
+ * Take all the connections waiting on the listening socket
+ */
+static void
+serverAccept(struct server *sv)
+{
+	static const char busy[] = "Too many clients\n";
+	struct serverClient *cl;
+	struct epoll_event ev;
+	int fd;
+
+	for (;;) {
+		fd = accept4(sv->sv_listenfd, NULL, NULL,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				fprintf(sv->sv_logfp, "Cannot accept : %s\n",
+					strerror(errno));
+			return;
+		}
+
+		if (sv->sv_nclients >= sv->sv_cfg->sc_maxclients) {
+			(void) send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL);
+			(void) close(fd);
+			continue;
+		}
+
+		cl = (struct serverClient *) calloc(1, sizeof(*cl));
+		if (cl == NULL) {
+			(void) close(fd);
+			continue;
+		}
+		cl->cl_fd = fd;
+		cl->cl_events = EPOLLIN;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = cl->cl_events;
+		ev.data.ptr = cl;
+		if (epoll_ctl(sv->sv_epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			(void) close(fd);
+			free(cl);
+			continue;
+		}
+
+		cl->cl_next = sv->sv_clients;
+		if (sv->sv_clients != NULL)
+			sv->sv_clients->cl_prev = cl;
+		sv->sv_clients = cl;
+		sv->sv_nclients++;
+	}
+}
+
+
+/**
+ * Deal with whatever epoll has reported for a client: read what it
+ * has sent (one read per wakeup, so that no client can starve the
+ * others), run it, and send what that printed.  The client is then
+ * dropped if it is finished, or else asked for the events it needs
+ * next: input unless its output is backed up, and output whenever
+ * some is waiting.
+ */
+static void
+serverServe(struct server *sv, struct serverClient *cl, unsigned int events)
+{
+	struct epoll_event ev;
+	ssize_t n;
+
+	if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !cl->cl_eof
+			&& cl->cl_inlen < SERVER_LINELEN - 1) {
+		n = recv(cl->cl_fd, cl->cl_in + cl->cl_inlen,
+				SERVER_LINELEN - 1 - cl->cl_inlen, 0);
+		if (n > 0) {
+			cl->cl_inlen += (size_t) n;
+		} else if (n == 0) {
+			cl->cl_eof = 1;
+		} else if (errno != EINTR && errno != EAGAIN
+				&& errno != EWOULDBLOCK) {
+			serverDropClient(sv, cl);
+			return;
+		}
+	}
+
+	/** run what has come in, and again as backed up output drains */
+	do {
+		serverRunInput(sv, cl);
+		if (serverFlush(cl) < 0) {
+			serverDropClient(sv, cl);
+			return;
+		}
+	} while (!cl->cl_closing && cl->cl_outlen == 0
+			&& cl->cl_inlen > 0 && (cl->cl_eof
+				|| memchr(cl->cl_in, '\n', cl->cl_inlen)));
+
+	if (cl->cl_closing && cl->cl_outlen == 0) {
+		serverDropClient(sv, cl);
+		return;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	if (!cl->cl_eof && !cl->cl_closing
+			&& cl->cl_outlen - cl->cl_outoff < SERVER_OUTMAX)
+		ev.events |= EPOLLIN;
+	if (cl->cl_outlen > cl->cl_outoff)
+		ev.events |= EPOLLOUT;
+	if (ev.events != cl->cl_events) {
+		ev.data.ptr = cl;
+		(void) epoll_ctl(sv->sv_epollfd, EPOLL_CTL_MOD, cl->cl_fd, &ev);
+		cl->cl_events = ev.events;
+	}
+}
+
+
+/**
+ * Serve the images until interrupted or terminated: listen as the
+ * configuration says, and run every client's commands against the
+ * pool of mounts.  On the way out every session is ended and every
+ * image unmounted.
+ *
+ * Returns 0 after a clean shutdown, or (-1) if the server could not
+ * be started
+ */
+int
+serverRun(const struct serverConfig *sc,
+		struct serverImage *images, int nimages)
+{
+	struct epoll_event events[SERVER_NEVENTS];
+	struct epoll_event ev;
+	struct sigaction sa;
+	struct server sv;
+	int i, n;
+
+	memset(&sv, 0, sizeof(sv));
+	sv.sv_cfg = sc;
+	sv.sv_logfp = (sc->sc_logfp != NULL) ? sc->sc_logfp : stderr;
+	sv.sv_images = images;
+	sv.sv_nimages = nimages;
+	if (nimages < 1 || sc->sc_listen == NULL)
+		return (-1);
+
+	sv.sv_listenfd = serverListen(&sv, sc->sc_listen);
+	if (sv.sv_listenfd < 0)
+		return (-1);
+	sv.sv_epollfd = epoll_create1(EPOLL_CLOEXEC);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (sv.sv_epollfd < 0 || epoll_ctl(sv.sv_epollfd, EPOLL_CTL_ADD,
+			sv.sv_listenfd, &ev) < 0) {
+		fprintf(sv.sv_logfp, "Cannot set up epoll : %s\n",
+			strerror(errno));
+		(void) close(sv.sv_listenfd);
+		return (-1);
+	}
+
+	/** stop cleanly on a signal; a lost client only fails its send */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = serverSignal;
+	sigemptyset(&sa.sa_mask);
+	(void) sigaction(SIGINT, &sa, NULL);
+	(void) sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	(void) sigaction(SIGPIPE, &sa, NULL);
+
+	fprintf(sv.sv_logfp, "Serving %d image%s on '%s'\n",
+		nimages, (nimages == 1) ? "" : "s", sc->sc_listen);
+	fflush(sv.sv_logfp);
+
+	while (!serverStopping) {
+		n = epoll_wait(sv.sv_epollfd, events, SERVER_NEVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(sv.sv_logfp, "Cannot wait for clients : %s\n",
+				strerror(errno));
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL)
+				serverAccept(&sv);
+			else
+				serverServe(&sv, (struct serverClient *)
+					events[i].data.ptr, events[i].events);
+		}
+		fflush(sv.sv_logfp);
+	}
+
+	while (sv.sv_clients != NULL)
+		serverDropClient(&sv, sv.sv_clients);
+	for (i = 0; i < nimages; i++) {
+		if (images[i].si_fs != NULL) {
+			fat12fsUmount(images[i].si_fs);
+			images[i].si_fs = NULL;
+		}
+	}
+	(void) close(sv.sv_epollfd);
+	(void) close(sv.sv_listenfd);
+	if (sv.sv_unixsocket)
+		(void) unlink(sc->sc_listen);
+	fprintf(sv.sv_logfp, "Server stopped\n");
+	return 0;
+}
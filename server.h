@@ -0,0 +1,47 @@
+#ifndef	__SERVER_HEADER__
+#define	__SERVER_HEADER__
+
+#include <stddef.h>
+#include "fat12fs.h"
+#include "commands.h"
+
+/** most clients served at once, unless told otherwise */
+#define	SERVER_MAXCLIENTS	256
+
+/** longest command line a client may send; longer ones are split */
+#define	SERVER_LINELEN		1024
+
+/** output queued for a client beyond which its input is left unread */
+#define	SERVER_OUTMAX		(4 * 1024 * 1024)
+
+/**
+ * An image the server will serve, with the settings it is mounted
+ * and run with, and its place in the pool: mounted on the first
+ * command sent to it, and kept mounted until evicted
+ */
+typedef struct serverImage {
+	const char *si_image;		/* image file, and the name "o" takes */
+	struct fat12fs_options si_opts;
+	struct commandConfig si_cfg;
+
+	struct fat12fs *si_fs;		/* the mount, or NULL if not resident */
+	int si_nclients;		/* sessions running against it */
+	unsigned long si_lastused;	/* server tick of its last command */
+} serverImage;
+
+/**
+ * How the server listens, and what it may keep; fill in with
+ * defaultServerConfig()
+ */
+typedef struct serverConfig {
+	const char *sc_listen;	/* "host:port" for TCP, else a socket path */
+	size_t sc_memcap;	/* most bytes idle mounts may hold, 0 for any */
+	int sc_maxclients;	/* clients served at once */
+	FILE *sc_logfp;		/* connections and mounts; NULL for stderr */
+} serverConfig;
+
+void defaultServerConfig(struct serverConfig *sc);
+int serverRun(const struct serverConfig *sc,
+		struct serverImage *images, int nimages);
+
+#endif /* __SERVER_HEADER__ */